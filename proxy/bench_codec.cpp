@@ -0,0 +1,541 @@
+#include "common.hpp"
+#include "encode.hpp"
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//standalone codec benchmark, one csv line per case
+//usage: ./bench_codec [-s sizes] [-k shapes] [-t threads] [-a aligns] [-e engines] [-r erasures] [-d seconds]
+//  -s 4K,64K,1M        chunk sizes
+//  -k 11:1:r,11:3:c    k:m:matrix, r for rs, c for cauchy
+//  -t 1,2              encoding threads, each with its own buffers
+//  -a 0,1,32           byte offset of every buffer from a 64 byte boundary
+//  -e encode,fixed    engines, see engines[] and decode_engines[]
+//  -r 1,2,3           lost data chunks of the global stripe, for the decode engines
+//  -d 0.2              seconds per case
+
+#define MAX_LIST 32
+//k + 2 * m buffers a thread, data, parity and the isa-l check
+#define MAX_VECTS 64
+
+//one way to get the parity of a stripe, all take the same codec
+struct engine
+{
+    const char *name;
+    void (*run)(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity);
+    int (*can)(struct ec_codec *codec); //NULL for every shape, cases it cannot run are left out
+};
+
+//what the proxy does on a full stripe
+static void run_encode(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    codec_encode(codec, len, data, parity);
+}
+
+//what the encode workers do, one chunk folded at a time
+static void run_update(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    for (int j = 0; j < codec->m; j++)
+        memset(parity[j], 0, len);
+    for (int c = 0; c < codec->k; c++)
+        codec_update(codec, len, c, data[c], parity);
+}
+
+//isa-l as it is, the reference
+static void run_isal(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    ec_encode_data(len, codec->k, codec->m, codec->encode_gftbl, data, parity);
+}
+
+//the fixed kernels of gf_kernel.hpp for these shapes, whatever this build codes with
+static const struct fixed_shape bench_shapes[] = {
+    FIXED_SHAPE(4, 2),
+    FIXED_SHAPE(6, 3),
+    FIXED_SHAPE(10, 4),
+    FIXED_SHAPE(15, 4),
+    FIXED_SHAPE(LK, LN - LK),
+    FIXED_SHAPE(GK, GN - GK),
+};
+static int has_avx2 = 0;
+
+static const struct fixed_shape *bench_fixed(struct ec_codec *codec)
+{
+    for (size_t i = 0; has_avx2 && i < sizeof(bench_shapes) / sizeof(bench_shapes[0]); i++)
+    {
+        if (bench_shapes[i].k == codec->k && bench_shapes[i].m == codec->m)
+            return &bench_shapes[i];
+    }
+    return NULL;
+}
+
+static int can_fixed(struct ec_codec *codec)
+{
+    return bench_fixed(codec) != NULL;
+}
+
+//k and m built in
+static void run_fixed(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    bench_fixed(codec)->encode(len, codec->encode_gftbl, data, parity);
+}
+
+static int can_generic(struct ec_codec *)
+{
+    return has_avx2;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//the kernel of fixed_kernel with k and m known only at run time, one parity row after the other
+__attribute__((target("avx2"))) static void run_generic(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    int k = codec->k, m = codec->m;
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        for (int j = 0; j < m; j++)
+        {
+            __m256i p = _mm256_setzero_si256();
+            for (int c = 0; c < k; c++)
+            {
+                __m256i d = _mm256_loadu_si256((const __m256i *)(data[c] + i));
+                __m256i lo = _mm256_and_si256(d, mask);
+                __m256i hi = _mm256_and_si256(_mm256_srli_epi64(d, 4), mask);
+                const unsigned char *t = codec->encode_gftbl + 32 * (j * k + c);
+                __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+                __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t + 16)));
+                p = _mm256_xor_si256(p, _mm256_xor_si256(_mm256_shuffle_epi8(tlo, lo), _mm256_shuffle_epi8(thi, hi)));
+            }
+            _mm256_storeu_si256((__m256i *)(parity[j] + i), p);
+        }
+    }
+    for (; i < len; i++)
+    {
+        for (int j = 0; j < m; j++)
+        {
+            unsigned char s = 0;
+            for (int c = 0; c < k; c++)
+                s ^= gf_tbl_mul(codec->encode_gftbl + 32 * (j * k + c), data[c][i]);
+            parity[j][i] = s;
+        }
+    }
+}
+#else
+static void run_generic(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    run_isal(codec, len, data, parity);
+}
+#endif
+
+static const struct engine engines[] = {
+    {"encode", run_encode, NULL},
+    {"update", run_update, NULL},
+    {"isal", run_isal, NULL},
+    {"generic", run_generic, can_generic},
+    {"fixed", run_fixed, can_fixed},
+};
+
+//a global repair as global_repair runs it: decode rows of the erasure, then every surviving chunk
+//of the global stripe folded in, k is G_POSITIONS and m the lost data chunks in the csv
+struct decode_engine
+{
+    const char *name;
+    int cold; //cached rows are dropped before each repair, so decode_get builds them
+};
+
+static const struct decode_engine decode_engines[] = {
+    {"decode", 0},
+    {"decode-cold", 1},
+};
+
+struct shape
+{
+    int k;
+    int m;
+    enum matrix_type type;
+};
+
+struct bench_case
+{
+    const struct engine *engine;
+    struct ec_codec *codec;
+    int len;
+    int align;
+    double seconds;
+
+    //decode engines only
+    const struct decode_engine *decode;
+    int nerr;
+
+    //per thread result
+    long stripes;
+    double elapsed;
+    uint64_t cycles;
+    int ok;
+};
+
+static pthread_barrier_t start_barrier;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_case *bc = (struct bench_case *)arg;
+    int k = bc->codec->k, m = bc->codec->m, len = bc->len;
+
+    //every buffer starts align bytes after a 64 byte boundary
+    unsigned char *base[MAX_VECTS];
+    unsigned char *data[MAX_VECTS], *parity[MAX_VECTS], *check[MAX_VECTS];
+    unsigned int seed = (unsigned int)(uintptr_t)bc;
+    int n = 0;
+    for (int i = 0; i < k + 2 * m; i++)
+    {
+        base[n] = (unsigned char *)aligned_alloc(64, (len + bc->align + 63) / 64 * 64);
+        unsigned char *p = base[n++] + bc->align;
+        if (i < k)
+        {
+            data[i] = p;
+            for (int j = 0; j < len; j++)
+                p[j] = rand_r(&seed);
+        }
+        else if (i < k + m)
+            parity[i - k] = p;
+        else
+            check[i - k - m] = p;
+    }
+
+    //same parity as isa-l, once before timing
+    bc->engine->run(bc->codec, len, data, parity);
+    ec_encode_data(len, k, m, bc->codec->encode_gftbl, data, check);
+    bc->ok = 1;
+    for (int j = 0; j < m; j++)
+        bc->ok &= (memcmp(parity[j], check[j], len) == 0);
+
+    pthread_barrier_wait(&start_barrier);
+
+    long stripes = 0;
+    double begin = now(), end = begin;
+    uint64_t c0 = cycles_now();
+    while (end - begin < bc->seconds)
+    {
+        for (int r = 0; r < 16; r++)
+            bc->engine->run(bc->codec, len, data, parity);
+        stripes += 16;
+        end = now();
+    }
+    bc->cycles = cycles_now() - c0;
+    bc->stripes = stripes;
+    bc->elapsed = end - begin;
+
+    for (int i = 0; i < n; i++)
+        free(base[i]);
+    return NULL;
+}
+
+static void *decode_thread(void *arg)
+{
+    struct bench_case *bc = (struct bench_case *)arg;
+    int len = bc->len, nerr = bc->nerr, group = 0;
+
+    //the global stripe of data group 0: data, global parities, then the local parity of the group
+    unsigned char *base[G_POSITIONS + G_MAX_ERASED];
+    unsigned char *chunk[G_POSITIONS], *rows[G_MAX_ERASED];
+    unsigned int seed = (unsigned int)(uintptr_t)bc;
+    for (int i = 0; i < G_POSITIONS + nerr; i++)
+    {
+        base[i] = (unsigned char *)aligned_alloc(64, (len + bc->align + 63) / 64 * 64);
+        unsigned char *p = base[i] + bc->align;
+        if (i < G_POSITIONS)
+            chunk[i] = p;
+        else
+            rows[i - G_POSITIONS] = p;
+        for (int j = 0; i < GK && j < len; j++)
+            p[j] = rand_r(&seed);
+    }
+    codec_encode(codec_get(GK, GN - GK, CAUCHY_MATRIX), len, chunk, &chunk[GK]);
+    int first = group * LK, last = (group + 1) * LK < GK ? (group + 1) * LK : GK;
+    xor_gen(last - first, len, &chunk[first], chunk[GN]);
+
+    //the first nerr data chunks are lost
+    uint64_t erasure = 0;
+    for (int i = 0; i < nerr; i++)
+        erasure |= 1ull << i;
+
+    pthread_barrier_wait(&start_barrier);
+
+    long repairs = 0;
+    double begin = now(), end = begin;
+    uint64_t c0 = cycles_now();
+    bc->ok = 1;
+    while (end - begin < bc->seconds && bc->ok)
+    {
+        for (int r = 0; r < 16; r++)
+        {
+            if (bc->decode->cold)
+                decode_flush();
+            struct decode_entry *entry = decode_get(erasure, group);
+            if (entry == NULL)
+            {
+                bc->ok = 0;
+                break;
+            }
+            for (int i = 0; i < nerr; i++)
+                memset(rows[i], 0, len);
+            for (int pos = 0; pos < G_POSITIONS; pos++)
+            {
+                if (!((erasure >> pos) & 1))
+                    g_middle_update(entry, pos, chunk[pos], rows);
+            }
+            decode_put(entry);
+            repairs++;
+        }
+        end = now();
+    }
+    bc->cycles = cycles_now() - c0;
+    bc->stripes = repairs;
+    bc->elapsed = end - begin;
+
+    //the rows of the last repair are the lost chunks, in the order of their positions
+    for (int i = 0; i < nerr && bc->ok; i++)
+        bc->ok &= (memcmp(rows[i], chunk[i], len) == 0);
+
+    for (int i = 0; i < G_POSITIONS + nerr; i++)
+        free(base[i]);
+    return NULL;
+}
+
+//nt threads of fn on copies of one, one csv line for all, a stripe is worth per_stripe chunks of bytes
+static void run_case(FILE *csv, const char *name, const char *matrix, int k, int m, const struct bench_case *one, int nt,
+                     void *(*fn)(void *arg), int per_stripe)
+{
+    struct bench_case *bc = (struct bench_case *)calloc(nt, sizeof(struct bench_case));
+    pthread_t *tid = (pthread_t *)calloc(nt, sizeof(pthread_t));
+    pthread_barrier_init(&start_barrier, NULL, nt);
+    for (int i = 0; i < nt; i++)
+    {
+        bc[i] = *one;
+        pthread_create(&tid[i], NULL, fn, &bc[i]);
+    }
+
+    long stripes = 0;
+    double elapsed = 0;
+    uint64_t cycles = 0;
+    int ok = 1;
+    for (int i = 0; i < nt; i++)
+    {
+        pthread_join(tid[i], NULL);
+        stripes += bc[i].stripes;
+        cycles += bc[i].cycles;
+        ok &= bc[i].ok;
+        if (bc[i].elapsed > elapsed)
+            elapsed = bc[i].elapsed;
+    }
+    pthread_barrier_destroy(&start_barrier);
+
+    double bytes = (double)stripes * per_stripe * one->len;
+    fprintf(csv, "%s,%s,%d,%d,%d,%d,%d,%d,%ld,%.1f,%.3f,%.3f\n", name, matrix, k, m, one->len, nt, one->align, ok, stripes,
+            elapsed * 1e9 * nt / stripes, bytes / elapsed / 1e9, cycles / bytes);
+    fflush(csv);
+
+    free(bc);
+    free(tid);
+}
+
+//"a,b,c" ==> items, split in place, count of items
+static int split_list(char *s, char **items)
+{
+    int n = 0;
+    char *save = NULL;
+    for (char *t = strtok_r(s, ",", &save); t && n < MAX_LIST; t = strtok_r(NULL, ",", &save))
+        items[n++] = t;
+    return n;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s 4K,64K,1M] [-k %d:%d:r,%d:%d:c] [-t 1,2] [-a 0,1,32] [-e encode,update,isal,generic,fixed,decode,decode-cold] [-r 1,2,3] [-d 0.2]\n",
+            name, LK, LN - LK, GK, GN - GK);
+}
+
+int main(int argc, char *argv[])
+{
+    char sizes_s[256] = "4K,64K,1M";
+    char shapes_s[256];
+    char threads_s[256] = "1";
+    char aligns_s[256] = "0,1,32";
+    char engines_s[256] = "encode,update,isal,generic,fixed,decode,decode-cold";
+    char erasures_s[256] = "1,2,3";
+    double seconds = 0.2;
+
+    //the shapes of this build first
+    sprintf(shapes_s, "%d:%d:r,%d:%d:c,%d:1:r,4:2:c,6:3:c,10:4:c,15:4:c", LK, LN - LK, GK, GN - GK, NODE);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:k:t:a:e:r:d:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            snprintf(sizes_s, sizeof(sizes_s), "%s", optarg);
+            break;
+        case 'k':
+            snprintf(shapes_s, sizeof(shapes_s), "%s", optarg);
+            break;
+        case 't':
+            snprintf(threads_s, sizeof(threads_s), "%s", optarg);
+            break;
+        case 'a':
+            snprintf(aligns_s, sizeof(aligns_s), "%s", optarg);
+            break;
+        case 'e':
+            snprintf(engines_s, sizeof(engines_s), "%s", optarg);
+            break;
+        case 'r':
+            snprintf(erasures_s, sizeof(erasures_s), "%s", optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    char *items[MAX_LIST];
+    int sizes[MAX_LIST], nsizes = split_list(sizes_s, items);
+    for (int i = 0; i < nsizes; i++)
+    {
+        //any size goes here, not only chunk sizes the proxy takes
+        char *end;
+        long v = strtol(items[i], &end, 10);
+        if (*end == 'K' || *end == 'k')
+            v <<= 10;
+        else if (*end == 'M' || *end == 'm')
+            v <<= 20;
+        if (v <= 0)
+        {
+            fprintf(stderr, "bad size %s\n", items[i]);
+            return 1;
+        }
+        sizes[i] = (int)v;
+    }
+
+    struct shape shapes[MAX_LIST];
+    int nshapes = split_list(shapes_s, items);
+    for (int i = 0; i < nshapes; i++)
+    {
+        char t = 'c';
+        if (sscanf(items[i], "%d:%d:%c", &shapes[i].k, &shapes[i].m, &t) < 2 || shapes[i].k < 1 || shapes[i].m < 1 || shapes[i].k + 2 * shapes[i].m > MAX_VECTS || shapes[i].k + shapes[i].m > 255)
+        {
+            fprintf(stderr, "bad shape %s\n", items[i]);
+            return 1;
+        }
+        shapes[i].type = (t == 'r') ? RS_MATRIX : CAUCHY_MATRIX;
+    }
+
+    int threads[MAX_LIST], nthreads = split_list(threads_s, items);
+    for (int i = 0; i < nthreads; i++)
+        threads[i] = atoi(items[i]) > 0 ? atoi(items[i]) : 1;
+
+    int aligns[MAX_LIST], naligns = split_list(aligns_s, items);
+    for (int i = 0; i < naligns; i++)
+        aligns[i] = atoi(items[i]) & 63;
+
+    const struct engine *use[MAX_LIST];
+    const struct decode_engine *use_decode[MAX_LIST];
+    int nengines = 0, ndecodes = 0, nitems = split_list(engines_s, items);
+    for (int i = 0; i < nitems; i++)
+    {
+        for (size_t j = 0; j < sizeof(engines) / sizeof(engines[0]); j++)
+        {
+            if (strcmp(items[i], engines[j].name) == 0)
+                use[nengines++] = &engines[j];
+        }
+        for (size_t j = 0; j < sizeof(decode_engines) / sizeof(decode_engines[0]); j++)
+        {
+            if (strcmp(items[i], decode_engines[j].name) == 0)
+                use_decode[ndecodes++] = &decode_engines[j];
+        }
+    }
+
+    int erasures[MAX_LIST], nerasures = split_list(erasures_s, items);
+    for (int i = 0; i < nerasures; i++)
+    {
+        erasures[i] = atoi(items[i]);
+        if (erasures[i] < 1 || erasures[i] > G_MAX_ERASED)
+        {
+            fprintf(stderr, "bad erasure count %s, 1 to %d\n", items[i], G_MAX_ERASED);
+            return 1;
+        }
+    }
+
+    //log_drain writes the VERBOSE lines to stdout, keep stdout for the csv only
+    FILE *csv = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    codec_init();
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    has_avx2 = __builtin_cpu_supports("avx2") && bench_shapes[0].encode != NULL;
+#endif
+
+    fprintf(csv, "engine,matrix,k,m,chunk_size,threads,align,ok,stripes,ns_per_stripe,gbps,cycles_per_byte\n");
+    for (int s = 0; s < nshapes; s++)
+    {
+        struct ec_codec *codec = codec_get(shapes[s].k, shapes[s].m, shapes[s].type);
+        for (int e = 0; e < nengines; e++)
+            for (int z = 0; z < nsizes && (use[e]->can == NULL || use[e]->can(codec)); z++)
+                for (int t = 0; t < nthreads; t++)
+                    for (int a = 0; a < naligns; a++)
+                    {
+                        struct bench_case one = {};
+                        one.engine = use[e];
+                        one.codec = codec;
+                        one.len = sizes[z];
+                        one.align = aligns[a];
+                        one.seconds = seconds;
+                        //data bytes coded, the parity written is not counted
+                        run_case(csv, use[e]->name, shapes[s].type == RS_MATRIX ? "rs" : "cauchy", codec->k, codec->m,
+                                 &one, threads[t], bench_thread, codec->k);
+                    }
+    }
+
+    for (int e = 0; e < ndecodes; e++)
+        for (int r = 0; r < nerasures; r++)
+            for (int z = 0; z < nsizes; z++)
+                for (int t = 0; t < nthreads; t++)
+                    for (int a = 0; a < naligns; a++)
+                    {
+                        //g_middle_update codes chunk_size bytes
+                        chunk_size = sizes[z];
+                        struct bench_case one = {};
+                        one.decode = use_decode[e];
+                        one.nerr = erasures[r];
+                        one.len = sizes[z];
+                        one.align = aligns[a];
+                        one.seconds = seconds;
+                        //bytes rebuilt
+                        run_case(csv, use_decode[e]->name, "cauchy", G_POSITIONS, erasures[r], &one, threads[t], decode_thread, erasures[r]);
+                    }
+
+    codec_destroy();
+    fclose(csv);
+    return 0;
+}
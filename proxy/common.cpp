@@ -1,27 +1,65 @@
 #include "common.hpp"
 
-//pthread_mutex_t mutex;
-//LEVEL is high, show less
-void vlog(int l, const char *fmt, ...)
+uint32_t chunk_size = CHUNK_SIZE;
+
+void print_err(const char *str, int err_no)
 {
-    if (LEVEL <= l)
-    {
-        va_list ap;
-        char msg[1024];
+    printf("%s :%s\n", str, strerror(err_no));
+    //_exit(-1);
+}
 
-        va_start(ap, fmt);
-        vsnprintf(msg, sizeof(msg), fmt, ap);
-        va_end(ap);
+ssize_t recv_all(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = recv(fd, (char *)buf + done, len - done, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    return done;
+}
 
-        fprintf(stdout, "%s", msg);
+ssize_t send_all(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
     }
-    //pthread_mutex_unlock(&mutex);
+    return done;
 }
 
-void print_err(const char *str, int err_no)
+uint32_t parse_chunk_size(const char *s)
 {
-    printf("%s :%s\n", str, strerror(err_no));
-    //_exit(-1);
+    char *end = NULL;
+    unsigned long size = strtoul(s, &end, 10);
+    if (end == s)
+        return 0;
+    if (*end == 'k' || *end == 'K')
+    {
+        size = size << 10;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size = size << 20;
+        end++;
+    }
+    if (*end != '\0')
+        return 0;
+    //power of two in [CHUNK_SIZE_MIN, CHUNK_SIZE_MAX], as ECHash_set_chunk_size wants
+    if (size < CHUNK_SIZE_MIN || size > CHUNK_SIZE_MAX || (size & (size - 1)))
+        return 0;
+    return (uint32_t)size;
 }
 
 int offset(int g, int r, int index_tag, int gid_self)
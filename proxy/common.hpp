@@ -16,6 +16,7 @@
 #include <sys/time.h>
 
 #include <isa-l.h>
+#include "log.hpp"
 #include <libmemcached/memcached.h>
 
 #define GROUP 2
@@ -33,6 +34,8 @@
 
 #define COMMAND_SIZE 100
 // #define BUFFER_SIZE 4096
+//messages with the requestor, a key and a value of up to a chunk with the words around them
+#define REQUEST_SIZE (chunk_size + 2 * COMMAND_SIZE)
 #define LISTEN_NUM 200
 
 //server
@@ -41,14 +44,31 @@
 #define P_PORT 20001 // proxy port
 
 //encode=2, repair=3, update=4
+#ifndef LEVEL
 #define LEVEL 1 //high -> less
+#endif
 
-//need l LEVEL, can show the
-void vlog(int l, const char *fmt, ...);
-#define VERBOSE(l, fmt, arg...) vlog((int)l, fmt, ##arg);
+//size of data and parity chunks, CHUNK_SIZE unless -c is given, same on every proxy
+extern uint32_t chunk_size;
+
+//need l >= LEVEL, can show the
+//the level is a constant, so a filtered VERBOSE leaves no code behind
+#define VERBOSE(l, fmt, arg...)        \
+    do                                 \
+    {                                  \
+        if (LEVEL <= (int)(l))         \
+            log_write(fmt, ##arg);     \
+    } while (0)
 
 void print_err(const char *str, int err_no);
 
+//loop until len bytes are moved, -1 on error or closed peer
+ssize_t recv_all(int fd, void *buf, size_t len);
+ssize_t send_all(int fd, const void *buf, size_t len);
+
+//"64K", "1M", "65536" ==> bytes, 0 if it is not a valid chunk size
+uint32_t parse_chunk_size(const char *s);
+
 int offset(int g, int r, int index_tag, int gid_self);
 
 double timeval_diff(struct timeval *start, struct timeval *end);
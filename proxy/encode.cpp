@@ -1,50 +1,292 @@
 #include "encode.hpp"
 
-//unsigned char encode_gftbl[32 * LK * (LN - LK)];
-//unsigned char encode_matrix[LN * LK];
-
-char *transfer_ustr_to_str(unsigned char *s, uint32_t len)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//all codecs built so far, only appended
+static struct ec_codec *codec_list = NULL;
+static pthread_mutex_t codec_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//the shapes used in the data path, set in codec_init
+static struct ec_codec *local_codec = NULL;
+static struct ec_codec *global_codec = NULL;
+static struct ec_codec *middle_codec = NULL;
+static struct ec_codec *decode_codec = NULL;
+
+//decode rows of the global stripe by erasure pattern, most recently used first
+static struct decode_entry *decode_cache = NULL;
+static int decode_cache_num = 0;
+static pthread_mutex_t decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//xor kernels, all take any len, the vector ones finish the tail with the scalar loop
+static void xor_gen_scalar(int vects, int len, unsigned char **data, unsigned char *parity, int start)
 {
-    char *p = (char *)malloc(sizeof(char) * len);
-    for (uint32_t i = 0; i < len; i++)
+    int i = start;
+    for (; i + 8 <= len; i += 8)
     {
-        if (s[i] <= 127)
-            p[i] = s[i];
-        else
-            p[i] = s[i] - 256;
+        uint64_t x, y;
+        memcpy(&x, data[0] + i, 8);
+        for (int v = 1; v < vects; v++)
+        {
+            memcpy(&y, data[v] + i, 8);
+            x ^= y;
+        }
+        memcpy(parity + i, &x, 8);
+    }
+    for (; i < len; i++)
+    {
+        unsigned char x = data[0][i];
+        for (int v = 1; v < vects; v++)
+            x ^= data[v][i];
+        parity[i] = x;
     }
-    return p;
 }
 
-unsigned char *transfer_str_to_ustr(char *s, uint32_t len)
+static void xor_gen_base(int vects, int len, unsigned char **data, unsigned char *parity)
 {
-    unsigned char *p = (unsigned char *)malloc(sizeof(char) * len);
+    xor_gen_scalar(vects, len, data, parity, 0);
+}
 
-    for (uint32_t i = 0; i < len; i++)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void xor_gen_sse2(int vects, int len, unsigned char **data, unsigned char *parity)
+{
+    int i = 0;
+    for (; i + 64 <= len; i += 64)
     {
-        if (s[i] >= 0)
+        __m128i x0 = _mm_loadu_si128((const __m128i *)(data[0] + i));
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(data[0] + i + 16));
+        __m128i x2 = _mm_loadu_si128((const __m128i *)(data[0] + i + 32));
+        __m128i x3 = _mm_loadu_si128((const __m128i *)(data[0] + i + 48));
+        for (int v = 1; v < vects; v++)
         {
-            p[i] = s[i];
+            x0 = _mm_xor_si128(x0, _mm_loadu_si128((const __m128i *)(data[v] + i)));
+            x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)(data[v] + i + 16)));
+            x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i *)(data[v] + i + 32)));
+            x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i *)(data[v] + i + 48)));
         }
-        else
+        _mm_storeu_si128((__m128i *)(parity + i), x0);
+        _mm_storeu_si128((__m128i *)(parity + i + 16), x1);
+        _mm_storeu_si128((__m128i *)(parity + i + 32), x2);
+        _mm_storeu_si128((__m128i *)(parity + i + 48), x3);
+    }
+    xor_gen_scalar(vects, len, data, parity, i);
+}
+
+__attribute__((target("avx2"))) static void xor_gen_avx2(int vects, int len, unsigned char **data, unsigned char *parity)
+{
+    int i = 0;
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(data[0] + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(data[0] + i + 32));
+        __m256i x2 = _mm256_loadu_si256((const __m256i *)(data[0] + i + 64));
+        __m256i x3 = _mm256_loadu_si256((const __m256i *)(data[0] + i + 96));
+        for (int v = 1; v < vects; v++)
         {
-            p[i] = s[i] + 256;
+            x0 = _mm256_xor_si256(x0, _mm256_loadu_si256((const __m256i *)(data[v] + i)));
+            x1 = _mm256_xor_si256(x1, _mm256_loadu_si256((const __m256i *)(data[v] + i + 32)));
+            x2 = _mm256_xor_si256(x2, _mm256_loadu_si256((const __m256i *)(data[v] + i + 64)));
+            x3 = _mm256_xor_si256(x3, _mm256_loadu_si256((const __m256i *)(data[v] + i + 96)));
         }
+        _mm256_storeu_si256((__m256i *)(parity + i), x0);
+        _mm256_storeu_si256((__m256i *)(parity + i + 32), x1);
+        _mm256_storeu_si256((__m256i *)(parity + i + 64), x2);
+        _mm256_storeu_si256((__m256i *)(parity + i + 96), x3);
+    }
+    xor_gen_scalar(vects, len, data, parity, i);
+}
+#endif
+
+//shapes of this build, coded by the fixed kernels when the cpu has avx2, others go through isa-l
+static const struct fixed_shape fixed_shapes[] = {
+    FIXED_SHAPE(LK, LN - LK),
+    FIXED_SHAPE(GK, GN - GK),
+    FIXED_SHAPE(NODE, 1),
+    FIXED_SHAPE(RACK - 1 + NODE - 1, 1),
+    //global repair, one row per erased data chunk
+    FIXED_SHAPE(G_POSITIONS, 1),
+    FIXED_SHAPE(G_POSITIONS, 2),
+    FIXED_SHAPE(G_POSITIONS, 3),
+    FIXED_SHAPE(G_POSITIONS, 4),
+};
+static int fixed_enabled = 0;
+
+static const struct fixed_shape *fixed_find(int k, int m)
+{
+    if (!fixed_enabled)
+        return NULL;
+    for (size_t i = 0; i < sizeof(fixed_shapes) / sizeof(fixed_shapes[0]); i++)
+    {
+        if (fixed_shapes[i].k == k && fixed_shapes[i].m == m)
+            return &fixed_shapes[i];
+    }
+    return NULL;
+}
+
+static void (*xor_gen_fn)(int vects, int len, unsigned char **data, unsigned char *parity) = xor_gen_base;
+
+static void xor_gen_select()
+{
+    const char *name = "scalar";
+    xor_gen_fn = xor_gen_base;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        xor_gen_fn = xor_gen_avx2;
+        name = "avx2";
+        fixed_enabled = (fixed_shapes[0].encode != NULL);
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        xor_gen_fn = xor_gen_sse2;
+        name = "sse2";
+    }
+#endif
+    VERBOSE(1, "xor_gen uses %s, fixed shape kernels are %s\n", name, fixed_enabled ? "on" : "off");
+}
+
+void xor_gen(int vects, int len, unsigned char **data, unsigned char *parity)
+{
+    xor_gen_fn(vects, len, data, parity);
+}
+
+static struct ec_codec *codec_create(int k, int m, enum matrix_type type)
+{
+    struct ec_codec *codec = (struct ec_codec *)calloc(1, sizeof(struct ec_codec));
+    codec->k = k;
+    codec->m = m;
+    codec->type = type;
+    codec->encode_matrix = (unsigned char *)calloc((k + m) * k, sizeof(unsigned char));
+    codec->encode_gftbl = (unsigned char *)calloc(32 * k * m, sizeof(unsigned char));
+
+    if (type == RS_MATRIX)
+        gf_gen_rs_matrix(codec->encode_matrix, k + m, k);
+    else
+        gf_gen_cauchy1_matrix(codec->encode_matrix, k + m, k);
+
+    ec_init_tables(k, m, &(codec->encode_matrix[k * k]), codec->encode_gftbl);
+
+    //gf_gen_rs_matrix starts its parity rows with all ones, so RS(k+1,k) is plain xor
+    codec->xor_only = (m == 1);
+    for (int j = 0; j < k && codec->xor_only; j++)
+    {
+        if (codec->encode_matrix[k * k + j] != 1)
+            codec->xor_only = 0;
     }
+
+    const struct fixed_shape *shape = fixed_find(k, m);
+    if (shape)
+    {
+        codec->fixed_encode = shape->encode;
+        codec->fixed_update = shape->update;
+    }
+
+    VERBOSE(1, "codec (k=%d, m=%d, %s%s) is ready\n", k, m, type == RS_MATRIX ? "rs" : "cauchy", codec->xor_only ? ", xor" : (codec->fixed_encode ? ", fixed" : ""));
+    return codec;
+}
+
+struct ec_codec *codec_get(int k, int m, enum matrix_type type)
+{
+    pthread_mutex_lock(&codec_mutex);
+    struct ec_codec *p = codec_list;
+    while (p)
+    {
+        if (p->k == k && p->m == m && p->type == type)
+            break;
+        p = p->next;
+    }
+    if (p == NULL)
+    {
+        p = codec_create(k, m, type);
+        p->next = codec_list;
+        codec_list = p;
+    }
+    pthread_mutex_unlock(&codec_mutex);
+
     return p;
 }
 
+void codec_init()
+{
+    xor_gen_select();
+    local_codec = codec_get(LK, LN - LK, RS_MATRIX);
+    global_codec = codec_get(GK, GN - GK, CAUCHY_MATRIX);
+    middle_codec = codec_get(NODE, 1, RS_MATRIX);
+    decode_codec = codec_get(RACK - 1 + NODE - 1, 1, RS_MATRIX);
+}
+
+void codec_destroy()
+{
+    pthread_mutex_lock(&codec_mutex);
+    struct ec_codec *p = codec_list, *q = p;
+    while (p)
+    {
+        q = p;
+        p = p->next;
+        free(q->encode_matrix);
+        free(q->encode_gftbl);
+        free(q);
+    }
+    codec_list = NULL;
+    local_codec = global_codec = middle_codec = decode_codec = NULL;
+    pthread_mutex_unlock(&codec_mutex);
+
+    pthread_mutex_lock(&decode_mutex);
+    struct decode_entry *e = decode_cache, *f = e;
+    while (e)
+    {
+        f = e;
+        e = e->next;
+        free(f->coef);
+        free(f->gftbl);
+        free(f);
+    }
+    decode_cache = NULL;
+    decode_cache_num = 0;
+    pthread_mutex_unlock(&decode_mutex);
+}
+
+void codec_encode(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity)
+{
+    if (codec->xor_only)
+        xor_gen(codec->k, len, data, parity[0]);
+    else if (codec->fixed_encode)
+        codec->fixed_encode(len, codec->encode_gftbl, data, parity);
+    else
+        ec_encode_data(len, codec->k, codec->m, codec->encode_gftbl, data, parity);
+}
+
+void codec_update(struct ec_codec *codec, int len, int vec_i, unsigned char *data, unsigned char **parity)
+{
+    if (codec->xor_only)
+    {
+        //every coefficient is 1, parity ^= data
+        unsigned char *v[2] = {parity[0], data};
+        xor_gen(2, len, v, parity[0]);
+    }
+    else if (codec->fixed_update)
+        codec->fixed_update(len, vec_i, codec->encode_gftbl, data, parity);
+    else
+        ec_encode_data_update(len, codec->k, codec->m, vec_i, codec->encode_gftbl, data, parity);
+}
+
+#ifdef DEBUG
+//the scans are skipped too when LEVEL filters the output
 void show_local(unsigned char *parity)
 {
+    if (LEVEL > 2)
+        return;
     VERBOSE(2, "\n**********Local Parity start**********\n");
-    int r = 0, i = 0;
-    for (int i = 0; i < CHUNK_SIZE;)
+    uint32_t r = 0;
+    for (uint32_t i = 0; i < chunk_size;)
     {
-        while (parity[i + r] == parity[i] && i + r < CHUNK_SIZE)
+        while (i + r < chunk_size && parity[i + r] == parity[i])
         {
             r++;
         }
-        VERBOSE(2, "[%d] for %d times;\n", parity[i], r);
+        VERBOSE(2, "[%d] for %u times;\n", parity[i], r);
         i = i + r;
         r = 0;
     }
@@ -53,18 +295,20 @@ void show_local(unsigned char *parity)
 
 void show_global(unsigned char **parity)
 {
+    if (LEVEL > 2)
+        return;
     VERBOSE(2, "\n**********Global Parity start**********\n"); 
     for (int i = 0; i < GN - GK; i++)
     {
         VERBOSE(2, "\n***g-%d head***\n", i);
-        int r = 0, j = 0;
-        for (int j = 0; j < CHUNK_SIZE;)
+        uint32_t r = 0;
+        for (uint32_t j = 0; j < chunk_size;)
         {
-            while (parity[i][j + r] == parity[i][j] && j + r < CHUNK_SIZE)
+            while (j + r < chunk_size && parity[i][j + r] == parity[i][j])
             {
                 r++;
             }
-            VERBOSE(2, "[%d] for %d times;\n", parity[i][j], r);
+            VERBOSE(2, "[%d] for %u times;\n", parity[i][j], r);
             j = j + r;
             r = 0;
         }
@@ -76,6 +320,8 @@ void show_global(unsigned char **parity)
 
 void show_data(char *data, int len, const char *s)
 {
+    if (LEVEL > 4)
+        return;
     VERBOSE(4, "\n**********%s start**********\n", s);
     int r = 0, i = 0;
     for (i = 0; i < len;)
@@ -94,12 +340,14 @@ void show_data(char *data, int len, const char *s)
 
 void show_unsigned_data(unsigned char *data, int len, const char *s)
 {
+    if (LEVEL > 4)
+        return;
     VERBOSE(4, "\n**********%s start**********\n", s);
-    int r = 0, i = 0;
-    for (int i = 0; i < CHUNK_SIZE;)
+    int r = 0;
+    for (int i = 0; i < len;)
     {
         r = 0;
-        while (data[i + r] == data[i] && i + r < CHUNK_SIZE)
+        while (data[i + r] == data[i] && i + r < len)
         {
             r++;
         }
@@ -109,34 +357,21 @@ void show_unsigned_data(unsigned char *data, int len, const char *s)
     }
     VERBOSE(4, "*********%s end**********\n", s);
 }
+#endif
 
-unsigned char *l_encode(struct local_encode_st *encode)
+void l_encode_update(struct local_encode_st *encode, int vec_i, unsigned char *data)
 {
-    unsigned char encode_gftbl[32 * LK * (LN - LK)];
-    unsigned char encode_matrix[LN * LK];
-
-    gf_gen_rs_matrix(encode_matrix, LN, LK);
-
-    // printf("encode_matrix:\n");
-    // for(int i=0;i<LN*LK;)
-    // {
-    //     printf("%3d ",encode_matrix[i]);
-    //     i++;
-    //     if(i%LK==0)
-    //         printf("\n");
-    // }
-
-    ec_init_tables(LK, LN - LK, &(encode_matrix[LK * LK]), encode_gftbl);
-    ec_encode_data(CHUNK_SIZE, LK, LN - LK, encode_gftbl, encode->source_data, &(encode->source_data[LK]));
+    codec_update(local_codec, chunk_size, vec_i, data, encode->parity);
+}
 
-    // for(int i=0;i<LK;i++)
-    // {
-    //     //if(encode->source_data[i])
-    //     //    printf("i=%d is OK\n",i);
-    //     show_data(transfer_ustr_to_str(encode->source_data[i],CHUNK_SIZE),CHUNK_SIZE, "Local data");
-    // }
+void g_encode_update(struct global_encode_st *encode, int vec_i, unsigned char *data)
+{
+    codec_update(global_codec, chunk_size, vec_i, data, encode->parity);
+}
 
-    unsigned char *parity = encode->source_data[LK];
+unsigned char *l_encode(struct local_encode_st *encode)
+{
+    unsigned char *parity = encode->parity[0];
     show_local(parity);
 
     return parity;
@@ -144,31 +379,7 @@ unsigned char *l_encode(struct local_encode_st *encode)
 
 unsigned char **g_encode(struct global_encode_st *encode)
 {
-    unsigned char encode_gftbl[32 * GK * (GN - GK)];
-    unsigned char encode_matrix[GN * GK];
-
-    // printf("encode_matrix:\n");
-    // for(int i=0;i<GN*GK;)
-    // {
-    //     printf("%3d ",encode_matrix[i]);
-    //     i++;
-    //     if(i%GK==0)
-    //         printf("\n");
-    // }
-
-    gf_gen_cauchy1_matrix(encode_matrix, GN, GK);
-
-    ec_init_tables(GK, GN - GK, &(encode_matrix[GK * GK]), encode_gftbl);
-    ec_encode_data(CHUNK_SIZE, GK, GN - GK, encode_gftbl, encode->source_data, &(encode->source_data[GK]));
-
-    // for(int i=0;i<GK;i++)
-    // {
-    //     //if(encode->source_data[i])
-    //      //  printf("i=%d is OK\n",i);
-    //     show_data(transfer_ustr_to_str(encode->source_data[i],CHUNK_SIZE),CHUNK_SIZE, "Global data");
-    // }
-
-    unsigned char **parity = &(encode->source_data[GK]);
+    unsigned char **parity = encode->parity;
     show_global(parity);
 
     return parity;
@@ -177,62 +388,236 @@ unsigned char **g_encode(struct global_encode_st *encode)
 //local repair middle result
 unsigned char *l_middle(unsigned char **data, int count)
 {
-    int k = count;
-    int n = count + 1;
-    unsigned char encode_gftbl[32 * k * (n - k)];
-    unsigned char encode_matrix[n * k];
+    struct ec_codec *codec = middle_codec;
+    if (codec == NULL || codec->k != count)
+        codec = codec_get(count, 1, RS_MATRIX);
 
-    gf_gen_rs_matrix(encode_matrix, n, k);
-
-    ec_init_tables(k, n - k, &(encode_matrix[k * k]), encode_gftbl);
-    ec_encode_data(CHUNK_SIZE, k, n - k, encode_gftbl, data, &(data[k]));
+    int k = count;
+    codec_encode(codec, chunk_size, data, &(data[k]));
 
     for (int i = 0; i < k; i++)
     {
-        //if(encode->source_data[i])
-        //    printf("i=%d is OK\n",i);
-        show_unsigned_data(data[i], CHUNK_SIZE, "Middle data");
+        show_unsigned_data(data[i], chunk_size, "Middle data");
     }
 
     unsigned char *middle = data[k];
-    show_unsigned_data(middle, CHUNK_SIZE, "Middle");
+    show_unsigned_data(middle, chunk_size, "Middle");
 
     return middle;
 }
 
 unsigned char *l_decode(unsigned char **data, unsigned char *recovery, int need)
 {
+    struct ec_codec *codec = decode_codec;
+    if (codec == NULL || codec->k != need)
+        codec = codec_get(need, 1, RS_MATRIX);
+
     int k = need;
-    int n = need + 1;
+    codec_encode(codec, chunk_size, data, &(recovery));
 
-    unsigned char encode_gftbl[32 * k * (n - k)];
-    unsigned char encode_matrix[n * k];
+    for (int i = 0; i < k; i++)
+    {
+        show_unsigned_data(data[i], chunk_size, "Repair data");
+    }
 
-    gf_gen_rs_matrix(encode_matrix, n, k);
+    //show recovery data
+    show_unsigned_data(recovery, chunk_size, "Recovery");
 
-    // printf("decode_matrix:\n");
-    // for(int i=0;i<n*k;)
-    // {
-    //     printf("%3d ",encode_matrix[i]);
-    //     i++;
-    //     if(i%k==0)
-    //         printf("\n");
-    // }
+    return recovery;
+}
 
-    ec_init_tables(k, n - k, &(encode_matrix[k * k]), encode_gftbl);
-    ec_encode_data(CHUNK_SIZE, k, n - k, encode_gftbl, data, &(recovery));
+//invert the rows of the surviving positions, keep the rows giving the erased data chunks
+static struct decode_entry *decode_create(uint64_t erasure, int group)
+{
+    int erased[G_MAX_ERASED], nerr = 0;
+    for (int pos = 0; pos < GK; pos++)
+    {
+        if ((erasure >> pos) & 1)
+        {
+            if (nerr == G_MAX_ERASED)
+                return NULL;
+            erased[nerr++] = pos;
+        }
+    }
+    if (nerr == 0)
+        return NULL;
+
+    //generator, row pos gives the chunk at pos from the data chunks
+    unsigned char gen[G_POSITIONS * GK];
+    memset(gen, 0, sizeof(gen));
+    for (int i = 0; i < GK; i++)
+        gen[i * GK + i] = 1;
+    memcpy(&gen[GK * GK], &(global_codec->encode_matrix[GK * GK]), (GN - GK) * GK);
+    for (int j = group * LK; j < (group + 1) * LK && j < GK; j++)
+        gen[GN * GK + j] = 1;
+
+    //the surviving data chunks are always used
+    int rows[GK], n = 0;
+    for (int pos = 0; pos < GK; pos++)
+    {
+        if (!((erasure >> pos) & 1))
+            rows[n++] = pos;
+    }
 
-    for (int i = 0; i < k; i++)
+    //parity candidates, the local parity first as it is the nearest one
+    int cand[G_MAX_ERASED], ncand = 0;
+    if (!((erasure >> GN) & 1))
+        cand[ncand++] = GN;
+    for (int pos = GK; pos < GN; pos++)
     {
-        //if(encode->source_data[i])
-        //    printf("i=%d is OK\n",i);
-        show_unsigned_data(data[i], CHUNK_SIZE, "Repair data");
+        if (!((erasure >> pos) & 1))
+            cand[ncand++] = pos;
     }
 
-    //show recovery data
-    show_unsigned_data(recovery, CHUNK_SIZE, "Recovery");
+    //take nerr of the candidates, the first set with an invertible matrix
+    unsigned char b[GK * GK], inv[GK * GK];
+    int found = 0;
+    for (int mask = 0; mask < (1 << ncand) && !found; mask++)
+    {
+        if (__builtin_popcount(mask) != nerr)
+            continue;
+        int m = n;
+        for (int c = 0; c < ncand; c++)
+        {
+            if ((mask >> c) & 1)
+                rows[m++] = cand[c];
+        }
+        for (int i = 0; i < GK; i++)
+            memcpy(&b[i * GK], &gen[rows[i] * GK], GK);
+        found = (gf_invert_matrix(b, inv, GK) == 0);
+    }
+    if (!found)
+        return NULL;
+
+    struct decode_entry *entry = (struct decode_entry *)calloc(1, sizeof(struct decode_entry));
+    entry->erasure = erasure;
+    entry->group = group;
+    entry->nerr = nerr;
+    memcpy(entry->erased, erased, sizeof(erased));
+    entry->coef = (unsigned char *)calloc(nerr * G_POSITIONS, sizeof(unsigned char));
+    entry->gftbl = (unsigned char *)calloc(32 * G_POSITIONS * nerr, sizeof(unsigned char));
+
+    for (int i = 0; i < nerr; i++)
+    {
+        for (int j = 0; j < GK; j++)
+            entry->coef[i * G_POSITIONS + rows[j]] = inv[erased[i] * GK + j];
+    }
+    ec_init_tables(G_POSITIONS, nerr, entry->coef, entry->gftbl);
+    const struct fixed_shape *shape = fixed_find(G_POSITIONS, nerr);
+    if (shape)
+        entry->fixed_update = shape->update;
 
-    //printf("%s", transfer_ustr_to_str(recovery,CHUNK_SIZE));
+    VERBOSE(3, "decode rows for erasure=%llx, group=%d, nerr=%d are ready\n", (unsigned long long)erasure, group, nerr);
+    return entry;
+}
 
-    return recovery;
-}
\ No newline at end of file
+struct decode_entry *decode_get(uint64_t erasure, int group)
+{
+    pthread_mutex_lock(&decode_mutex);
+    struct decode_entry *p = decode_cache;
+    while (p)
+    {
+        if (p->erasure == erasure && p->group == group)
+            break;
+        p = p->next;
+    }
+
+    if (p)
+    {
+        //move to the head
+        if (p != decode_cache)
+        {
+            p->prev->next = p->next;
+            if (p->next)
+                p->next->prev = p->prev;
+            p->prev = NULL;
+            p->next = decode_cache;
+            decode_cache->prev = p;
+            decode_cache = p;
+        }
+    }
+    else
+    {
+        p = decode_create(erasure, group);
+        if (p)
+        {
+            p->next = decode_cache;
+            if (decode_cache)
+                decode_cache->prev = p;
+            decode_cache = p;
+            decode_cache_num++;
+
+            //drop the least recently used entry nobody holds
+            if (decode_cache_num > DECODE_CACHE_SIZE)
+            {
+                struct decode_entry *q = decode_cache;
+                while (q->next)
+                    q = q->next;
+                while (q && q->ref > 0)
+                    q = q->prev;
+                if (q && q != p)
+                {
+                    q->prev->next = q->next;
+                    if (q->next)
+                        q->next->prev = q->prev;
+                    free(q->coef);
+                    free(q->gftbl);
+                    free(q);
+                    decode_cache_num--;
+                }
+            }
+        }
+    }
+
+    if (p)
+        p->ref++;
+    pthread_mutex_unlock(&decode_mutex);
+
+    return p;
+}
+
+void decode_put(struct decode_entry *entry)
+{
+    pthread_mutex_lock(&decode_mutex);
+    entry->ref--;
+    pthread_mutex_unlock(&decode_mutex);
+}
+
+void decode_flush()
+{
+    pthread_mutex_lock(&decode_mutex);
+    struct decode_entry *e = decode_cache;
+    while (e)
+    {
+        struct decode_entry *f = e;
+        e = e->next;
+        if (f->ref > 0)
+            continue;
+        if (f->prev)
+            f->prev->next = f->next;
+        else
+            decode_cache = f->next;
+        if (f->next)
+            f->next->prev = f->prev;
+        free(f->coef);
+        free(f->gftbl);
+        free(f);
+        decode_cache_num--;
+    }
+    pthread_mutex_unlock(&decode_mutex);
+}
+
+void g_middle_update(struct decode_entry *entry, int pos, unsigned char *chunk, unsigned char **middle)
+{
+    //not a chosen survivor, nothing to add
+    int used = 0;
+    for (int i = 0; i < entry->nerr && !used; i++)
+        used = (entry->coef[i * G_POSITIONS + pos] != 0);
+    if (!used)
+        return;
+
+    if (entry->fixed_update)
+        entry->fixed_update(chunk_size, pos, entry->gftbl, chunk, middle);
+    else
+        ec_encode_data_update(chunk_size, G_POSITIONS, entry->nerr, pos, entry->gftbl, chunk, middle);
+}
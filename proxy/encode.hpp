@@ -1,15 +1,28 @@
 #pragma once
 
 #include "common.hpp"
+#include "gf_kernel.hpp"
 
-//calloc when it inits
+//a delta of a chunk whose stripe has no parity stored yet, folded in before it is
+struct stripe_delta
+{
+    int vec_i;            //column of the updated chunk
+    unsigned char *delta; //chunk_size, a slab reference
+    struct stripe_delta *next;
+};
+
+//only the parity of an open stripe is kept, each data chunk is folded into it on arrival
+//parity calloc when it inits, the stripe stays listed until its parity is stored
 struct local_encode_st
 {
     //encode with the order of gid rid index_tag chunkID
     //here, all chunk are same, so rid and index_tag
-    int num;
+    int num;  //data chunks folded into parity
+    int slot; //data chunks given a position, slot >= num
     uint32_t chunk_id;
-    unsigned char *source_data[LN];
+    pthread_mutex_t fold_mutex; //serialize the folds into parity
+    unsigned char *parity[LN - LK];
+    struct stripe_delta *deltas; //under the list's mutex
 
     struct local_encode_st *next;
 };
@@ -18,16 +31,80 @@ struct global_encode_st
 {
     //encode with the order of gid rid index_tag chunkID
     int num;
+    int slot;
     uint32_t chunk_id;
-    unsigned char *source_data[GN];
+    pthread_mutex_t fold_mutex;
+    unsigned char *parity[GN - GK];
+    struct stripe_delta *deltas;
 
     struct global_encode_st *next;
 };
 
-char *transfer_ustr_to_str(unsigned char *s, uint32_t len);
+enum matrix_type
+{
+    RS_MATRIX,
+    CAUCHY_MATRIX
+};
 
-unsigned char *transfer_str_to_ustr(char *s, uint32_t len);
+//precomputed tables for one (k, m, matrix type), built once and shared by all threads
+//read only after codec_get returns it, so no lock is needed to encode with it
+struct ec_codec
+{
+    int k;
+    int m;
+    enum matrix_type type;
+    unsigned char *encode_matrix; //(k + m) * k
+    unsigned char *encode_gftbl;  //32 * k * m
+    int xor_only;                 //single parity row of all ones, coded with xor_gen
+    fixed_encode_fn fixed_encode; //kernels with k and m built in, NULL to go through isa-l
+    fixed_update_fn fixed_update;
 
+    struct ec_codec *next;
+};
+
+//parity = data[0] ^ ... ^ data[vects - 1], best kernel for this cpu, picked in codec_init
+void xor_gen(int vects, int len, unsigned char **data, unsigned char *parity);
+
+//find the codec of (k, m, type), build it at the first time
+struct ec_codec *codec_get(int k, int m, enum matrix_type type);
+
+//build the codecs of local/global parity and local repair at startup
+void codec_init();
+
+void codec_destroy();
+
+//global stripe positions: GK data, then GN - GK global parities, then the local parity of one data group
+#define G_POSITIONS (GN + 1)
+static_assert(G_POSITIONS <= 64, "erasure bitmaps are 64 bit, one bit a global stripe position");
+//at most this many data chunks come back from one global repair
+#define G_MAX_ERASED (GN - GK + 1)
+#define DECODE_CACHE_SIZE 64
+
+//decode rows of one erasure pattern of the global stripe, kept in an lru list
+//erased data chunk erased[i] = sum of coef[i * G_POSITIONS + pos] * chunk at pos, over the surviving positions
+struct decode_entry
+{
+    uint64_t erasure; //bit pos set if the chunk at pos is lost
+    int group;        //data group whose local parity sits at position GN
+    int nerr;         //erased data chunks
+    int erased[G_MAX_ERASED];
+    unsigned char *coef;   //nerr * G_POSITIONS
+    unsigned char *gftbl;  //32 * G_POSITIONS * nerr
+    fixed_update_fn fixed_update;
+    int ref;               //users of this entry, only unused ones are evicted
+
+    struct decode_entry *prev;
+    struct decode_entry *next;
+};
+
+//parity[0..m-1] = encode(data[0..k-1])
+void codec_encode(struct ec_codec *codec, int len, unsigned char **data, unsigned char **parity);
+
+//parity[0..m-1] ^= contribution of data as the vec_i-th data chunk, parity starts from zero
+void codec_update(struct ec_codec *codec, int len, int vec_i, unsigned char *data, unsigned char **parity);
+
+//chunk dumps, run lengths of the bytes, only in DEBUG builds
+#ifdef DEBUG
 void show_local(unsigned char *parity);
 
 void show_global(unsigned char **parity);
@@ -35,11 +112,38 @@ void show_global(unsigned char **parity);
 void show_data(char *data, int len, const char *s);
 
 void show_unsigned_data(unsigned char *data, int len, const char *s);
+#else
+static inline void show_local(unsigned char *) {}
+
+static inline void show_global(unsigned char **) {}
+
+static inline void show_data(char *, int, const char *) {}
 
+static inline void show_unsigned_data(unsigned char *, int, const char *) {}
+#endif
+
+//fold the vec_i-th data chunk into the stripe parity
+void l_encode_update(struct local_encode_st *encode, int vec_i, unsigned char *data);
+
+void g_encode_update(struct global_encode_st *encode, int vec_i, unsigned char *data);
+
+//parity of a stripe that has all data chunks folded
 unsigned char *l_encode(struct local_encode_st *encode);
 
 unsigned char **g_encode(struct global_encode_st *encode);
 
 unsigned char *l_middle(unsigned char **data, int count);
 
-unsigned char *l_decode(unsigned char **data, unsigned char *recovery, int need);
\ No newline at end of file
+unsigned char *l_decode(unsigned char **data, unsigned char *recovery, int need);
+
+//decode rows for an erasure pattern, from the cache or built by inverting the surviving rows
+//NULL if the pattern can not be decoded, give it back by decode_put
+struct decode_entry *decode_get(uint64_t erasure, int group);
+
+void decode_put(struct decode_entry *entry);
+
+//drop the cached decode rows nobody holds, the next decode_get builds them again
+void decode_flush();
+
+//middle[0..nerr-1] += the share of the chunk at pos, middle starts from zero
+void g_middle_update(struct decode_entry *entry, int pos, unsigned char *chunk, unsigned char **middle);
\ No newline at end of file
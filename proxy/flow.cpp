@@ -0,0 +1,102 @@
+#include "flow.hpp"
+
+int flow_class(int opcode)
+{
+    switch (opcode)
+    {
+    case OP_L_ENCODE:
+    case OP_G_ENCODE:
+    case OP_L_UPDATE:
+    case OP_G_UPDATE:
+        return FLOW_ENCODE;
+    case OP_L_MIDDLE:
+    case OP_G_MIDDLE:
+        return FLOW_REPAIR;
+    }
+    return -1;
+}
+
+void flow_out_init(struct flow_out *f)
+{
+    memset(f, 0, sizeof(*f));
+    pthread_mutex_init(&f->mutex, NULL);
+    for (int c = 0; c < FLOW_CLASSES; c++)
+        f->credits[c] = FLOW_WINDOW;
+}
+
+int flow_send(struct flow_out *f, struct peer_queue *q, const struct frame_head *head, void *payload)
+{
+    int c = flow_class(head->opcode);
+    if (c < 0)
+        return peer_send(q, head, payload);
+
+    //queued under the lock, so a frame never passes one that waited
+    pthread_mutex_lock(&f->mutex);
+    int ret = 0;
+    if (f->credits[c] > 0 && f->first[c] == NULL)
+    {
+        f->credits[c]--;
+        ret = peer_send(q, head, payload);
+    }
+    else
+    {
+        struct flow_parked *p = (struct flow_parked *)malloc(sizeof(struct flow_parked));
+        p->q = q;
+        p->head = *head;
+        p->payload = payload;
+        p->next = NULL;
+        if (f->last[c])
+            f->last[c]->next = p;
+        else
+            f->first[c] = p;
+        f->last[c] = p;
+        f->parked[c]++;
+        f->stalls[c]++;
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return ret;
+}
+
+void flow_credit(struct flow_out *f, int cls, int n)
+{
+    pthread_mutex_lock(&f->mutex);
+    f->credits[cls] += n;
+    while (f->credits[cls] > 0 && f->first[cls])
+    {
+        struct flow_parked *p = f->first[cls];
+        f->first[cls] = p->next;
+        if (f->first[cls] == NULL)
+            f->last[cls] = NULL;
+        f->parked[cls]--;
+        f->credits[cls]--;
+
+        //credited frames fit in the peer queue (FLOW_QUEUED), so this never waits for room
+        if (-1 == peer_send(p->q, &p->head, p->payload))
+            VERBOSE(1, "\t[%s frame to (%d,%d) dropped]\n", frame_op_name(p->head.opcode), p->q->gid, p->q->rid);
+        free(p);
+    }
+    pthread_mutex_unlock(&f->mutex);
+}
+
+int flow_parked(struct flow_out *f, int cls)
+{
+    return __atomic_load_n(&f->parked[cls], __ATOMIC_RELAXED);
+}
+
+int flow_drained(struct flow_in *f, int cls)
+{
+    if (__atomic_add_fetch(&f->owed[cls], 1, __ATOMIC_SEQ_CST) < FLOW_GRANT)
+        return 0;
+    //of two drains that both see enough, one takes them all
+    return __atomic_exchange_n(&f->owed[cls], 0, __ATOMIC_SEQ_CST);
+}
+
+int flow_owed(struct flow_in *f, int cls)
+{
+    return __atomic_exchange_n(&f->owed[cls], 0, __ATOMIC_SEQ_CST);
+}
+
+void flow_owe(struct flow_in *f, int cls, int n)
+{
+    __atomic_add_fetch(&f->owed[cls], n, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.hpp"
+#include "peer.hpp"
+
+//credit based flow control of chunk frames between proxies, per peer and traffic class
+//a sender starts with FLOW_WINDOW credits a class to each peer and spends one a chunk frame,
+//frames without a credit wait here, not in the peer queue, so a slow peer never holds up the
+//thread that sends to the others. The receiver gives credits back with OP_CREDIT once it has
+//drained the frames: folded into the parity, taken by the repair, applied by the update
+//small frames (gather requests, acks, credits) go without credits
+
+enum flow_class
+{
+    FLOW_ENCODE = 0, //data chunks to the parity racks and their deltas, in one line
+    FLOW_REPAIR,     //repair shares
+    FLOW_CLASSES
+};
+
+#define FLOW_WINDOW 16  //chunk frames a class in flight to a peer
+#define FLOW_GRANT 4    //drained frames a receiver gives back in one OP_CREDIT
+#define FLOW_PARKED 256 //frames a class waits for credits before requests are turned away
+
+//payload bytes the credits of a peer let into its queue, the largest frame carries GN - GK + 1 chunks
+#define FLOW_QUEUED(chunk) ((size_t)FLOW_CLASSES * FLOW_WINDOW * (GN - GK + 1) * (chunk))
+
+//frame waiting for a credit
+struct flow_parked
+{
+    struct peer_queue *q;
+    struct frame_head head;
+    void *payload;
+    struct flow_parked *next;
+};
+
+//sender side, one a peer
+struct flow_out
+{
+    pthread_mutex_t mutex;
+    int credits[FLOW_CLASSES];
+    struct flow_parked *first[FLOW_CLASSES];
+    struct flow_parked *last[FLOW_CLASSES];
+    int parked[FLOW_CLASSES];
+
+    //for logs
+    unsigned long stalls[FLOW_CLASSES]; //frames that had to wait
+};
+
+//receiver side, one a peer, drained frames not given back yet
+struct flow_in
+{
+    int owed[FLOW_CLASSES];
+};
+
+//class of a frame, -1 for the ones without credits
+int flow_class(int opcode);
+
+//FLOW_WINDOW credits of every class
+void flow_out_init(struct flow_out *f);
+
+//queue the frame on q (a queue of the peer) now if its class has a credit, else once credits come
+//never waits, 0, or -1 if the peer is broken and the frame is dropped
+int flow_send(struct flow_out *f, struct peer_queue *q, const struct frame_head *head, void *payload);
+
+//the peer gave n credits of cls back, frames waiting for them are queued
+//called on an io thread, it never waits for room once the peer queues hold FLOW_QUEUED more than PEER_QUEUED
+void flow_credit(struct flow_out *f, int cls, int n);
+
+//frames of cls waiting for credits
+int flow_parked(struct flow_out *f, int cls);
+
+//a frame of cls from the peer is drained, the credits to give back now, 0 until FLOW_GRANT are owed
+int flow_drained(struct flow_in *f, int cls);
+
+//credits owed to the peer that could not be given yet, taken
+int flow_owed(struct flow_in *f, int cls);
+
+//give n credits back later, the peer cannot be reached yet
+void flow_owe(struct flow_in *f, int cls, int n);
@@ -0,0 +1,199 @@
+#include "frame.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+//the head goes with the payload, at most this many payload parts
+#define FRAME_IOV_MAX 8
+
+static const char *op_names[OP_MAX] = {
+    "none",
+    "conn",
+    "l-encode",
+    "g-encode",
+    "l-gather-middle",
+    "g-gather-middle",
+    "l-middle",
+    "g-middle",
+    "l-update",
+    "g-update",
+    "ack-l-update",
+    "ack-g-update",
+    "set",
+    "get",
+    "update",
+    "reply",
+    "mset",
+    "mget",
+    "mupdate",
+    "batch-reply",
+    "credit",
+};
+
+const char *frame_op_name(int opcode)
+{
+    if (opcode < 0 || opcode >= OP_MAX)
+        return "unknown";
+    return op_names[opcode];
+}
+
+void frame_pack(const struct frame_head *head, unsigned char *out)
+{
+    uint32_t v;
+    out[0] = head->opcode;
+    out[1] = head->gid;
+    out[2] = head->rid;
+    out[3] = head->index_tag;
+    v = htonl(head->chunk_id);
+    memcpy(out + 4, &v, 4);
+    v = htonl(head->request_id);
+    memcpy(out + 8, &v, 4);
+    v = htonl(head->length);
+    memcpy(out + 12, &v, 4);
+}
+
+void frame_unpack(const unsigned char *in, struct frame_head *head)
+{
+    uint32_t v;
+    head->opcode = in[0];
+    head->gid = in[1];
+    head->rid = in[2];
+    head->index_tag = in[3];
+    memcpy(&v, in + 4, 4);
+    head->chunk_id = ntohl(v);
+    memcpy(&v, in + 8, 4);
+    head->request_id = ntohl(v);
+    memcpy(&v, in + 12, 4);
+    head->length = ntohl(v);
+}
+
+unsigned char *frame_entry_put(unsigned char *out, const struct frame_entry *e)
+{
+    uint16_t k = htons(e->key_length);
+    uint32_t v = htonl(e->value_length);
+    out[0] = e->status;
+    memcpy(out + 1, &k, 2);
+    memcpy(out + 3, &v, 4);
+    out += FRAME_ENTRY_HEAD;
+    if (e->key_length)
+        memcpy(out, e->key, e->key_length);
+    out += e->key_length;
+    if (e->value_length)
+        memcpy(out, e->value, e->value_length);
+    return out + e->value_length;
+}
+
+int frame_entry_next(const unsigned char **in, const unsigned char *end, struct frame_entry *e)
+{
+    const unsigned char *p = *in;
+    if (end - p < FRAME_ENTRY_HEAD)
+        return -1;
+    uint16_t k;
+    uint32_t v;
+    e->status = p[0];
+    memcpy(&k, p + 1, 2);
+    memcpy(&v, p + 3, 4);
+    e->key_length = ntohs(k);
+    e->value_length = ntohl(v);
+    p += FRAME_ENTRY_HEAD;
+    if ((size_t)(end - p) < (size_t)e->key_length + e->value_length)
+        return -1;
+    e->key = p;
+    e->value = p + e->key_length;
+    *in = p + e->key_length + e->value_length;
+    return 0;
+}
+
+int frame_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    //short writes move the window forward
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len)
+        {
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+int frame_sendv(int fd, const struct frame_head *head, const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 0 || iovcnt > FRAME_IOV_MAX)
+        return -1;
+
+    unsigned char raw[FRAME_HEAD_SIZE];
+    frame_pack(head, raw);
+
+    struct iovec vec[FRAME_IOV_MAX + 1];
+    vec[0].iov_base = raw;
+    vec[0].iov_len = FRAME_HEAD_SIZE;
+    for (int i = 0; i < iovcnt; i++)
+        vec[i + 1] = iov[i];
+
+    return frame_writev(fd, vec, iovcnt + 1);
+}
+
+int frame_send(int fd, const struct frame_head *head, const void *payload)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)payload;
+    iov.iov_len = head->length;
+    return frame_sendv(fd, head, &iov, head->length ? 1 : 0);
+}
+
+int frame_recv(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = recv(fd, (char *)buf + done, len - done, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+int frame_recv_head(int fd, struct frame_head *head)
+{
+    unsigned char raw[FRAME_HEAD_SIZE];
+    if (frame_recv(fd, raw, FRAME_HEAD_SIZE) == -1)
+        return -1;
+    frame_unpack(raw, head);
+    return 0;
+}
+
+int frame_skip(int fd, size_t len)
+{
+    char buf[4096];
+    while (len > 0)
+    {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (frame_recv(fd, buf, n) == -1)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
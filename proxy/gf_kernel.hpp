@@ -0,0 +1,128 @@
+#pragma once
+
+#include "common.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//gf(2^8) kernels with k and m fixed at compile time, for the shapes this build codes with
+//tables are the ones of ec_init_tables: 32 bytes for row j, column c at 32 * (j * k + c),
+//products of the low nibbles first, then of the high nibbles
+
+typedef void (*fixed_encode_fn)(int len, const unsigned char *gftbl, unsigned char **data, unsigned char **parity);
+typedef void (*fixed_update_fn)(int len, int vec_i, const unsigned char *gftbl, unsigned char *data, unsigned char **parity);
+
+static inline unsigned char gf_tbl_mul(const unsigned char *tbl, unsigned char d)
+{
+    return tbl[d & 0x0f] ^ tbl[16 + (d >> 4)];
+}
+
+template <int K, int M>
+struct fixed_kernel
+{
+    //parity[0..M-1] = data[0..K-1] coded by gftbl, bytes from start on
+    static void encode_tail(int start, int len, const unsigned char *gftbl, unsigned char **data, unsigned char **parity)
+    {
+        for (int i = start; i < len; i++)
+        {
+            unsigned char s[M] = {0};
+            for (int c = 0; c < K; c++)
+            {
+                unsigned char d = data[c][i];
+                for (int j = 0; j < M; j++)
+                    s[j] ^= gf_tbl_mul(gftbl + 32 * (j * K + c), d);
+            }
+            for (int j = 0; j < M; j++)
+                parity[j][i] = s[j];
+        }
+    }
+
+    static void update_tail(int start, int len, int vec_i, const unsigned char *gftbl, unsigned char *data, unsigned char **parity)
+    {
+        for (int i = start; i < len; i++)
+        {
+            for (int j = 0; j < M; j++)
+                parity[j][i] ^= gf_tbl_mul(gftbl + 32 * (j * K + vec_i), data[i]);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    //32 bytes a round, the M parity vectors stay in registers over all K data chunks
+    __attribute__((target("avx2"))) static void encode(int len, const unsigned char *gftbl, unsigned char **data, unsigned char **parity)
+    {
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+        int i = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i p[M];
+#pragma GCC unroll 16
+            for (int j = 0; j < M; j++)
+                p[j] = _mm256_setzero_si256();
+#pragma GCC unroll 32
+            for (int c = 0; c < K; c++)
+            {
+                __m256i d = _mm256_loadu_si256((const __m256i *)(data[c] + i));
+                __m256i lo = _mm256_and_si256(d, mask);
+                __m256i hi = _mm256_and_si256(_mm256_srli_epi64(d, 4), mask);
+#pragma GCC unroll 16
+                for (int j = 0; j < M; j++)
+                {
+                    const unsigned char *t = gftbl + 32 * (j * K + c);
+                    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+                    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t + 16)));
+                    p[j] = _mm256_xor_si256(p[j], _mm256_xor_si256(_mm256_shuffle_epi8(tlo, lo), _mm256_shuffle_epi8(thi, hi)));
+                }
+            }
+#pragma GCC unroll 16
+            for (int j = 0; j < M; j++)
+                _mm256_storeu_si256((__m256i *)(parity[j] + i), p[j]);
+        }
+        encode_tail(i, len, gftbl, data, parity);
+    }
+
+    //parity[0..M-1] ^= data as column vec_i, tables loaded once for the whole chunk
+    __attribute__((target("avx2"))) static void update(int len, int vec_i, const unsigned char *gftbl, unsigned char *data, unsigned char **parity)
+    {
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+        __m256i tlo[M], thi[M];
+#pragma GCC unroll 16
+        for (int j = 0; j < M; j++)
+        {
+            const unsigned char *t = gftbl + 32 * (j * K + vec_i);
+            tlo[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+            thi[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t + 16)));
+        }
+        int i = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i d = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i lo = _mm256_and_si256(d, mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi64(d, 4), mask);
+#pragma GCC unroll 16
+            for (int j = 0; j < M; j++)
+            {
+                __m256i x = _mm256_xor_si256(_mm256_shuffle_epi8(tlo[j], lo), _mm256_shuffle_epi8(thi[j], hi));
+                __m256i q = _mm256_loadu_si256((const __m256i *)(parity[j] + i));
+                _mm256_storeu_si256((__m256i *)(parity[j] + i), _mm256_xor_si256(q, x));
+            }
+        }
+        update_tail(i, len, vec_i, gftbl, data, parity);
+    }
+#endif
+};
+
+//one shape with its fixed kernels
+struct fixed_shape
+{
+    int k;
+    int m;
+    fixed_encode_fn encode;
+    fixed_update_fn update;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FIXED_SHAPE(k, m) {k, m, fixed_kernel<k, m>::encode, fixed_kernel<k, m>::update}
+#else
+#define FIXED_SHAPE(k, m) {k, m, NULL, NULL}
+#endif
@@ -0,0 +1,152 @@
+#include "log.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+//single producer, the owning thread, single consumer, whoever holds drain_mutex
+struct log_ring
+{
+    struct log_record rec[LOG_RING_SIZE];
+    uint32_t head; //next slot to write, only the owner moves it
+    uint32_t tail; //next slot to drain
+    unsigned long dropped;
+    unsigned long dropped_shown;
+    int released; //owner thread is gone, the ring goes to the next new thread once it is drained
+
+    struct log_ring *next;
+};
+
+static struct log_ring *ring_list = NULL;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static __thread struct log_ring *my_ring = NULL;
+
+static void *log_drain(void *)
+{
+    while (1)
+    {
+        log_flush();
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void log_release(void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+    __atomic_store_n(&ring->released, 1, __ATOMIC_RELEASE);
+}
+
+static void log_start()
+{
+    pthread_key_create(&ring_key, log_release);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&tid, &attr, log_drain, NULL);
+    pthread_attr_destroy(&attr);
+
+    //what is still in the rings at exit
+    atexit(log_flush);
+}
+
+static struct log_ring *ring_get()
+{
+    if (my_ring)
+        return my_ring;
+
+    pthread_once(&log_once, log_start);
+
+    pthread_mutex_lock(&ring_mutex);
+    struct log_ring *ring = ring_list;
+    while (ring)
+    {
+        //left by an ended thread and drained, take it over
+        if (__atomic_load_n(&ring->released, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head)
+        {
+            ring->released = 0;
+            break;
+        }
+        ring = ring->next;
+    }
+    if (ring == NULL)
+    {
+        ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+        ring->next = ring_list;
+        ring_list = ring;
+    }
+    pthread_mutex_unlock(&ring_mutex);
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+struct log_record *log_reserve()
+{
+    struct log_ring *ring = ring_get();
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail == LOG_RING_SIZE)
+    {
+        //never wait for the drain thread
+        ring->dropped++;
+        return NULL;
+    }
+    return &ring->rec[ring->head & (LOG_RING_SIZE - 1)];
+}
+
+void log_commit()
+{
+    __atomic_store_n(&my_ring->head, my_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void log_format_text(char *out, size_t n, const char *, const unsigned char *payload)
+{
+    snprintf(out, n, "%s", (const char *)payload);
+}
+
+void log_flush()
+{
+    static char line[1024];
+    int written = 0;
+
+    pthread_mutex_lock(&drain_mutex);
+    pthread_mutex_lock(&ring_mutex);
+    struct log_ring *ring = ring_list;
+    pthread_mutex_unlock(&ring_mutex);
+
+    //rings are only added at the head, the ones seen here stay
+    while (ring)
+    {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+        while (tail != head)
+        {
+            struct log_record *r = &ring->rec[tail & (LOG_RING_SIZE - 1)];
+            r->format(line, sizeof(line), r->fmt, r->payload);
+            fputs(line, stdout);
+            tail++;
+            written = 1;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned long dropped = ring->dropped;
+        if (dropped != ring->dropped_shown)
+        {
+            fprintf(stdout, "[log] %lu records dropped, ring full\n", dropped - ring->dropped_shown);
+            ring->dropped_shown = dropped;
+            written = 1;
+        }
+        ring = ring->next;
+    }
+
+    if (written)
+        fflush(stdout);
+    pthread_mutex_unlock(&drain_mutex);
+}
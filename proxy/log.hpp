@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+
+//binary log, each thread puts records into its own ring, one drain thread formats and writes them
+//a record keeps the format, a formatter made for the argument types, and the raw arguments
+//strings are copied, the caller's buffer may be reused before the record is drained
+
+#define LOG_RING_SIZE 512    //records a thread, power of two
+#define LOG_PAYLOAD 240      //argument bytes a record, 256 bytes with the header
+#define LOG_STRING_MAX 128   //longer strings are cut
+
+typedef void (*log_format_fn)(char *out, size_t n, const char *fmt, const unsigned char *payload);
+
+struct log_record
+{
+    const char *fmt;
+    log_format_fn format;
+    unsigned char payload[LOG_PAYLOAD];
+};
+
+//free slot of this thread's ring, NULL when it is full and the record is dropped
+struct log_record *log_reserve();
+
+//publish the slot given by log_reserve
+void log_commit();
+
+//format and write every record committed so far, the drain thread does it every millisecond
+void log_flush();
+
+//numbers and pointers go as they are
+template <typename T, bool S = std::is_same<T, char *>::value || std::is_same<T, const char *>::value>
+struct log_arg
+{
+    static_assert(std::is_arithmetic<T>::value || std::is_pointer<T>::value || std::is_enum<T>::value, "log arguments are numbers, pointers or strings");
+    typedef T type;
+
+    static size_t size(T)
+    {
+        return sizeof(T);
+    }
+    static void put(unsigned char *&p, T v)
+    {
+        memcpy(p, &v, sizeof(T));
+        p += sizeof(T);
+    }
+    static T get(const unsigned char *&p)
+    {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+};
+
+//strings go with their bytes
+template <typename T>
+struct log_arg<T, true>
+{
+    typedef const char *type;
+
+    static size_t size(T s)
+    {
+        return (s ? strnlen(s, LOG_STRING_MAX) : 6) + 1;
+    }
+    static void put(unsigned char *&p, T v)
+    {
+        const char *s = v ? v : "(null)";
+        size_t len = strnlen(s, LOG_STRING_MAX);
+        memcpy(p, s, len);
+        p[len] = '\0';
+        p += len + 1;
+    }
+    static const char *get(const unsigned char *&p)
+    {
+        const char *s = (const char *)p;
+        p += strlen(s) + 1;
+        return s;
+    }
+};
+
+static inline size_t log_size()
+{
+    return 0;
+}
+
+template <typename T, typename... A>
+static inline size_t log_size(T v, A... rest)
+{
+    return log_arg<T>::size(v) + log_size(rest...);
+}
+
+static inline void log_put(unsigned char *&)
+{
+}
+
+template <typename T, typename... A>
+static inline void log_put(unsigned char *&p, T v, A... rest)
+{
+    log_arg<T>::put(p, v);
+    log_put(p, rest...);
+}
+
+template <int... I>
+struct log_seq
+{
+};
+
+template <int N, int... I>
+struct log_make_seq : log_make_seq<N - 1, N - 1, I...>
+{
+};
+
+template <int... I>
+struct log_make_seq<0, I...>
+{
+    typedef log_seq<I...> type;
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+template <typename... A>
+struct log_format
+{
+    typedef std::tuple<typename log_arg<A>::type...> args;
+
+    template <int... I>
+    static void apply(char *out, size_t n, const char *fmt, args &t, log_seq<I...>)
+    {
+        snprintf(out, n, fmt, std::get<I>(t)...);
+    }
+
+    static void run(char *out, size_t n, const char *fmt, const unsigned char *payload)
+    {
+        //a braced list is read left to right, the same order log_put wrote
+        args t{log_arg<A>::get(payload)...};
+        (void)payload;
+        apply(out, n, fmt, t, typename log_make_seq<sizeof...(A)>::type());
+    }
+};
+
+//payload is the text itself, for records too large to keep the arguments
+void log_format_text(char *out, size_t n, const char *fmt, const unsigned char *payload);
+
+template <typename... A>
+void log_write(const char *fmt, A... args)
+{
+    struct log_record *r = log_reserve();
+    if (r == NULL)
+        return;
+
+    r->fmt = fmt;
+    if (log_size(args...) <= LOG_PAYLOAD)
+    {
+        unsigned char *p = r->payload;
+        log_put(p, args...);
+        r->format = log_format<A...>::run;
+    }
+    else
+    {
+        snprintf((char *)r->payload, LOG_PAYLOAD, fmt, args...);
+        r->format = log_format_text;
+    }
+    log_commit();
+}
+#pragma GCC diagnostic pop
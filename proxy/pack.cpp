@@ -0,0 +1,258 @@
+#include "pack.hpp"
+#include "slab.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define ZRUN_MIN 4       //shorter runs stay in the literals, pack_zrun skips by it
+#define LZ_MIN 5         //shorter matches cost more than the bytes
+#define LZ_HASH_BITS 13  //positions remembered, by their first 4 bytes
+
+static const char *codec_names[PACK_CODECS] = {
+    "raw",
+    "zrun",
+    "lz",
+};
+
+const char *pack_codec_name(int codec)
+{
+    if (codec < 0 || codec >= PACK_CODECS)
+        return "unknown";
+    return codec_names[codec];
+}
+
+//lengths and distances are varints, 7 bits a byte, low bits first
+static unsigned char *put_varint(unsigned char *o, unsigned char *end, size_t v)
+{
+    while (o < end)
+    {
+        if (v < 0x80)
+        {
+            *o++ = (unsigned char)v;
+            return o;
+        }
+        *o++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    return NULL;
+}
+
+static const unsigned char *get_varint(const unsigned char *i, const unsigned char *end, size_t *v)
+{
+    size_t x = 0;
+    for (int shift = 0; i < end && shift < 35; shift += 7)
+    {
+        unsigned char b = *i++;
+        x |= (size_t)(b & 0x7f) << shift;
+        if (b < 0x80)
+        {
+            *v = x;
+            return i;
+        }
+    }
+    return NULL;
+}
+
+//token, then n bytes of lit
+static unsigned char *put_literal(unsigned char *o, unsigned char *end, size_t token, const unsigned char *lit, size_t n)
+{
+    o = put_varint(o, end, token);
+    if (o == NULL || (size_t)(end - o) < n)
+        return NULL;
+    memcpy(o, lit, n);
+    return o + n;
+}
+
+//a token is a varint of length << 1 | run, then the literal bytes or the byte of the run
+size_t pack_zrun(const unsigned char *in, size_t n, unsigned char *out, size_t lim)
+{
+    unsigned char *o = out, *end = out + lim;
+    size_t i = 0, lit = 0;
+    while (i < n)
+    {
+        //literals that no longer fit, the payload does not pay
+        if (i - lit > (size_t)(end - o))
+            return 0;
+        //a run of 4 from i, i + 1 or i + 2 needs in[i + 2] == in[i + 3]
+        if (i + 3 < n && in[i + 2] != in[i + 3])
+        {
+            i += 3;
+            continue;
+        }
+        //8 bytes a step through the run, then byte by byte
+        uint64_t w = 0x0101010101010101ull * in[i], x;
+        size_t j = i + 1;
+        while (j + 8 <= n && (memcpy(&x, in + j, 8), x == w))
+            j += 8;
+        while (j < n && in[j] == in[i])
+            j++;
+        if (j - i >= ZRUN_MIN)
+        {
+            if (i > lit && (o = put_literal(o, end, (i - lit) << 1, in + lit, i - lit)) == NULL)
+                return 0;
+            if ((o = put_varint(o, end, (j - i) << 1 | 1)) == NULL || o == end)
+                return 0;
+            *o++ = in[i];
+            lit = j;
+        }
+        i = j;
+    }
+    if (n > lit && (o = put_literal(o, end, (n - lit) << 1, in + lit, n - lit)) == NULL)
+        return 0;
+    return o - out;
+}
+
+int unpack_zrun(const unsigned char *in, size_t len, unsigned char *out, size_t n)
+{
+    const unsigned char *end = in + len;
+    size_t o = 0;
+    while (in < end)
+    {
+        size_t t;
+        if ((in = get_varint(in, end, &t)) == NULL)
+            return -1;
+        size_t l = t >> 1;
+        if (l > n - o)
+            return -1;
+        if (t & 1)
+        {
+            if (in == end)
+                return -1;
+            memset(out + o, *in++, l);
+        }
+        else
+        {
+            if ((size_t)(end - in) < l)
+                return -1;
+            memcpy(out + o, in, l);
+            in += l;
+        }
+        o += l;
+    }
+    return o == n ? 0 : -1;
+}
+
+//a sequence is a varint of literal bytes, the literals, then a varint of match length - LZ_MIN
+//and a varint of its distance back, the last sequence stops after its literals
+size_t pack_lz(const unsigned char *in, size_t n, unsigned char *out, size_t lim)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    unsigned char *o = out, *end = out + lim;
+    size_t i = 0, lit = 0;
+
+    while (o && i + LZ_MIN <= n)
+    {
+        uint32_t v;
+        memcpy(&v, in + i, 4);
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = i;
+
+        if (cand < i && memcmp(in + cand, in + i, 4) == 0)
+        {
+            size_t len = 4;
+            while (i + len < n && in[cand + len] == in[i + len])
+                len++;
+            if (len >= LZ_MIN)
+            {
+                if ((o = put_literal(o, end, i - lit, in + lit, i - lit)) == NULL ||
+                    (o = put_varint(o, end, len - LZ_MIN)) == NULL ||
+                    (o = put_varint(o, end, i - cand)) == NULL)
+                    break;
+                i += len;
+                lit = i;
+                continue;
+            }
+        }
+        //long stretches without a match are skipped faster
+        i += 1 + ((i - lit) >> 6);
+    }
+    if (o)
+        o = put_literal(o, end, n - lit, in + lit, n - lit);
+    return o ? o - out : 0;
+}
+
+int unpack_lz(const unsigned char *in, size_t len, unsigned char *out, size_t n)
+{
+    const unsigned char *end = in + len;
+    size_t o = 0;
+    while (1)
+    {
+        size_t l;
+        if ((in = get_varint(in, end, &l)) == NULL || l > n - o || (size_t)(end - in) < l)
+            return -1;
+        memcpy(out + o, in, l);
+        in += l;
+        o += l;
+        if (in == end)
+            return o == n ? 0 : -1;
+
+        size_t dist;
+        if ((in = get_varint(in, end, &l)) == NULL || (in = get_varint(in, end, &dist)) == NULL)
+            return -1;
+        l += LZ_MIN;
+        if (dist == 0 || dist > o || l > n - o)
+            return -1;
+        unsigned char *d = out + o, *s = d - dist;
+        if (dist == 1)
+            memset(d, *s, l);
+        else if (dist >= l)
+            memcpy(d, s, l);
+        else
+        {
+            //overlapping, the match repeats its first dist bytes
+            for (size_t k = 0; k < l; k += dist)
+                memcpy(d + k, s + k, l - k < dist ? l - k : dist);
+        }
+        o += l;
+    }
+}
+
+unsigned char *pack_payload(int codec, const unsigned char *payload, uint32_t length, uint32_t *packed_length)
+{
+    if (length < PACK_MIN || codec <= PACK_RAW || codec >= PACK_CODECS)
+        return NULL;
+
+    size_t lim = length - length / 8 - PACK_HEAD;
+    unsigned char *out = (unsigned char *)malloc(PACK_HEAD + lim);
+    size_t n = codec == PACK_ZRUN ? pack_zrun(payload, length, out + PACK_HEAD, lim)
+                                  : pack_lz(payload, length, out + PACK_HEAD, lim);
+    if (n == 0)
+    {
+        free(out);
+        return NULL;
+    }
+
+    uint32_t raw = htonl(length);
+    out[0] = (unsigned char)codec;
+    memcpy(out + 1, &raw, 4);
+    *packed_length = PACK_HEAD + n;
+    return out;
+}
+
+unsigned char *unpack_payload(const unsigned char *packed, uint32_t length, uint32_t max, uint32_t *raw_length)
+{
+    if (length < PACK_HEAD)
+        return NULL;
+    uint32_t raw;
+    memcpy(&raw, packed + 1, 4);
+    raw = ntohl(raw);
+    if (raw > max)
+        return NULL;
+
+    unsigned char *out = slab_alloc(raw);
+    int ret = -1;
+    if (packed[0] == PACK_ZRUN)
+        ret = unpack_zrun(packed + PACK_HEAD, length - PACK_HEAD, out, raw);
+    else if (packed[0] == PACK_LZ)
+        ret = unpack_lz(packed + PACK_HEAD, length - PACK_HEAD, out, raw);
+    if (ret == -1)
+    {
+        slab_free(out);
+        return NULL;
+    }
+    *raw_length = raw;
+    return out;
+}
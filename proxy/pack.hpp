@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//compression of chunk frames between proxies, chosen per opcode by the sender
+//a packed frame has FRAME_PACKED set in its opcode and this payload:
+//
+//  0       1               5
+//  codec   raw length      packed bytes
+//
+//every proxy reads packed frames, only senders with -x write them
+//zero padded data chunks, filler chunks of a repair and update deltas are mostly runs
+
+enum pack_codec
+{
+    PACK_RAW = 0,
+    PACK_ZRUN, //runs of one byte, literals in between
+    PACK_LZ,   //matches anywhere back in the payload, runs are matches at distance 1
+    PACK_CODECS
+};
+
+#define PACK_HEAD 5
+#define PACK_MIN 256 //smaller payloads go raw
+
+//"zrun", for logs
+const char *pack_codec_name(int codec);
+
+//n bytes of in ==> at most lim bytes at out, 0 if they do not fit
+size_t pack_zrun(const unsigned char *in, size_t n, unsigned char *out, size_t lim);
+size_t pack_lz(const unsigned char *in, size_t n, unsigned char *out, size_t lim);
+
+//len bytes of in ==> exactly n bytes at out, -1 if in is corrupt
+int unpack_zrun(const unsigned char *in, size_t len, unsigned char *out, size_t n);
+int unpack_lz(const unsigned char *in, size_t len, unsigned char *out, size_t n);
+
+//length bytes of payload ==> PACK_HEAD and the packed bytes in a new buffer, *packed_length in all
+//NULL if the codec does not save an eighth, the frame then goes raw
+unsigned char *pack_payload(int codec, const unsigned char *payload, uint32_t length, uint32_t *packed_length);
+
+//a packed payload of length bytes ==> the raw one in a new buffer of slab_alloc, *raw_length bytes
+//NULL if it is corrupt or would be more than max bytes
+unsigned char *unpack_payload(const unsigned char *packed, uint32_t length, uint32_t max, uint32_t *raw_length);
@@ -0,0 +1,676 @@
+#include "peer.hpp"
+#include "uring.hpp"
+#include "pack.hpp"
+#include "slab.hpp"
+
+#include <poll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+
+//set by peer_zerocopy_start
+static int zerocopy = 0;
+//codec of each opcode, set by peer_pack
+static int pack_codecs[OP_MAX];
+//class of each opcode and weight of each class, set by peer_shape and peer_class_weight
+static int shape_classes[OP_MAX];
+static int class_weights[PEER_CLASSES] = {1, 1, 1, 1, 1};
+static size_t queued_bound = PEER_QUEUED;
+
+static void frame_release(struct peer_frame *f)
+{
+    slab_free(f->payload);
+    free(f);
+}
+
+//heads and payloads of up to PEER_BATCH frames, straight from the callers' buffers
+//returns the first frame left out
+static struct peer_frame *batch_iov(struct peer_queue *q, struct peer_frame *list, struct iovec *iov, int *iovcnt)
+{
+    int n = 0, frames = 0;
+    while (list && frames < PEER_BATCH)
+    {
+        iov[n].iov_base = list->head;
+        iov[n++].iov_len = FRAME_HEAD_SIZE;
+        if (list->length)
+        {
+            iov[n].iov_base = list->payload ? list->payload : list->inline_payload;
+            iov[n++].iov_len = list->length;
+        }
+        list = list->next;
+        frames++;
+    }
+    q->frames += frames;
+    q->batches++;
+    *iovcnt = n;
+    return list;
+}
+
+static int queue_empty(struct peer_queue *q)
+{
+    for (int c = 0; c < PEER_CLASSES; c++)
+    {
+        if (q->first[c])
+            return 0;
+    }
+    return 1;
+}
+
+//frames for the writer, unlinked from the queue in rounds until there are a batch of them or no more
+//a round gives each class with frames its quantum and takes the frames that fit in what it has,
+//in class order; a class without frames keeps nothing. Under the mutex, NULL if the queue is empty
+static struct peer_frame *queue_round(struct peer_queue *q)
+{
+    struct peer_frame *list = NULL, **tail = &list;
+    int frames = 0;
+    while (frames < PEER_BATCH && !queue_empty(q))
+    {
+        for (int c = 0; c < PEER_CLASSES; c++)
+        {
+            struct peer_frame *f = q->first[c];
+            if (f == NULL)
+                continue;
+            q->deficit[c] += class_weights[c] * PEER_QUANTUM;
+            while (f && FRAME_HEAD_SIZE + f->length <= (uint32_t)q->deficit[c])
+            {
+                q->deficit[c] -= FRAME_HEAD_SIZE + f->length;
+                *tail = f;
+                tail = &f->next;
+                f = f->next;
+                frames++;
+            }
+            q->first[c] = f;
+            if (f == NULL)
+            {
+                q->last[c] = NULL;
+                q->deficit[c] = 0;
+            }
+        }
+    }
+    *tail = NULL;
+    return list;
+}
+
+static void batch_broken(struct peer_queue *q)
+{
+    VERBOSE(1, "\t[peer (%d,%d) broken, dropping its frames]\n", q->gid, q->rid);
+    pthread_mutex_lock(&q->mutex);
+    q->broken = 1;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+//frames [batch, end) are written or dropped, callers waiting for room go on
+static void batch_done(struct peer_queue *q, struct peer_frame *batch, struct peer_frame *end)
+{
+    size_t written = 0;
+    while (batch != end)
+    {
+        struct peer_frame *next = batch->next;
+        written += batch->length;
+        frame_release(batch);
+        batch = next;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    q->queued -= written;
+    pthread_cond_broadcast(&q->room_cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+#ifdef SO_ZEROCOPY
+//frame_writev with MSG_ZEROCOPY, the kernel numbers every sendmsg that takes bytes
+static int zc_writev(struct peer_queue *q, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    int flags = MSG_NOSIGNAL | MSG_ZEROCOPY;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t ret = sendmsg(q->fd, &msg, flags);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        //no socket memory left for the notification, the rest of the batch is copied
+        if (ret == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+        {
+            flags = MSG_NOSIGNAL;
+            continue;
+        }
+        if (ret <= 0)
+            return -1;
+        if (flags & MSG_ZEROCOPY)
+            q->zc_sent++;
+        while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len)
+        {
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+//frames [batch, end) wait for the completion of sendmsg id before they are freed
+static void zc_pin(struct peer_queue *q, struct peer_frame *batch, struct peer_frame *end, uint32_t id)
+{
+    struct peer_frame *f = batch;
+    while (f->next != end)
+        f = f->next;
+    f->next = NULL;
+
+    struct peer_pinned *p = (struct peer_pinned *)malloc(sizeof(struct peer_pinned));
+    p->first = batch;
+    p->id = id;
+    p->next = NULL;
+    if (q->pinned_last)
+        q->pinned_last->next = p;
+    else
+        q->pinned = p;
+    q->pinned_last = p;
+}
+
+//free the pinned frames up to sendmsg done, all with done_all
+static void zc_release(struct peer_queue *q, uint32_t done, int done_all)
+{
+    while (q->pinned && (done_all || (int32_t)(q->pinned->id - done) <= 0))
+    {
+        struct peer_pinned *p = q->pinned;
+        q->pinned = p->next;
+        batch_done(q, p->first, NULL);
+        free(p);
+    }
+    if (q->pinned == NULL)
+        q->pinned_last = NULL;
+}
+
+//completions from the error queue of the socket, tcp reports the ids in order
+static void zc_reap(struct peer_queue *q)
+{
+    uint32_t done = 0;
+    int any = 0;
+    while (1)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(q->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+                continue;
+            //sendmsg ee_info to ee_data are done
+            done = ee->ee_data;
+            any = 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                q->zc_copied++;
+        }
+    }
+    if (any)
+        zc_release(q, done, 0);
+
+    //the kernel copied the pages anyway (loopback, a device without scatter gather), pinning only costs
+    if (q->zc_copied && q->zerocopy)
+    {
+        q->zerocopy = 0;
+        VERBOSE(1, "\t[peer (%d,%d) sends are copied by the kernel, zero copy off]\n", q->gid, q->rid);
+    }
+}
+#endif
+
+//write [batch, end) of q, the frames are freed now or, sent with MSG_ZEROCOPY, once the kernel is done
+//-1 on error
+static int batch_write(struct peer_queue *q, struct peer_frame *batch, struct peer_frame *end, struct iovec *iov, int n)
+{
+    if (q->shm)
+    {
+        int ret = shm_writev(q->shm, iov, n);
+        batch_done(q, batch, end);
+        return ret;
+    }
+#ifdef SO_ZEROCOPY
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++)
+        bytes += iov[i].iov_len;
+    if (q->zerocopy && bytes >= PEER_ZEROCOPY_MIN)
+    {
+        uint32_t before = q->zc_sent;
+        if (-1 == zc_writev(q, iov, n))
+        {
+            batch_done(q, batch, end);
+            return -1;
+        }
+        q->zc_batches++;
+        if (q->zc_sent != before)
+            zc_pin(q, batch, end, q->zc_sent - 1);
+        else
+            batch_done(q, batch, end);
+        return 0;
+    }
+#endif
+    int ret = frame_writev(q->fd, iov, n);
+    batch_done(q, batch, end);
+    return ret;
+}
+
+static void *peer_writer(void *arg)
+{
+    struct peer_queue *q = (struct peer_queue *)arg;
+    struct iovec iov[2 * PEER_BATCH];
+
+    while (1)
+    {
+        //take the next rounds
+        pthread_mutex_lock(&q->mutex);
+        while (queue_empty(q))
+        {
+#ifdef SO_ZEROCOPY
+            //idle with pinned frames, look for their completions now and then
+            if (q->pinned)
+            {
+                pthread_mutex_unlock(&q->mutex);
+                struct pollfd p = {q->fd, 0, 0}; //POLLERR comes with the completions
+                poll(&p, 1, 1);
+                zc_reap(q);
+                pthread_mutex_lock(&q->mutex);
+                continue;
+            }
+#endif
+            pthread_cond_wait(&q->cond, &q->mutex);
+        }
+        struct peer_frame *list = queue_round(q);
+        int broken = q->broken;
+        pthread_mutex_unlock(&q->mutex);
+
+        while (list)
+        {
+            struct peer_frame *batch = list;
+            int n;
+            list = batch_iov(q, batch, iov, &n);
+
+            if (broken)
+                batch_done(q, batch, list);
+            else if (-1 == batch_write(q, batch, list, iov, n))
+            {
+                print_err("send failed", errno);
+                broken = 1;
+                batch_broken(q);
+            }
+        }
+#ifdef SO_ZEROCOPY
+        if (q->pinned)
+            zc_reap(q);
+        //no completions come for a broken socket
+        if (broken)
+            zc_release(q, 0, 1);
+#endif
+    }
+    return NULL;
+}
+
+#ifdef HAVE_URING
+#define PEER_RING 64 //sqes, one sendmsg a peer and the wakeup read
+#define RING_WAKE 1  //user_data of the eventfd read, queues use their address
+
+//the one writer when io_uring is on
+struct peer_ring
+{
+    struct uring u;
+    int efd; //callers wake the writer through it
+    uint64_t ebuf;
+    pthread_mutex_t mutex;
+    struct peer_queue *queues;
+};
+
+static struct peer_ring *ring = NULL;
+
+static struct io_uring_sqe *ring_sqe()
+{
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_sqe(&ring->u)) == NULL)
+        uring_submit(&ring->u, 0);
+    return sqe;
+}
+
+static void ring_wake()
+{
+    uint64_t one = 1;
+    if (write(ring->efd, &one, sizeof(one)) != sizeof(one))
+        print_err("eventfd write failed", errno);
+}
+
+static void ring_wait_wake()
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->efd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->ebuf;
+    sqe->len = sizeof(ring->ebuf);
+    sqe->user_data = RING_WAKE;
+}
+
+static void ring_sendmsg(struct peer_queue *q)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = q->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&q->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)q;
+}
+
+//post the next batch of q, one sendmsg in flight a peer keeps its frames in order
+static void ring_next_batch(struct peer_queue *q)
+{
+    if (q->held == NULL)
+    {
+        pthread_mutex_lock(&q->mutex);
+        q->held = queue_round(q);
+        q->busy = q->held != NULL;
+        int broken = q->broken;
+        pthread_mutex_unlock(&q->mutex);
+        if (q->held && broken)
+        {
+            batch_done(q, q->held, NULL);
+            q->held = NULL;
+        }
+        if (q->held == NULL)
+            return;
+    }
+
+    int n;
+    q->sending = q->held;
+    q->held = batch_iov(q, q->held, q->iov, &n);
+    memset(&q->msg, 0, sizeof(q->msg));
+    q->msg.msg_iov = q->iov;
+    q->msg.msg_iovlen = n;
+    ring_sendmsg(q);
+}
+
+//a sendmsg of q is done, short sends move the window forward and go again
+static void ring_sent(struct peer_queue *q, int res)
+{
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        ring_sendmsg(q);
+        return;
+    }
+    if (res <= 0)
+    {
+        errno = -res;
+        print_err("send failed", errno);
+        batch_broken(q);
+        batch_done(q, q->sending, q->held);
+        batch_done(q, q->held, NULL);
+        q->sending = q->held = NULL;
+        return;
+    }
+
+    struct msghdr *msg = &q->msg;
+    size_t done = res;
+    while (msg->msg_iovlen > 0 && done >= msg->msg_iov->iov_len)
+    {
+        done -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+    if (msg->msg_iovlen > 0)
+    {
+        msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + done;
+        msg->msg_iov->iov_len -= done;
+        ring_sendmsg(q);
+        return;
+    }
+    batch_done(q, q->sending, q->held);
+    q->sending = NULL;
+}
+
+static void *ring_writer(void *)
+{
+    ring_wait_wake();
+    while (1)
+    {
+        //queues with frames and no sendmsg in flight
+        pthread_mutex_lock(&ring->mutex);
+        struct peer_queue *q = ring->queues;
+        pthread_mutex_unlock(&ring->mutex);
+        for (; q; q = q->ring_next)
+        {
+            if (q->sending == NULL)
+                ring_next_batch(q);
+        }
+
+        //the batches of every peer go in one system call, which then sleeps until one is done
+        if (uring_submit(&ring->u, 1) < 0 && errno != EINTR && errno != EBUSY)
+            print_err("io_uring_enter failed", errno);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&ring->u)) != NULL)
+        {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(&ring->u);
+            if (data == RING_WAKE)
+                ring_wait_wake();
+            else
+                ring_sent((struct peer_queue *)(uintptr_t)data, res);
+        }
+    }
+    return NULL;
+}
+
+int peer_uring_start()
+{
+    struct peer_ring *g = (struct peer_ring *)calloc(1, sizeof(struct peer_ring));
+    if (uring_init(&g->u, PEER_RING) == -1)
+    {
+        free(g);
+        return -1;
+    }
+    g->efd = eventfd(0, EFD_CLOEXEC);
+    if (g->efd == -1)
+    {
+        uring_exit(&g->u);
+        free(g);
+        return -1;
+    }
+    pthread_mutex_init(&g->mutex, NULL);
+    ring = g;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, ring_writer, NULL) != 0)
+        print_err("peer writer create failed", errno);
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+#else
+int peer_uring_start()
+{
+    return -1;
+}
+#endif
+
+#ifdef SO_ZEROCOPY
+int peer_zerocopy_start()
+{
+    //the option is known to the kernel if a tcp socket takes it
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    if (fd == -1)
+        return -1;
+    int ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+    close(fd);
+    if (ret == -1)
+        return -1;
+    zerocopy = 1;
+    return 0;
+}
+#else
+int peer_zerocopy_start()
+{
+    return -1;
+}
+#endif
+
+static void peer_start(struct peer_queue *q, int fd, int gid, int rid, struct shm_ring *shm)
+{
+    memset(q, 0, sizeof(*q));
+    q->fd = fd;
+    q->gid = gid;
+    q->rid = rid;
+    q->shm = shm;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    pthread_cond_init(&q->room_cond, NULL);
+
+#ifdef HAVE_URING
+    if (ring && shm == NULL)
+    {
+        //at the head, the writer walks the list it saw without the lock
+        pthread_mutex_lock(&ring->mutex);
+        q->ring_next = ring->queues;
+        ring->queues = q;
+        pthread_mutex_unlock(&ring->mutex);
+        return;
+    }
+#endif
+
+#ifdef SO_ZEROCOPY
+    //only the writer threads send zero copy, unix sockets refuse it
+    int one = 1;
+    if (zerocopy && shm == NULL && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+        q->zerocopy = 1;
+#endif
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&q->writer, &attr, peer_writer, q) != 0)
+        print_err("peer writer create failed", errno);
+    pthread_attr_destroy(&attr);
+}
+
+void peer_init(struct peer_queue *q, int fd, int gid, int rid)
+{
+    peer_start(q, fd, gid, rid, NULL);
+}
+
+void peer_init_shm(struct peer_queue *q, struct shm_ring *shm, int gid, int rid)
+{
+    peer_start(q, shm->sock, gid, rid, shm);
+}
+
+static int peer_push(struct peer_queue *q, struct peer_frame *f, int opcode)
+{
+    int c = opcode > OP_NONE && opcode < OP_MAX ? shape_classes[opcode] : 0;
+    f->next = NULL;
+    pthread_mutex_lock(&q->mutex);
+    //a frame larger than the bound still goes once the queue is empty
+    while (!q->broken && q->queued > 0 && q->queued + f->length > queued_bound)
+        pthread_cond_wait(&q->room_cond, &q->mutex);
+    if (q->broken)
+    {
+        pthread_mutex_unlock(&q->mutex);
+        frame_release(f);
+        return -1;
+    }
+    //only an idle writer waits
+    int wake = queue_empty(q) && !q->busy;
+    if (q->last[c])
+        q->last[c]->next = f;
+    else
+        q->first[c] = f;
+    q->last[c] = f;
+    q->queued += f->length;
+    q->raw_bytes += FRAME_HEAD_SIZE + f->raw_length;
+    q->wire_bytes += FRAME_HEAD_SIZE + f->length;
+    if (wake)
+        pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+#ifdef HAVE_URING
+    if (wake && ring)
+        ring_wake();
+#endif
+    return 0;
+}
+
+void peer_pack(int opcode, int codec)
+{
+    if (opcode > OP_NONE && opcode < OP_MAX)
+        pack_codecs[opcode] = codec;
+}
+
+void peer_shape(int opcode, int cls)
+{
+    if (opcode > OP_NONE && opcode < OP_MAX && cls >= 0 && cls < PEER_CLASSES)
+        shape_classes[opcode] = cls;
+}
+
+void peer_class_weight(int cls, int weight)
+{
+    if (cls >= 0 && cls < PEER_CLASSES && weight > 0)
+        class_weights[cls] = weight;
+}
+
+void peer_queue_bound(size_t bytes)
+{
+    if (bytes > PEER_QUEUED)
+        queued_bound = bytes;
+}
+
+int peer_send(struct peer_queue *q, const struct frame_head *head, void *payload)
+{
+    struct peer_frame *f = (struct peer_frame *)malloc(sizeof(struct peer_frame));
+    f->raw_length = head->length;
+
+    //compressed here, so the callers' threads share the work; raw if it saves too little
+    struct frame_head h = *head;
+    uint32_t packed_length;
+    unsigned char *packed = NULL;
+    if (h.opcode < OP_MAX && pack_codecs[h.opcode] != PACK_RAW)
+        packed = pack_payload(pack_codecs[h.opcode], (const unsigned char *)payload, h.length, &packed_length);
+    if (packed)
+    {
+        slab_free(payload);
+        payload = packed;
+        h.opcode |= FRAME_PACKED;
+        h.length = packed_length;
+    }
+
+    frame_pack(&h, f->head);
+    f->payload = h.length ? payload : NULL;
+    f->length = h.length;
+    if (h.length == 0)
+        slab_free(payload);
+    return peer_push(q, f, head->opcode);
+}
+
+int peer_send_copy(struct peer_queue *q, const struct frame_head *head, const void *payload)
+{
+    if (head->length > PEER_INLINE)
+        return -1;
+    struct peer_frame *f = (struct peer_frame *)malloc(sizeof(struct peer_frame));
+    frame_pack(head, f->head);
+    f->payload = NULL;
+    f->length = head->length;
+    f->raw_length = head->length;
+    if (head->length)
+        memcpy(f->inline_payload, payload, head->length);
+    return peer_push(q, f, head->opcode);
+}
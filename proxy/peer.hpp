@@ -0,0 +1,121 @@
+#pragma once
+
+#include "common.hpp"
+#include "frame.hpp"
+#include "shm.hpp"
+
+//outbound queue of one peer proxy, drained by its own writer thread
+//callers never block on the socket, a slow peer only holds up its own queue
+//after peer_uring_start one thread writes every queue instead, the batches of all peers go
+//to the kernel as sendmsg sqes in one io_uring_enter
+//payloads of the opcodes given to peer_pack are compressed by the caller before they are queued
+//after peer_zerocopy_start the writer threads send large batches with MSG_ZEROCOPY, the kernel
+//takes the payloads from the callers' pages and the frames are freed on its completion
+//a queue started with peer_init_shm has its writer thread copy the batches into a shared memory
+//ring (shm.hpp) to a proxy of this host, io_uring and zero copy are for sockets only
+//frames wait in one list a class (peer_shape), the writer takes them a round at a time, each class
+//with frames up to its weight in PEER_QUANTUM bytes and what it had left, so chunks of a busy class
+//do not hold back the frames of the others
+
+#define PEER_BATCH 32  //frames a sendmsg, two iovecs each
+#define PEER_INLINE 16 //payloads this small are copied into the frame
+#define PEER_QUEUED (32 << 20) //payload bytes queued a peer before callers wait, unless peer_queue_bound raised it
+#define PEER_ZEROCOPY_MIN (16 << 10) //payload bytes a batch before MSG_ZEROCOPY pays off
+#define PEER_CLASSES 5 //outbound classes, 0 for opcodes peer_shape was not given
+#define PEER_QUANTUM (16 << 10) //bytes a round for a class of weight 1
+
+struct peer_frame
+{
+    unsigned char head[FRAME_HEAD_SIZE]; //packed
+    void *payload;                       //freed once written, NULL for none or inline
+    uint32_t length;
+    uint32_t raw_length; //before peer_pack's codec
+    unsigned char inline_payload[PEER_INLINE];
+
+    struct peer_frame *next;
+};
+
+//frames of one zerocopy batch, the kernel may still read their payloads
+struct peer_pinned
+{
+    struct peer_frame *first; //NULL ended
+    uint32_t id;              //of the last sendmsg of the batch
+    struct peer_pinned *next;
+};
+
+struct peer_queue
+{
+    int fd;
+    int gid;
+    int rid;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;      //writer waits for frames
+    pthread_cond_t room_cond; //callers wait for room
+    struct peer_frame *first[PEER_CLASSES];
+    struct peer_frame *last[PEER_CLASSES];
+    int deficit[PEER_CLASSES]; //bytes a class may still send, left from its last round
+    size_t queued; //payload bytes queued or being written
+    int broken; //a write failed, later frames are dropped
+
+    //for logs
+    unsigned long frames;
+    unsigned long batches;
+    uint64_t raw_bytes;  //heads and payloads queued, as the callers gave them
+    uint64_t wire_bytes; //the same, compressed
+
+    //MSG_ZEROCOPY, only the writer thread touches these
+    int zerocopy;       //SO_ZEROCOPY is on and the kernel did not fall back to copies
+    uint32_t zc_sent;   //zerocopy sendmsg calls, the kernel numbers them from 0
+    struct peer_pinned *pinned; //oldest first
+    struct peer_pinned *pinned_last;
+    unsigned long zc_batches;
+    unsigned long zc_copied;
+
+    pthread_t writer;
+
+    //NULL for a socket, else the ring the writer fills, fd is its sock then
+    struct shm_ring *shm;
+
+    //io_uring writer: frames taken from the queue, the sendmsg in flight covers [sending, held)
+    int busy; //the writer has frames of this queue, callers need not wake it
+    struct peer_frame *sending;
+    struct peer_frame *held;
+    struct iovec iov[2 * PEER_BATCH];
+    struct msghdr msg;
+    struct peer_queue *ring_next;
+};
+
+//one io_uring writer for the queues started after this, 0, or -1 if the kernel has no io_uring
+//and every queue keeps its own writer thread
+int peer_uring_start();
+
+//MSG_ZEROCOPY for the queues started after this, 0, or -1 if the kernel has no SO_ZEROCOPY
+//queues whose socket refuses it, or whose sends the kernel copies anyway, keep plain sends
+int peer_zerocopy_start();
+
+//compress the payloads of opcode with codec (pack.hpp) from now on, PACK_RAW to stop
+void peer_pack(int opcode, int codec);
+
+//frames of opcode wait in class cls from now on; before the queues have frames
+void peer_shape(int opcode, int cls);
+
+//share of a queue's writer cls gets while others have frames too, 1 by default; before the queues have frames
+void peer_class_weight(int cls, int weight);
+
+//callers wait once bytes of payload are queued to a peer, at least PEER_QUEUED; before the queues have frames
+void peer_queue_bound(size_t bytes);
+
+//start the writer of fd, (gid, rid) is the peer
+void peer_init(struct peer_queue *q, int fd, int gid, int rid);
+
+//the same for a ring, the queue owns it
+void peer_init_shm(struct peer_queue *q, struct shm_ring *shm, int gid, int rid);
+
+//queue a frame, the payload (head->length bytes) is owned by the queue and slab_free'd once written
+//waits while PEER_QUEUED bytes are queued for this peer, other peers are not held up
+//0, or -1 if the peer is broken and the frame is dropped
+int peer_send(struct peer_queue *q, const struct frame_head *head, void *payload);
+
+//the same, payload of at most PEER_INLINE bytes copied, the caller keeps it
+int peer_send_copy(struct peer_queue *q, const struct frame_head *head, const void *payload);
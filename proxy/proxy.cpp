@@ -1,6 +1,16 @@
 #include "common.hpp"
 #include "thread.hpp"
 #include "encode.hpp"
+#include "frame.hpp"
+#include "peer.hpp"
+#include "reactor.hpp"
+#include "pack.hpp"
+#include "shm.hpp"
+#include "flow.hpp"
+#include "slab.hpp"
+#include "sched.hpp"
+
+#include <endian.h>
 
 //int P_PORT[GROUP][RACK] = {{12001, 12002}, {12003, 12004}, {12005, 12006}};
 //int P_PORT[GROUP][RACK];
@@ -10,7 +20,6 @@ enum status
 {
     conn_wait,
     conn_init,
-    conn_write,
     conn_read,
     conn_close
 };
@@ -21,8 +30,22 @@ int rid_self = 0;
 
 //for this node, write and read
 int connfd_list_W[GROUP][RACK] = {0};
-
-pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+//lanes to each peer, a control lane for acks and gather requests so they never wait behind chunks,
+//and peer_lanes chunk lanes, a chunk goes to lane chunk_id % peer_lanes so its frames stay in order
+#define PEER_LANES_MAX 8
+struct peer_link
+{
+    struct peer_queue ctrl; //its fd is connfd_list_W
+    struct peer_queue data[PEER_LANES_MAX];
+    struct flow_out flow; //credits of the chunk frames to it
+    struct sched_serial serial[SCHED_PRIOS]; //tasks that send to it, in the order they were added
+};
+struct peer_link peers[GROUP][RACK];
+//credits owed to each peer for the chunk frames it sent here
+struct flow_in peers_in[GROUP][RACK];
+static void peer_drained(int g, int r, int cls);
+//-n, chunk lanes a peer
+int peer_lanes = 1;
 
 int connfd_list_R[GROUP][RACK] = {0};
 long rack_update[GROUP][RACK] = {0}; //count update in each rack
@@ -30,16 +53,66 @@ long rack_update[GROUP][RACK] = {0}; //count update in each rack
 
 int connfd_server;
 
-memcached_return rc;
 struct ECHash_st *ech;
-struct threadpool *send_pool, *repair_pool, *gather_pool, *middle_pool, *update_pool, *update_ack_pool;
+//the chunk index and ring of ech, used by one thread at a time
+pthread_mutex_t ech_mutex = PTHREAD_MUTEX_INITIALIZER;
+//tasks for a peer that is not connected yet, they drop their frames in order
+struct sched_serial serial_unlinked[SCHED_PRIOS];
+
+//encoding tasks running at once, -e
+int encode_workers = 0;
+
+//io threads reading the other proxies, sized by -i
+int io_threads = 2;
+//-u, io_uring for the proxy mesh where the kernel has it
+int use_uring = 0;
+//-z, large batches to other proxies go out with MSG_ZEROCOPY
+int use_zerocopy = 0;
+//-x, chunk frames to other proxies are compressed by pack_table
+int use_pack = 0;
+//lanes to proxies of this host go over shared memory rings, -t keeps them on TCP
+int use_shm = 1;
+
+//codec of each chunk frame with -x
+static const struct
+{
+    int opcode;
+    int codec;
+} pack_table[] = {
+    {OP_L_ENCODE, PACK_LZ},   //sealed data chunks, values and the zero tail
+    {OP_G_ENCODE, PACK_LZ},
+    {OP_L_MIDDLE, PACK_LZ},   //repair shares, mostly xor of data, lz gives up on those fastest
+    {OP_G_MIDDLE, PACK_LZ},
+    {OP_L_UPDATE, PACK_ZRUN}, //deltas, zero but where the value changed
+    {OP_G_UPDATE, PACK_ZRUN},
+};
+
+//requests of the requestor in flight at once, sized by -w
+int request_workers = 4;
+
+//outbound class of each frame to other proxies, the scheduler's priorities and weights
+//credits, gather requests and replies keep class 0 with the client's frames, they are small
+//a delta goes in the class of the data chunks, so it never passes the chunk it changes
+static const struct
+{
+    int opcode;
+    int prio;
+} shape_table[] = {
+    {OP_L_ENCODE, SCHED_ENCODING},
+    {OP_G_ENCODE, SCHED_ENCODING},
+    {OP_L_MIDDLE, SCHED_DEGRADED},
+    {OP_G_MIDDLE, SCHED_DEGRADED},
+    {OP_L_UPDATE, SCHED_ENCODING},
+    {OP_G_UPDATE, SCHED_ENCODING},
+    {OP_L_UPDATE_ACK, SCHED_PARITY},
+    {OP_G_UPDATE_ACK, SCHED_PARITY},
+};
+static_assert(SCHED_PRIOS <= PEER_CLASSES, "a peer queue needs a class for each priority");
 
 //critical variable
-int local_can_encode = 0;
 int local_wait_num = 0;
 struct local_encode_st *local_encode_list = NULL;
-pthread_mutex_t local_encode_mutex;
-pthread_cond_t local_encode_cond;
+pthread_mutex_t local_encode_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct timeval l_this_update_begin, l_this_update_end;
 struct timeval l_other_update_begin, l_other_update_end;
@@ -60,68 +133,99 @@ static void show_local_encode()
     }
 }
 
-//encoding buffer, when it is full,  pop for local parity
-//sorted with gid, rid, index_tag, data chunkID
-//in this local parity, we encode all same data chunkID
-void *local_encode(void *arg)
+//memcached_st is not thread safe, each worker thread goes through its own clone
+static memcached_st *worker_ring()
 {
-    pthread_mutex_init(&local_encode_mutex, NULL);
-    pthread_cond_init(&local_encode_cond, NULL);
-
-    while (1)
+    static __thread memcached_st *ring = NULL;
+    if (ring == NULL)
     {
-        pthread_mutex_lock(&local_encode_mutex);
+        pthread_mutex_lock(&ech_mutex);
+        ring = memcached_clone(NULL, ech->ring);
+        pthread_mutex_unlock(&ech_mutex);
+        //a batch set may have ech->ring without replies while it is cloned
+        memcached_behavior_set(ring, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+    }
+    return ring;
+}
 
-        if (local_can_encode == 0)
-        {
-            VERBOSE(2, "\nChoking in local_encode\n");
-            pthread_cond_wait(&local_encode_cond, &local_encode_mutex);
-        }
+//position of a data chunk in the global stripe of chunk_id, the same on every proxy
+//each group but chunk_id % GROUP gives LK chunks, ordered by (rid, index_tag) without the local parity
+static int global_offset(int g, int r, int index_tag, uint32_t chunk_id)
+{
+    //chunk_waiting_push leaves this place of rack chunk_id % RACK to the local parity
+    char key_local[100] = {0};
+    sprintf(key_local, "local-%d-%d", g, chunk_id);
+    int hole = (chunk_id % RACK) * NODE + memcached_generate_hash(worker_ring(), key_local, strlen(key_local));
+
+    int pos = r * NODE + index_tag;
+    if (pos > hole)
+        pos--;
+    return (g - (g > (int)(chunk_id % GROUP))) * LK + pos;
+}
 
-        VERBOSE(2, "\nResuming in local_encode\n");
-        struct local_encode_st *p = local_encode_list, *q = p;
+//chunk_list is written by the request workers under ech_mutex
+static int chunk_sealed(uint32_t index_tag, uint32_t chunk_id)
+{
+    pthread_mutex_lock(&ech_mutex);
+    int sealed = ech->chunk_list[index_tag][chunk_id].stat == Sealed;
+    pthread_mutex_unlock(&ech_mutex);
+    return sealed;
+}
 
-        //find can encode_st
-        if (p == NULL)
-        {
-            VERBOSE(2, "\nEncode_list == NULL\n");
-        }
+//a sealed data chunk of this proxy is lost if its server no longer has its first key
+static int chunk_lost(uint32_t index_tag, uint32_t chunk_id)
+{
+    char *key = NULL;
+    pthread_mutex_lock(&ech_mutex);
+    struct key_st *k = ech->chunk_list[index_tag][chunk_id].key_list;
+    while (k && k->hn == NULL)
+        k = k->next;
+    if (k)
+        key = strdup(k->hn->key);
+    pthread_mutex_unlock(&ech_mutex);
+    if (key == NULL)
+        return 0;
+    int lost = memcached_exist(worker_ring(), key, strlen(key)) != MEMCACHED_SUCCESS;
+    free(key);
+    return lost;
+}
 
-        if (p->num == LK)
-        {
-            local_encode_list = p->next;
-        }
-        else
-        {
-            p = p->next;
-            while (p)
-            {
-                if (p->num == LK)
-                {
-                    q->next = p->next;
-                    break;
-                }
-                q = p;
-                p = p->next;
-            }
-        }
+//take the deltas queued on a stripe, under its list's mutex
+static struct stripe_delta *stripe_deltas(struct stripe_delta **deltas)
+{
+    struct stripe_delta *d = *deltas;
+    *deltas = NULL;
+    return d;
+}
 
-        local_wait_num--;
-        local_can_encode--;
+//a full local stripe, no data chunk comes to it any more
+//store its parity with the deltas that came before, then unlink and free it
+static void local_encode(struct local_encode_st *p)
+{
+    //normal set memcached
+    char key_local[100] = {0};
+    sprintf(key_local, "local-%d-%d", gid_self, p->chunk_id);
 
-        //show_local_encode();
-        pthread_mutex_unlock(&local_encode_mutex);
+    pthread_mutex_lock(&local_encode_mutex);
+    struct stripe_delta *d = stripe_deltas(&p->deltas);
+    pthread_mutex_unlock(&local_encode_mutex);
 
-        //normal set memcached
-        char key_local[100] = {0};
-        sprintf(key_local, "local-%d-%d", gid_self, p->chunk_id);
+    while (1)
+    {
+        //the local parity is plain xor, a delta goes in at any column
+        while (d)
+        {
+            struct stripe_delta *next = d->next;
+            l_encode_update(p, 0, d->delta);
+            slab_free(d->delta);
+            free(d);
+            d = next;
+        }
 
-        // encode P, free in local_encode
+        //parity is already folded
         unsigned char *parity = l_encode(p);
 
-        char *pp = transfer_ustr_to_str(parity, CHUNK_SIZE);
-        rc = memcached_set(ech->ring, key_local, strlen(key_local), pp, CHUNK_SIZE, 0, 0);
-        free(pp);
+        memcached_return rc = memcached_set(worker_ring(), key_local, strlen(key_local), (char *)parity, chunk_size, 0, 0);
         if (rc == MEMCACHED_SUCCESS)
         {
             VERBOSE(2, "\nLocal parity %s STORE OK\n", key_local);
@@ -131,86 +235,75 @@ void *local_encode(void *arg)
             VERBOSE(2, "\nLocal parity %s STORE NOK\n", key_local);
         }
 
-        for (int i = 0; i < LN; i++)
+        //deltas that came during the set need another one, once none came the parity is in memcached
+        pthread_mutex_lock(&local_encode_mutex);
+        d = stripe_deltas(&p->deltas);
+        if (d == NULL)
         {
-            free(p->source_data[i]);
+            if (local_encode_list == p)
+                local_encode_list = p->next;
+            else
+            {
+                struct local_encode_st *q = local_encode_list;
+                while (q->next != p)
+                    q = q->next;
+                q->next = p->next;
+            }
+            local_wait_num--;
         }
-        free(p);
+        pthread_mutex_unlock(&local_encode_mutex);
+        if (d == NULL)
+            break;
+    }
+
+    for (int i = 0; i < LN - LK; i++)
+    {
+        slab_free(p->parity[i]);
     }
+    pthread_mutex_destroy(&p->fold_mutex);
+    free(p);
 }
 
-int global_can_encode = 0;
 int global_wait_num = 0;
 struct global_encode_st *global_encode_list = NULL;
-pthread_mutex_t global_encode_mutex;
-pthread_cond_t global_encode_cond;
+pthread_mutex_t global_encode_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void *global_encode(void *arg)
+//a full global stripe, the same as local_encode
+static void global_encode(struct global_encode_st *p)
 {
-    pthread_mutex_init(&global_encode_mutex, NULL);
-    pthread_cond_init(&global_encode_cond, NULL);
+    //normal set memcached
+    char key_global[GN - GK][100];
+    for (int i = 0; i < GN - GK; i++)
+        memset(key_global[i], 0, 100);
+    uint32_t chunk_id = p->chunk_id;
+    //for global
+    for (int i = 0; i < GN - GK; i++)
+        sprintf(key_global[i], "global-%d[%d]", chunk_id, i);
+
+    pthread_mutex_lock(&global_encode_mutex);
+    struct stripe_delta *d = stripe_deltas(&p->deltas);
+    pthread_mutex_unlock(&global_encode_mutex);
 
     while (1)
     {
-        pthread_mutex_lock(&global_encode_mutex);
-
-        if (global_can_encode == 0)
-        {
-            VERBOSE(2, "\nChoking in global_encode\n");
-            pthread_cond_wait(&global_encode_cond, &global_encode_mutex);
-        }
-
-        VERBOSE(2, "\nResuming in global_encode\n");
-        struct global_encode_st *p = global_encode_list, *q = p;
-
-        //find can encode_st
-        if (p == NULL)
-        {
-            VERBOSE(2, "\nEncode_list == NULL\n");
-        }
-        if (p->num == GK)
-        {
-            global_encode_list = p->next;
-        }
-        else
+        //each parity takes coef[i][vec_i] * delta, as the chunk itself went in
+        while (d)
         {
-            p = p->next;
-            while (p)
-            {
-                if (p->num == GK)
-                {
-                    q->next = p->next;
-                    break;
-                }
-                q = p;
-                p = p->next;
-            }
+            struct stripe_delta *next = d->next;
+            g_encode_update(p, d->vec_i, d->delta);
+            slab_free(d->delta);
+            free(d);
+            d = next;
         }
 
-        global_wait_num--;
-        global_can_encode--;
-
-        pthread_mutex_unlock(&global_encode_mutex);
-
-        //normal set memcached
-        char key_global[GN - GK][100];
-        for (int i = 0; i < GN - GK; i++)
-            memset(key_global[i], 0, 100);
-        uint32_t chunk_id = p->chunk_id;
-        //for global
-        for (int i = 0; i < GN - GK; i++)
-            sprintf(key_global[i], "global-%d[%d]", chunk_id, i);
-
-        //encode P, free in local_encode
+        //parity is already folded
         unsigned char **parity = g_encode(p);
 
         VERBOSE(2, "\n\nGlobal parity of chunk_id=%d\n\n", chunk_id);
 
         for (int i = 0; i < GN - GK; i++)
         {
-            char *pp = transfer_ustr_to_str(parity[i], CHUNK_SIZE);
-            rc = memcached_set(ech->ring, key_global[i], strlen(key_global[i]), pp, CHUNK_SIZE, 0, 0);
-            free(pp);
+            memcached_return rc = memcached_set(worker_ring(), key_global[i], strlen(key_global[i]), (char *)parity[i], chunk_size, 0, 0);
             if (rc == MEMCACHED_SUCCESS)
             {
                 VERBOSE(2, "Global parity %s STORE OK\n", key_global[i]);
@@ -221,300 +314,390 @@ void *global_encode(void *arg)
             }
         }
 
-        for (int i = 0; i < GN; i++)
-        {
-            free(p->source_data[i]);
-        }
-        free(p);
-    }
-}
-
-//only send
-//for two parts, command and real data
-void *proxy_send(void *send_arg)
-{
-    //char receive_buf[100];
-    //format: local/global gid rid index_tag chunk_id
-    struct send_arg *tmp = (struct send_arg *)send_arg;
-    int fd = tmp->connfd;
-    int g, r;
-    for (int i = 0; i < GROUP; i++)
-    {
-        for (int j = 0; j < RACK; j++)
+        pthread_mutex_lock(&global_encode_mutex);
+        d = stripe_deltas(&p->deltas);
+        if (d == NULL)
         {
-            if (fd == connfd_list_W[i][j])
+            if (global_encode_list == p)
+                global_encode_list = p->next;
+            else
             {
-                g = i;
-                r = j;
-                break;
+                struct global_encode_st *q = global_encode_list;
+                while (q->next != p)
+                    q = q->next;
+                q->next = p->next;
             }
+            global_wait_num--;
         }
+        pthread_mutex_unlock(&global_encode_mutex);
+        if (d == NULL)
+            break;
     }
 
-    //send local first
-    char send_com[COMMAND_SIZE];
-    memset(send_com, 0, COMMAND_SIZE);
-    //send real value
-    char send_buf[CHUNK_SIZE];
-    memset(send_buf, 0, CHUNK_SIZE);
-
-    //local
-    if (tmp->global == 0)
+    for (int i = 0; i < GN - GK; i++)
     {
-        sprintf(send_com, "%s %d %d %d %u", "l-encode", tmp->gid, tmp->rid, tmp->index_tag, tmp->chunk_id);
+        slab_free(p->parity[i]);
+    }
+    pthread_mutex_destroy(&p->fold_mutex);
+    free(p);
+}
 
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(2, "\n\t****(Local data SEND command) (%s) to (%d,%d)\n", send_com, g, r);
-        }
+//a place in the open local stripe of chunk_id for a data chunk, a new stripe if none has room
+//taken when the chunk arrives, so a delta of it handled later finds the stripe
+static struct local_encode_st *local_encode_reserve(uint32_t chunk_id, int *vec_i)
+{
+    pthread_mutex_lock(&local_encode_mutex);
 
-        memcpy(send_buf, tmp->send, CHUNK_SIZE);
-        ret = send(fd, send_buf, CHUNK_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(2, "\n\t****(Local data SEND real) to (%d,%d)\n", g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
+    struct local_encode_st *p = local_encode_list, *q = p;
+    while (p)
+    {
+        if (p->chunk_id == chunk_id && p->slot < LK)
+            break;
+        q = p;
+        p = p->next;
     }
-    else
+    if (p == NULL)
     {
-        sprintf(send_com, "%s %d %d %d %u", "g-encode", tmp->gid, tmp->rid, tmp->index_tag, tmp->chunk_id);
-
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
+        p = (struct local_encode_st *)calloc(1, sizeof(struct local_encode_st));
+        p->chunk_id = chunk_id;
+        p->next = NULL;
+        pthread_mutex_init(&p->fold_mutex, NULL);
+        for (int i = 0; i < LN - LK; i++)
         {
-            VERBOSE(2, "\n\t####(Global data SEND command) (%s) to (%d,%d)\n", send_com, g, r);
+            p->parity[i] = slab_zalloc(chunk_size);
         }
 
-        memcpy(send_buf, tmp->send, CHUNK_SIZE);
-        ret = send(fd, send_buf, CHUNK_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
+        if (local_encode_list == NULL)
+            local_encode_list = p;
         else
-        {
-            VERBOSE(2, "\n\t####(Global data SEND real) to (%d,%d)\n", g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
+            q->next = p;
+        local_wait_num++;
     }
+    *vec_i = p->slot++;
 
-    free(tmp);
-    return NULL;
+    pthread_mutex_unlock(&local_encode_mutex);
+    return p;
 }
 
-void *middle_send(void *middle_arg)
+//fold a data chunk into its place in the local stripe p, the chunk stays with the caller
+//the call that folds the last chunk of a stripe also stores its parity
+static void local_encode_add(struct local_encode_st *p, int vec_i, int g, int r, int index_tag, unsigned char *chunk)
 {
-    //format: local/global gid rid chunk_id
-    struct middle_arg *tmp = (struct middle_arg *)middle_arg;
-    int fd = tmp->connfd;
-    int g, r;
-    for (int i = 0; i < GROUP; i++)
-    {
-        for (int j = 0; j < RACK; j++)
-        {
-            if (fd == connfd_list_W[i][j])
-            {
-                g = i;
-                r = j;
-                break;
-            }
-        }
-    }
+    //the stripe is not stored before this fold is counted in num
+    pthread_mutex_lock(&p->fold_mutex);
+    l_encode_update(p, vec_i, chunk);
+    pthread_mutex_unlock(&p->fold_mutex);
+
+    pthread_mutex_lock(&local_encode_mutex);
+    p->num++;
+    VERBOSE(2, "\n\t****Local data from (%d,%d) (%d), local_wait_num=%d, chunk_id=%d, index_tag=%d\n", g, r, p->num, local_wait_num, p->chunk_id, index_tag);
+    int full = (p->num == LK);
+    pthread_mutex_unlock(&local_encode_mutex);
+
+    //other stripes keep folding meanwhile
+    if (full)
+        local_encode(p);
+}
 
-    //send local first
-    char send_com[COMMAND_SIZE];
-    memset(send_com, 0, COMMAND_SIZE);
-    //send real value
-    unsigned char send_buf[CHUNK_SIZE];
-    memset(send_buf, 0, CHUNK_SIZE);
+static struct global_encode_st *global_encode_reserve(int g, int r, int index_tag, uint32_t chunk_id, int *vec_i)
+{
+    //cauchy rows differ by column, so the position is fixed for the global repair to decode
+    *vec_i = global_offset(g, r, index_tag, chunk_id);
 
-    //local
-    if (tmp->global == 0)
-    {
-        sprintf(send_com, "%s %d %d %u", "l-middle", tmp->gid, tmp->rid, tmp->chunk_id);
+    pthread_mutex_lock(&global_encode_mutex);
 
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
+    struct global_encode_st *p = global_encode_list, *q = p;
+    while (p)
+    {
+        if (p->chunk_id == chunk_id && p->slot < GK)
+            break;
+        q = p;
+        p = p->next;
+    }
+    if (p == NULL)
+    {
+        p = (struct global_encode_st *)calloc(1, sizeof(struct global_encode_st));
+        p->chunk_id = chunk_id;
+        p->next = NULL;
+        pthread_mutex_init(&p->fold_mutex, NULL);
+        for (int i = 0; i < GN - GK; i++)
         {
-            VERBOSE(3, "\n\t****(Local middle SEND command) (%s) to (%d,%d)\n", send_com, g, r);
+            p->parity[i] = slab_zalloc(chunk_size);
         }
 
-        memcpy(send_buf, tmp->middle, CHUNK_SIZE);
-        ret = send(fd, send_buf, CHUNK_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
+        if (global_encode_list == NULL)
+            global_encode_list = p;
         else
-        {
-            VERBOSE(3, "\n\t****(Local middle SEND real) to (%d,%d)\n", g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
+            q->next = p;
+        global_wait_num++;
     }
-    else
-    {
-        // sprintf(send_com, "%s %d %d %u", "g-middle", tmp->gid, tmp->rid, tmp->chunk_id);
+    p->slot++;
 
-        // int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        // if (-1 == ret)
-        //     print_err("send failed", errno);
-        // else
-        // {
-        //     VERBOSE(3, "\n\t####(Global Middle SEND command) (%s) to (%d,%d)\n", send_com, g, r);
-        // }
+    pthread_mutex_unlock(&global_encode_mutex);
+    return p;
+}
 
-        // memcpy(send_buf, tmp->send, CHUNK_SIZE);
-        // ret = send(fd, send_buf, CHUNK_SIZE, 0);
-        // if (-1 == ret)
-        //     print_err("send failed", errno);
-        // else
-        // {
-        //     VERBOSE(3, "\n\t####(Global Middle SEND real) to (%d,%d)\n", g, r);
-        // }
-    }
+static void global_encode_add(struct global_encode_st *p, int vec_i, int g, int r, int index_tag, unsigned char *chunk)
+{
+    pthread_mutex_lock(&p->fold_mutex);
+    g_encode_update(p, vec_i, chunk);
+    pthread_mutex_unlock(&p->fold_mutex);
+
+    pthread_mutex_lock(&global_encode_mutex);
+    p->num++;
+    VERBOSE(2, "\n\t####Global data from (%d,%d) (%d), global_wait_num=%d, chunk_id=%d, index_tag=%d\n", g, r, p->num, global_wait_num, p->chunk_id, index_tag);
+    int full = (p->num == GK);
+    pthread_mutex_unlock(&global_encode_mutex);
+
+    if (full)
+        global_encode(p);
+}
 
-    free(tmp);
-    return NULL;
+//a delta of a chunk of chunk_id, queued on its stripe if the parity is not stored yet
+//the stripe takes a reference of delta then and 1 is returned, 0 if the parity is in memcached
+static int local_delta_add(uint32_t chunk_id, unsigned char *delta)
+{
+    pthread_mutex_lock(&local_encode_mutex);
+    struct local_encode_st *p = local_encode_list;
+    while (p && p->chunk_id != chunk_id)
+        p = p->next;
+    if (p)
+    {
+        struct stripe_delta *d = (struct stripe_delta *)malloc(sizeof(struct stripe_delta));
+        d->vec_i = 0;
+        d->delta = slab_ref(delta);
+        d->next = p->deltas;
+        p->deltas = d;
+    }
+    pthread_mutex_unlock(&local_encode_mutex);
+    return p != NULL;
 }
 
-void *update_send(void *update_arg)
+//the same for the global stripe, pos is the chunk's place in it
+static int global_delta_add(uint32_t chunk_id, int pos, unsigned char *delta)
 {
-    //format: local/global gid rid chunk_id
-    struct update_arg *tmp = (struct update_arg *)update_arg;
-    int fd = tmp->connfd;
-    int g, r;
-    for (int i = 0; i < GROUP; i++)
+    pthread_mutex_lock(&global_encode_mutex);
+    struct global_encode_st *p = global_encode_list;
+    while (p && p->chunk_id != chunk_id)
+        p = p->next;
+    if (p)
     {
-        for (int j = 0; j < RACK; j++)
-        {
-            if (fd == connfd_list_W[i][j])
-            {
-                g = i;
-                r = j;
-                break;
-            }
-        }
+        struct stripe_delta *d = (struct stripe_delta *)malloc(sizeof(struct stripe_delta));
+        d->vec_i = pos;
+        d->delta = slab_ref(delta);
+        d->next = p->deltas;
+        p->deltas = d;
     }
+    pthread_mutex_unlock(&global_encode_mutex);
+    return p != NULL;
+}
 
-    //send local first
-    char send_com[COMMAND_SIZE];
-    memset(send_com, 0, COMMAND_SIZE);
-    //send real value
-    unsigned char send_buf[CHUNK_SIZE];
-    memset(send_buf, 0, CHUNK_SIZE);
+//encoding task, folds one data chunk and frees it
+void *encode_chunk(void *encode_arg)
+{
+    struct encode_arg *tmp = (struct encode_arg *)encode_arg;
 
-    //local
     if (tmp->global == 0)
-    {
-        sprintf(send_com, "%s %d %d %u", "l-update", tmp->gid, tmp->rid, tmp->chunk_id);
+        local_encode_add((struct local_encode_st *)tmp->stripe, tmp->vec_i, tmp->gid, tmp->rid, tmp->index_tag, tmp->chunk);
+    else
+        global_encode_add((struct global_encode_st *)tmp->stripe, tmp->vec_i, tmp->gid, tmp->rid, tmp->index_tag, tmp->chunk);
+    //a chunk of another proxy is folded, it may send the next one
+    if (tmp->gid != gid_self || tmp->rid != rid_self)
+        peer_drained(tmp->gid, tmp->rid, FLOW_ENCODE);
 
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(4, "\n\t****(Local update SEND command) (%s) to (%d,%d)\n", send_com, g, r);
-        }
+    slab_free(tmp->chunk);
+    free(tmp);
+    return NULL;
+}
 
-        memcpy(send_buf, tmp->update, CHUNK_SIZE);
-        ret = send(fd, send_buf, CHUNK_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            //show_unsigned_data(send_buf,CHUNK_SIZE,"aaa");
-            VERBOSE(4, "\n\t****(Local update SEND real) to (%d,%d)\n", g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
-    }
+//give a data chunk its place in a stripe, then hand it to the scheduler, the chunk is owned by the task from now on
+static void encode_add(int global, int g, int r, int index_tag, uint32_t chunk_id, unsigned char *chunk)
+{
+    struct encode_arg *ea = (struct encode_arg *)calloc(1, sizeof(struct encode_arg));
+    ea->global = global;
+    ea->gid = g;
+    ea->rid = r;
+    ea->index_tag = index_tag;
+    ea->chunk_id = chunk_id;
+    ea->chunk = chunk;
+    if (global == 0)
+        ea->stripe = local_encode_reserve(chunk_id, &ea->vec_i);
     else
-    {
-        sprintf(send_com, "%s %d %d %u", "g-update", tmp->gid, tmp->rid, tmp->chunk_id);
+        ea->stripe = global_encode_reserve(g, r, index_tag, chunk_id, &ea->vec_i);
 
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(4, "\n\t####(Global update SEND command) (%s) to (%d,%d)\n", send_com, g, r);
-        }
+    sched_add(SCHED_ENCODE, encode_chunk, ea);
+}
 
-        memcpy(send_buf, tmp->update, CHUNK_SIZE);
-        ret = send(fd, send_buf, CHUNK_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(4, "\n\t####(Global update SEND real) to (%d,%d)\n", g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
+//take a value got from memcached as a chunk buffer, zero padded up to chunk_size
+static unsigned char *chunk_from_value(char *value, size_t value_length)
+{
+    if (value_length < chunk_size)
+    {
+        value = (char *)realloc(value, chunk_size);
+        memset(value + value_length, 0, chunk_size - value_length);
     }
-    free(tmp);
-    return NULL;
+    return (unsigned char *)value;
 }
 
-void *update_ack_send(void *update_ack_arg)
+//lanes of the peer behind a connfd_list_W fd, NULL before it is connected
+static struct peer_link *peer_of(int fd)
 {
-    struct update_ack_arg *tmp = (struct update_ack_arg *)update_ack_arg;
-    int fd = tmp->connfd;
-    int g, r;
     for (int i = 0; i < GROUP; i++)
     {
         for (int j = 0; j < RACK; j++)
         {
-            if (fd == connfd_list_W[i][j])
-            {
-                g = i;
-                r = j;
-                break;
-            }
+            if (fd == connfd_list_W[i][j] && peers[i][j].ctrl.fd == fd)
+                return &peers[i][j];
         }
     }
+    return NULL;
+}
 
-    //send local first
-    char send_com[COMMAND_SIZE];
-    memset(send_com, 0, COMMAND_SIZE);
+//serial for the tasks of cls that send to the peer behind fd
+static struct sched_serial *peer_serial(int fd, int cls)
+{
+    struct peer_link *l = peer_of(fd);
+    return l ? &l->serial[sched_prio(cls)] : &serial_unlinked[sched_prio(cls)];
+}
 
-    //local
-    if (tmp->global == 0)
-    {
-        sprintf(send_com, "%s %d %d", "ack-l-update", tmp->gid, tmp->rid);
+//queue for a frame that carries chunk chunk_id
+static struct peer_queue *peer_chunk(int fd, uint32_t chunk_id)
+{
+    struct peer_link *l = peer_of(fd);
+    return l ? &l->data[chunk_id % peer_lanes] : NULL;
+}
 
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(4, "\n\t****(Local update ack SEND command) (%s) to (%d,%d)\n", send_com, g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
-    }
-    else
-    {
-        sprintf(send_com, "%s %d %d", "ack-g-update", tmp->gid, tmp->rid);
+//queue for a small frame nobody should wait for
+static struct peer_queue *peer_ctrl(int fd)
+{
+    struct peer_link *l = peer_of(fd);
+    return l ? &l->ctrl : NULL;
+}
 
-        pthread_mutex_lock(&send_mutex);
-        int ret = send(fd, send_com, COMMAND_SIZE, 0);
-        if (-1 == ret)
-            print_err("send failed", errno);
-        else
-        {
-            VERBOSE(4, "\n\t####(Global update ack SEND command) (%s) to (%d,%d)\n", send_com, g, r);
-        }
-        pthread_mutex_unlock(&send_mutex);
+//a chunk frame to q, a queue of its peer, once the peer has credits for it
+static int peer_chunk_send(struct peer_queue *q, const struct frame_head *head, void *payload)
+{
+    return flow_send(&peers[q->gid][q->rid].flow, q, head, payload);
+}
+
+//credits of peer (g,r) for the frames drained so far, later if it is not connected yet
+static void peer_grant(int g, int r, int cls, int n)
+{
+    struct peer_queue *q = peer_ctrl(connfd_list_W[g][r]);
+    if (q == NULL)
+    {
+        flow_owe(&peers_in[g][r], cls, n);
+        //main gives what is owed once it connects, unless that was just now
+        if ((q = peer_ctrl(connfd_list_W[g][r])) == NULL || (n = flow_owed(&peers_in[g][r], cls)) == 0)
+            return;
     }
+    struct frame_head head = {OP_CREDIT, (uint8_t)gid_self, (uint8_t)rid_self, (uint8_t)cls, (uint32_t)n, 0, 0};
+    if (-1 == peer_send(q, &head, NULL))
+        VERBOSE(1, "\t[credit to (%d,%d) dropped]\n", g, r);
+}
+
+//a chunk frame of class cls from peer (g,r) is done with
+static void peer_drained(int g, int r, int cls)
+{
+    int n = flow_drained(&peers_in[g][r], cls);
+    if (n > 0)
+        peer_grant(g, r, cls, n);
+}
+
+//only send
+//one frame to the peer's queue, the writer puts it on the wire
+void *proxy_send(void *send_arg)
+{
+    //char receive_buf[100];
+    //format: local/global gid rid index_tag chunk_id
+    struct send_arg *tmp = (struct send_arg *)send_arg;
+    struct peer_queue *q = peer_chunk(tmp->connfd, tmp->chunk_id);
+
+    struct frame_head head = {(uint8_t)(tmp->global ? OP_G_ENCODE : OP_L_ENCODE), (uint8_t)tmp->gid, (uint8_t)tmp->rid, (uint8_t)tmp->index_tag, tmp->chunk_id, 0, chunk_size};
+
+    //the writer of the peer frees the payload once it is on the wire
+    int ret = -1;
+    if (q)
+        ret = peer_chunk_send(q, &head, tmp->send);
+    else
+        slab_free(tmp->send);
+    if (-1 == ret)
+        VERBOSE(1, "\t[frame to fd %d dropped]\n", tmp->connfd);
+    else if (tmp->global == 0)
+        VERBOSE(2, "\n\t****(Local data SEND) chunk_id=%u, index_tag=%d to (%d,%d)\n", tmp->chunk_id, tmp->index_tag, q->gid, q->rid);
+    else
+        VERBOSE(2, "\n\t####(Global data SEND) chunk_id=%u, index_tag=%d to (%d,%d)\n", tmp->chunk_id, tmp->index_tag, q->gid, q->rid);
+
+    free(tmp);
+    return NULL;
+}
+
+void *middle_send(void *middle_arg)
+{
+    //format: local/global gid rid chunk_id
+    struct middle_arg *tmp = (struct middle_arg *)middle_arg;
+    struct peer_queue *q = peer_chunk(tmp->connfd, tmp->chunk_id);
+
+    //a global share is one chunk per erased position
+    size_t length = tmp->global ? (size_t)tmp->count * chunk_size : chunk_size;
+    struct frame_head head = {(uint8_t)(tmp->global ? OP_G_MIDDLE : OP_L_MIDDLE), (uint8_t)tmp->gid, (uint8_t)tmp->rid, 0, tmp->chunk_id, 0, (uint32_t)length};
+
+    //the writer of the peer frees the payload once it is on the wire
+    int ret = -1;
+    if (q)
+        ret = peer_chunk_send(q, &head, tmp->middle);
+    else
+        slab_free(tmp->middle);
+    if (-1 == ret)
+        VERBOSE(1, "\t[frame to fd %d dropped]\n", tmp->connfd);
+    else if (tmp->global == 0)
+        VERBOSE(3, "\n\t****(Local middle SEND) chunk_id=%u to (%d,%d)\n", tmp->chunk_id, q->gid, q->rid);
+    else
+        VERBOSE(3, "\n\t####(Global middle SEND) chunk_id=%u, count=%d to (%d,%d)\n", tmp->chunk_id, tmp->count, q->gid, q->rid);
+
+    free(tmp);
+    return NULL;
+}
+
+void *update_send(void *update_arg)
+{
+    //format: local/global gid rid chunk_id
+    struct update_arg *tmp = (struct update_arg *)update_arg;
+    struct peer_queue *q = peer_chunk(tmp->connfd, tmp->chunk_id);
+
+    struct frame_head head = {(uint8_t)(tmp->global ? OP_G_UPDATE : OP_L_UPDATE), (uint8_t)tmp->gid, (uint8_t)tmp->rid, (uint8_t)tmp->index_tag, tmp->chunk_id, 0, chunk_size};
+
+    //the writer of the peer frees the payload once it is on the wire
+    int ret = -1;
+    if (q)
+        ret = peer_chunk_send(q, &head, tmp->update);
+    else
+        slab_free(tmp->update);
+    if (-1 == ret)
+        VERBOSE(1, "\t[frame to fd %d dropped]\n", tmp->connfd);
+    else if (tmp->global == 0)
+        VERBOSE(4, "\n\t****(Local update SEND) chunk_id=%u to (%d,%d)\n", tmp->chunk_id, q->gid, q->rid);
+    else
+        VERBOSE(4, "\n\t####(Global update SEND) chunk_id=%u to (%d,%d)\n", tmp->chunk_id, q->gid, q->rid);
+
+    free(tmp);
+    return NULL;
+}
+
+void *update_ack_send(void *update_ack_arg)
+{
+    struct update_ack_arg *tmp = (struct update_ack_arg *)update_ack_arg;
+    struct peer_queue *q = peer_ctrl(tmp->connfd);
+
+    struct frame_head head = {(uint8_t)(tmp->global ? OP_G_UPDATE_ACK : OP_L_UPDATE_ACK), (uint8_t)tmp->gid, (uint8_t)tmp->rid, 0, 0, 0, 0};
+
+    int ret = q ? peer_send(q, &head, NULL) : -1;
+    if (-1 == ret)
+        VERBOSE(1, "\t[frame to fd %d dropped]\n", tmp->connfd);
+    else if (tmp->global == 0)
+        VERBOSE(4, "\n\t****(Local update ack SEND) to (%d,%d)\n", q->gid, q->rid);
+    else
+        VERBOSE(4, "\n\t####(Global update ack SEND) to (%d,%d)\n", q->gid, q->rid);
 
     free(tmp);
     return NULL;
@@ -530,40 +713,37 @@ void *gather_middle(void *gather_arg)
     // if(chunk_id % RACK == rid_self) //local parity rack
     //     total=NODE-1;
 
+    //slots take the gathered buffers directly
     unsigned char **data = (unsigned char **)calloc(NODE + 1, sizeof(unsigned char *));
-    for (int i = 0; i < NODE + 1; i++)
-        data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
 
     int count = 0;
 
     for (int i = 0; i < NODE; i++)
     {
-        if (ech->chunk_list[i][chunk_id].stat == Sealed) //have chunkID in this rack
+        if (chunk_sealed(i, chunk_id)) //have chunkID in this rack
         {
-            char *buffer = gather(ech, i, chunk_id);
+            char *buffer = gather_ring(ech, worker_ring(), i, chunk_id);
 
-            show_data(buffer, CHUNK_SIZE, "Middle data");
+            show_data(buffer, chunk_size, "Middle data");
             //same gid, same rack, diff index_tag
             //xor, do not consider order
             if (buffer) //may local, or failed
             {
                 VERBOSE(3, "\t\tIn other rack, (%u,%u) is ok\n", i, chunk_id);
-                unsigned char *pp = transfer_str_to_ustr(buffer, CHUNK_SIZE);
-                memcpy(data[count++], pp, CHUNK_SIZE);
-                free(pp);
-                free(buffer);
+                data[count++] = (unsigned char *)buffer;
             }
         }
         else
         {
             //fill it
-            memset(data[count++], 's', CHUNK_SIZE);
-            printf("In other rack, (%u,%u) is not Sealed, but is filled\n", i, chunk_id);
+            data[count] = slab_alloc(chunk_size);
+            memset(data[count++], 's', chunk_size);
+            VERBOSE(3, "In other rack, (%u,%u) is not Sealed, but is filled\n", i, chunk_id);
         }
     }
 
     //local in
-    if (chunk_id % RACK == rid_self)
+    if ((int)(chunk_id % RACK) == rid_self)
     {
         size_t value_length;
         uint32_t flags;
@@ -571,27 +751,28 @@ void *gather_middle(void *gather_arg)
 
         char key_local[100] = {0};
         sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
-        printf("\t\tIn other rack, local parity{%s} is ok\n", key_local);
-        char *local = memcached_get(ech->ring, key_local, strlen(key_local), &value_length, &flags, &rc);
+        VERBOSE(3, "\t\tIn other rack, local parity{%s} is ok\n", key_local);
+        char *local = memcached_get(worker_ring(), key_local, strlen(key_local), &value_length, &flags, &rc);
         if (local)
         {
-            unsigned char *pp = transfer_str_to_ustr(local, CHUNK_SIZE);
-            show_local(pp);
-            memcpy(data[count++], pp, CHUNK_SIZE);
-            free(pp);
+            data[count] = chunk_from_value(local, value_length);
+            show_local(data[count++]);
         }
         else
         {
-            memset(data[count++], 'f', CHUNK_SIZE);
+            data[count] = slab_alloc(chunk_size);
+            memset(data[count++], 'f', chunk_size);
             VERBOSE(3, "\tIn other rack, local parity{%s} is nok, maybe not encoded, but is filled\n", key_local);
         }
     }
 
-    printf("count=%u, NODE=%u\n", count, NODE);
+    VERBOSE(3, "count=%u, NODE=%u\n", count, NODE);
 
     //if (count == NODE) //must be in, count ==NODE
     //{
         VERBOSE(3, "Middle is ready\n");
+        if (data[NODE] == NULL)
+            data[NODE] = slab_zalloc(chunk_size);
         unsigned char *middle = l_middle(data, NODE);
         //middle pool
         struct middle_arg *lm = (struct middle_arg *)calloc(1, sizeof(struct middle_arg));
@@ -600,25 +781,251 @@ void *gather_middle(void *gather_arg)
         lm->gid = gid_self;
         lm->rid = rid_self;
         lm->chunk_id = chunk_id;
-        memcpy(lm->middle, middle, CHUNK_SIZE);
+        lm->count = 1;
+        //the middle slot goes to middle_send as is
+        lm->middle = middle;
+        data[NODE] = NULL;
 
-        threadpool_add_job(middle_pool, middle_send, lm);
+        sched_add_serial(peer_serial(lm->connfd, SCHED_MIDDLE), SCHED_MIDDLE, middle_send, lm);
         VERBOSE(3, "\n\t\t$$$$Add [Local middle] task to (%d,%d), chunk_id=%d\n", chunk_id % GROUP, tmp->rid, chunk_id);
     //}
 
     for (int i = 0; i < NODE + 1; i++)
     {
-        free(data[i]);
+        slab_free(data[i]);
     }
     free(data);
 }
 
+//share of this proxy in the erased chunks of a global stripe, sent to the repairing proxy
+//data chunks, the local parity of the repairing group and the global parities, whichever are here
+void *gather_global_middle(void *gather_arg)
+{
+    struct gather_arg *tmp = (struct gather_arg *)gather_arg;
+    uint32_t chunk_id = tmp->chunk_id;
+    if (tmp->gid == (int)(chunk_id % GROUP))
+    {
+        //the data of that group is not in the global stripe
+        VERBOSE(3, "\tGlobal middle of chunk_id=%u asked by its own group %d\n", chunk_id, tmp->gid);
+        free(tmp);
+        return NULL;
+    }
+    int group = tmp->gid - (tmp->gid > (int)(chunk_id % GROUP));
+
+    struct decode_entry *entry = decode_get(tmp->erasure, group);
+    if (entry == NULL)
+    {
+        VERBOSE(3, "\tGlobal middle of chunk_id=%u, erasure=%llx can not be decoded\n", chunk_id, (unsigned long long)tmp->erasure);
+        free(tmp);
+        return NULL;
+    }
+
+    unsigned char *middle = slab_zalloc((size_t)entry->nerr * chunk_size);
+    unsigned char *rows[GN - GK + 1];
+    for (int i = 0; i < entry->nerr; i++)
+        rows[i] = middle + (size_t)i * chunk_size;
+
+    size_t value_length;
+    uint32_t flags;
+    memcached_return_t rc;
+
+    //data chunks of this rack
+    if (gid_self != (int)(chunk_id % GROUP))
+    {
+        for (int i = 0; i < NODE; i++)
+        {
+            if (!chunk_sealed(i, chunk_id))
+                continue;
+            int pos = global_offset(gid_self, rid_self, i, chunk_id);
+            if ((tmp->erasure >> pos) & 1)
+                continue;
+            char *buffer = gather_ring(ech, worker_ring(), i, chunk_id);
+            if (buffer)
+            {
+                g_middle_update(entry, pos, (unsigned char *)buffer, rows);
+                free(buffer);
+            }
+        }
+    }
+
+    //local parity of the repairing group
+    if (gid_self == tmp->gid && (int)(chunk_id % RACK) == rid_self && !((tmp->erasure >> GN) & 1))
+    {
+        char key_local[100] = {0};
+        sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
+        char *local = memcached_get(worker_ring(), key_local, strlen(key_local), &value_length, &flags, &rc);
+        if (local)
+        {
+            unsigned char *parity = chunk_from_value(local, value_length);
+            g_middle_update(entry, GN, parity, rows);
+            free(parity);
+        }
+        else
+            VERBOSE(3, "\tLocal parity{%s} is nok for global middle\n", key_local);
+    }
+
+    //global parities
+    if (gid_self == (int)(chunk_id % GROUP) && (int)(chunk_id % RACK) == rid_self)
+    {
+        for (int i = 0; i < GN - GK; i++)
+        {
+            if ((tmp->erasure >> (GK + i)) & 1)
+                continue;
+            char key_global[100] = {0};
+            sprintf(key_global, "global-%d[%d]", chunk_id, i);
+            char *global = memcached_get(worker_ring(), key_global, strlen(key_global), &value_length, &flags, &rc);
+            if (global)
+            {
+                unsigned char *parity = chunk_from_value(global, value_length);
+                g_middle_update(entry, GK + i, parity, rows);
+                free(parity);
+            }
+            else
+                VERBOSE(3, "\tGlobal parity{%s} is nok for global middle\n", key_global);
+        }
+    }
+
+    struct middle_arg *gm = (struct middle_arg *)calloc(1, sizeof(struct middle_arg));
+    gm->connfd = tmp->connfd;
+    gm->global = 1;
+    gm->gid = gid_self;
+    gm->rid = rid_self;
+    gm->chunk_id = chunk_id;
+    gm->count = entry->nerr;
+    gm->middle = middle;
+    decode_put(entry);
+
+    sched_add_serial(peer_serial(gm->connfd, SCHED_MIDDLE), SCHED_MIDDLE, middle_send, gm);
+    VERBOSE(3, "\n\t\t####Add [Global middle] task to (%d,%d), chunk_id=%u\n", tmp->gid, tmp->rid, chunk_id);
+
+    free(tmp);
+    return NULL;
+}
+
 int local_can_repair = 0;
 int local_repair_wait_num = 0;
 struct local_repair_arg *local_repair_list = NULL;
 pthread_mutex_t local_repair_mutex;
 pthread_cond_t local_repair_cond;
 
+static int repair_ready(struct local_repair_arg *p)
+{
+    if (p->global)
+        return p->need == p->expect;
+    return p->need == RACK - 1 + NODE - 1;
+}
+
+//more than one chunk of the local stripe is lost in this rack, decode with the global stripe
+//own share goes into decoded, other proxies send theirs as g-middle
+static void global_repair(struct local_repair_arg *tmp, uint64_t erasure)
+{
+    uint32_t chunk_id = tmp->chunk_id;
+    int group = gid_self - (gid_self > (int)(chunk_id % GROUP));
+
+    //the data of chunk_id % GROUP is not in the global stripe, its chunks are never decoded with it
+    struct decode_entry *entry = NULL;
+    if (gid_self != (int)(chunk_id % GROUP))
+        entry = decode_get(erasure, group);
+    if (entry == NULL)
+    {
+        VERBOSE(3, "\n\t$$$$CANOT DECODE, chunk_id=%u, erasure=%llx\n", chunk_id, (unsigned long long)erasure);
+        //drop it, nothing will come for it
+        pthread_mutex_lock(&local_repair_mutex);
+        struct local_repair_arg *p = local_repair_list, *q = p;
+        while (p && p != tmp)
+        {
+            q = p;
+            p = p->next;
+        }
+        if (p == local_repair_list)
+            local_repair_list = p->next;
+        else if (p)
+            q->next = p->next;
+        pthread_mutex_unlock(&local_repair_mutex);
+
+        slab_free(tmp->recovery_data);
+        free(tmp);
+        return;
+    }
+
+    int target = global_offset(gid_self, rid_self, tmp->index_tag, chunk_id);
+    tmp->nerr = entry->nerr;
+    for (int i = 0; i < entry->nerr; i++)
+    {
+        tmp->decoded[i] = slab_zalloc(chunk_size);
+        if (entry->erased[i] == target)
+            tmp->target_row = i;
+    }
+
+    //own share, before any g-middle can come
+    for (int i = 0; i < NODE; i++)
+    {
+        if (!chunk_sealed(i, chunk_id))
+            continue;
+        int pos = global_offset(gid_self, rid_self, i, chunk_id);
+        if ((erasure >> pos) & 1)
+            continue;
+        char *buffer = gather_ring(ech, worker_ring(), i, chunk_id);
+        if (buffer)
+        {
+            g_middle_update(entry, pos, (unsigned char *)buffer, tmp->decoded);
+            free(buffer);
+        }
+    }
+    if ((int)(chunk_id % RACK) == rid_self && !((erasure >> GN) & 1))
+    {
+        size_t value_length;
+        uint32_t flags;
+        memcached_return_t rc;
+        char key_local[100] = {0};
+        sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
+        char *local = memcached_get(worker_ring(), key_local, strlen(key_local), &value_length, &flags, &rc);
+        if (local)
+        {
+            unsigned char *parity = chunk_from_value(local, value_length);
+            g_middle_update(entry, GN, parity, tmp->decoded);
+            free(parity);
+        }
+    }
+    decode_put(entry);
+
+    //every other rack holding data of this stripe, and the global parity rack
+    int targets[GROUP * RACK][2], n = 0;
+    for (int g = 0; g < GROUP; g++)
+    {
+        for (int r = 0; r < RACK; r++)
+        {
+            if (g == gid_self && r == rid_self)
+                continue;
+            if (g == (int)(chunk_id % GROUP) && r != (int)(chunk_id % RACK))
+                continue;
+            targets[n][0] = g;
+            targets[n++][1] = r;
+        }
+    }
+
+    pthread_mutex_lock(&local_repair_mutex);
+    tmp->erasure = erasure;
+    tmp->expect = n;
+    tmp->need = 0;
+    tmp->global = 1;
+    pthread_mutex_unlock(&local_repair_mutex);
+
+    for (int i = 0; i < n; i++)
+    {
+        //g-gather-middle, (gid_self rid_self) chunkid, the erasure as payload
+        struct frame_head head = {OP_G_GATHER_MIDDLE, (uint8_t)gid_self, (uint8_t)rid_self, 0, chunk_id, 0, sizeof(uint64_t)};
+        uint64_t wire = htobe64(erasure);
+
+        struct peer_queue *q = peer_ctrl(connfd_list_W[targets[i][0]][targets[i][1]]);
+        int ret = q ? peer_send_copy(q, &head, &wire) : -1;
+        if (-1 == ret)
+            VERBOSE(1, "\t[frame to (%d,%d) dropped]\n", targets[i][0], targets[i][1]);
+        else
+            VERBOSE(3, "\n\t####(Global gather middle SEND) chunk_id=%u, erasure=%llx to (%d,%d)\n", chunk_id, (unsigned long long)erasure, targets[i][0], targets[i][1]);
+    }
+}
+
 //repair chunk ==>degraded read
 void *repair_chunk(void *local_repair_arg)
 {
@@ -626,52 +1033,76 @@ void *repair_chunk(void *local_repair_arg)
 
     VERBOSE(3, "\n\t$$$$Add [Repair KV] task kv in index_tag=%u, chunk_id=%u, offset=%u, length=%u\n", tmp->index_tag, tmp->chunk_id, tmp->offset, tmp->length);
 
+    //local parity covers one lost chunk in the local stripe, look for more in this rack
+    uint64_t erasure = 1ull << global_offset(gid_self, rid_self, tmp->index_tag, tmp->chunk_id);
+    int lost = 0;
+    for (int i = 0; i < NODE; i++)
+    {
+        if (i != (int)tmp->index_tag && chunk_sealed(i, tmp->chunk_id) && chunk_lost(i, tmp->chunk_id))
+        {
+            erasure |= 1ull << global_offset(gid_self, rid_self, i, tmp->chunk_id);
+            lost++;
+        }
+    }
+    if ((int)(tmp->chunk_id % RACK) == rid_self)
+    {
+        char key_local[100] = {0};
+        sprintf(key_local, "local-%d-%d", gid_self, tmp->chunk_id);
+        if (memcached_exist(worker_ring(), key_local, strlen(key_local)) != MEMCACHED_SUCCESS)
+        {
+            erasure |= 1ull << GN;
+            lost++;
+        }
+    }
+    if (lost > 0)
+    {
+        VERBOSE(3, "\tIn this rack %d more chunks are lost, erasure=%llx, go global\n", lost, (unsigned long long)erasure);
+        global_repair(tmp, erasure);
+        return NULL;
+    }
+
     //all = RACK-1+NODE-1
     //this rack's data chunk
     for (int i = 0; i < NODE; i++)
     {
-        if (i == tmp->index_tag)
+        if (i == (int)tmp->index_tag)
             continue;
 
-        if (ech->chunk_list[i][tmp->chunk_id].stat == Sealed) //have chunkID in this rack
+        if (chunk_sealed(i, tmp->chunk_id)) //have chunkID in this rack
         {
-            char *buffer = gather(ech, i, tmp->chunk_id);
+            char *buffer = gather_ring(ech, worker_ring(), i, tmp->chunk_id);
 
-            show_data(buffer, CHUNK_SIZE, "Reapair data");
+            show_data(buffer, chunk_size, "Reapair data");
             //same gid, same rack, diff index_tag
             //xor, do not consider order
             if (buffer) //may local, or failed
             {
-                printf("\tchunk_list[%u][%u], used_size=%u, KV_num=%u\n", tmp->index_tag, tmp->chunk_id, ech->chunk_list[i][tmp->chunk_id].used_size, ech->chunk_list[i][tmp->chunk_id].KV_num);
+                VERBOSE(3, "\tchunk_list[%u][%u], used_size=%u, KV_num=%u\n", tmp->index_tag, tmp->chunk_id, ech->chunk_list[i][tmp->chunk_id].used_size, ech->chunk_list[i][tmp->chunk_id].KV_num);
                 VERBOSE(3, "\tIn this rack (%u,%u) is ok\n", i, tmp->chunk_id);
-                unsigned char *pp = transfer_str_to_ustr(buffer, CHUNK_SIZE);
-                memcpy(tmp->left_data[tmp->need++], pp, CHUNK_SIZE);
-                free(pp);
-                //free(buffer);
+                tmp->left_data[tmp->need++] = (unsigned char *)buffer;
             }
         }
     }
     //local in
-    if (tmp->chunk_id % RACK == rid_self)
+    if ((int)(tmp->chunk_id % RACK) == rid_self)
     {
         size_t value_length;
         uint32_t flags;
         memcached_return_t rc;
         char key_local[100] = {0};
         sprintf(key_local, "local-%d-%d", gid_self, tmp->chunk_id);
-        char *local = memcached_get(ech->ring, key_local, strlen(key_local), &value_length, &flags, &rc);
+        char *local = memcached_get(worker_ring(), key_local, strlen(key_local), &value_length, &flags, &rc);
         if (local)
         {
             VERBOSE(3, "\tIn this rack, local parity{%s} is ok\n", key_local);
-            unsigned char *pp = transfer_str_to_ustr(local, CHUNK_SIZE);
-            show_local(pp);
-            memcpy(tmp->left_data[tmp->need++], pp, CHUNK_SIZE);
-            free(pp);
+            tmp->left_data[tmp->need] = chunk_from_value(local, value_length);
+            show_local(tmp->left_data[tmp->need++]);
         }
         else
         {
             //fill in
-            memset(tmp->left_data[tmp->need++], 'f', CHUNK_SIZE);
+            tmp->left_data[tmp->need] = slab_alloc(chunk_size);
+            memset(tmp->left_data[tmp->need++], 'f', chunk_size);
             VERBOSE(3, "\tIn this rack, local parity{%s} is nok, maybe not encoded\n", key_local);
         }
     }
@@ -697,19 +1128,18 @@ void *repair_chunk(void *local_repair_arg)
                 continue;
 
             //notify other rack to provide data
-            char send_com[COMMAND_SIZE];
-            memset(send_com, 0, COMMAND_SIZE);
-
             //l-gather-middle, (gid rid_self) chunkid
-            sprintf(send_com, "%s %d %d %u", "l-gather-middle", gid_self, rid_self, tmp->chunk_id);
+            struct frame_head head = {OP_L_GATHER_MIDDLE, (uint8_t)gid_self, (uint8_t)rid_self, 0, tmp->chunk_id, 0, 0};
 
-            int ret = send(connfd_list_W[gid_self][i], send_com, COMMAND_SIZE, 0);
+            struct peer_queue *q = peer_ctrl(connfd_list_W[gid_self][i]);
+            int ret = q ? peer_send_copy(q, &head, NULL) : -1;
             if (-1 == ret)
-                print_err("send failed", errno);
+                VERBOSE(1, "\t[frame to (%d,%d) dropped]\n", gid_self, i);
             else
-                VERBOSE(3, "\n\t****(Local middle SEND command) (%s) to (%d,%d)\n", send_com, gid_self, i);
+                VERBOSE(3, "\n\t****(Local gather middle SEND) chunk_id=%u to (%d,%d)\n", tmp->chunk_id, gid_self, i);
         }
     }
+    return NULL;
 }
 
 void *local_repair(void *arg)
@@ -737,7 +1167,7 @@ void *local_repair(void *arg)
             VERBOSE(3, "\nReapair_list == NULL\n");
         }
 
-        if (p->need == RACK - 1 + NODE - 1)
+        if (repair_ready(p))
         {
             local_repair_list = p->next;
         }
@@ -746,7 +1176,7 @@ void *local_repair(void *arg)
             p = p->next;
             while (p)
             {
-                if (p->need == RACK - 1 + NODE - 1)
+                if (repair_ready(p))
                 {
                     q->next = p->next;
                     break;
@@ -763,13 +1193,15 @@ void *local_repair(void *arg)
 
         //decode
         VERBOSE(3, "Repair is ready\n");
-        unsigned char *fail_chunk = l_decode(p->left_data, p->recovery_data, p->need);
+        unsigned char *fail_chunk;
+        if (p->global)
+            fail_chunk = p->decoded[p->target_row];
+        else
+            fail_chunk = l_decode(p->left_data, p->recovery_data, p->need);
 
         //get value by offset and length
-        char *v = transfer_ustr_to_str(fail_chunk, CHUNK_SIZE);
         char *value = (char *)calloc(1, (p->length + 1) * sizeof(char));
-        memcpy(value, v + p->offset, p->length);
-        free(v);
+        memcpy(value, fail_chunk + p->offset, p->length);
 
         //get failed value
         //VERBOSE(4,"\n\nGET FAILED VALUE key:{%s} ==> {%s}\n\n", p->key, value);
@@ -777,12 +1209,12 @@ void *local_repair(void *arg)
         free(value);
 
         //send to server
-        // char send_buf[CHUNK_SIZE];
-        // memset(send_buf,0,CHUNK_SIZE);
+        // char send_buf[REQUEST_SIZE];
+        // memset(send_buf,0,REQUEST_SIZE);
 
         // sprintf(send_buf, "%s %s %s", "recovery", p->key, value);
 
-        // int ret = send(connfd_server, send_buf, CHUNK_SIZE, 0);
+        // int ret = send(connfd_server, send_buf, REQUEST_SIZE, 0);
         // if (-1 == ret)
         //     print_err("send failed", errno);
         // else
@@ -821,12 +1253,20 @@ void *local_repair(void *arg)
 
             for (int i = 0; i < RACK - 1 + NODE - 1; i++)
             {
-                memset(local_repair_list->left_data[i], 0, CHUNK_SIZE);
+                slab_free(local_repair_list->left_data[i]);
+                local_repair_list->left_data[i] = NULL;
             }
             //for one
-            memset(local_repair_list->recovery_data, 0, CHUNK_SIZE);
+            memset(local_repair_list->recovery_data, 0, chunk_size);
+            for (int i = 0; i < GN - GK + 1; i++)
+            {
+                slab_free(local_repair_list->decoded[i]);
+                local_repair_list->decoded[i] = NULL;
+            }
+            local_repair_list->global = 0;
 
-            threadpool_add_job(repair_pool, repair_chunk, local_repair_list);
+            //nobody waits for this one
+            sched_add(SCHED_REPAIR_BACK, repair_chunk, local_repair_list);
 
             pthread_mutex_unlock(&local_repair_mutex);
 
@@ -849,485 +1289,641 @@ void *local_repair(void *arg)
     }
 }
 
-//work with server, for normal KV
-void *work(void *arg)
+//check_chunk_sealed copies a sealed chunk here, under ech_mutex
+static unsigned char *seal_chunk = NULL;
+
+//a data chunk of this proxy is sealed, fold it into the local and global parity, chunk is taken
+static void chunk_sealed_send(int index_tag, uint32_t chunk_id, unsigned char *chunk)
 {
-    char send_buf[CHUNK_SIZE];
-    char receive_buf[CHUNK_SIZE];
+    //global parity
+    //send to chunk_id%GROUP, chunk_id%RACK
+    //all needed to send
+    struct send_arg *gg = (struct send_arg *)calloc(1, sizeof(struct send_arg));
+    gg->connfd = connfd_list_W[chunk_id % GROUP][chunk_id % RACK];
+    gg->global = 1;
+    //come from
+    gg->gid = ech->gid;
+    gg->rid = ech->rid;
+    gg->index_tag = index_tag;
+    gg->chunk_id = chunk_id;
+    //every holder reads the one buffer, the last one done puts it back
+    gg->send = (char *)slab_ref(chunk);
+
+    //local parity
+    if ((int)(chunk_id % RACK) == rid_self)
+    {
+        //local parity in this rack, do not need to send
+        encode_add(0, gid_self, rid_self, index_tag, chunk_id, slab_ref(chunk));
+    }
+    else
+    {
+        struct send_arg *ll = (struct send_arg *)calloc(1, sizeof(struct send_arg));
+        ll->connfd = connfd_list_W[gid_self][chunk_id % RACK];
+        ll->global = 0;
+        //come from
+        ll->gid = ech->gid;
+        ll->rid = ech->rid;
+        ll->index_tag = index_tag;
+        ll->chunk_id = chunk_id;
+        ll->send = (char *)slab_ref(chunk);
+
+        //send to this group, chunkID%RACK
+        VERBOSE(2, "\n\t****Add [Local data] task to (%d,%d) local_encode_st, chunk_id=%d,index_tag=%d\n", gid_self, chunk_id % RACK, chunk_id, index_tag);
+        sched_add_serial(peer_serial(ll->connfd, SCHED_SEND), SCHED_SEND, proxy_send, ll);
+    }
 
-    int fd = (long)arg;
-    enum status status_now = conn_init;
+    //send to this group, chunkID%RACK
+    VERBOSE(2, "\n\t####Add [Global data] task to (%d,%d) global_encode_st, chunk_id=%d,index_tag=%d\n", chunk_id % GROUP, chunk_id % RACK, chunk_id, index_tag);
+    sched_add_serial(peer_serial(gg->connfd, SCHED_SEND), SCHED_SEND, proxy_send, gg);
+    slab_free(chunk);
+}
 
-    while (status_now != conn_close)
+static void request_set(const char *key, const char *value, char *send_buf)
+{
+    //for(int i=0;i<20;i++)
+    //    memcpy(value+20*i,str,20);
+    //memset(value,key[4],500);
+
+    //the chunk index is shared by every request worker
+    pthread_mutex_lock(&ech_mutex);
+    memcached_return rc = ECHash_set(ech, key, strlen(key), value, strlen(value), 0, 0);
+
+    //check sealed data chunk
+    int index_tag;
+    uint32_t chunk_id = 0;
+    unsigned char *chunk = NULL;
+    if ((index_tag = check_chunk_sealed(ech, (char *)seal_chunk, &chunk_id)) != -1)
     {
-        switch (status_now)
-        {
-        case conn_wait:
+        chunk = seal_chunk;
+        seal_chunk = slab_alloc(chunk_size);
+    }
+    pthread_mutex_unlock(&ech_mutex);
+
+    if (rc == MEMCACHED_SUCCESS)
+    {
+        VERBOSE(1, "\tSET:[%s] ok\n", key);
+        snprintf(send_buf, REQUEST_SIZE, "ack kv{%s} STORED OK", key);
+    }
+    else
+    {
+        VERBOSE(1, "\tSET:[%s] not ok\n", key);
+        snprintf(send_buf, REQUEST_SIZE, "ack kv{%s} STORED NOK", key);
+    }
+
+    if (chunk)
+        chunk_sealed_send(index_tag, chunk_id, chunk);
+}
+
+//the value of key is lost, repair it from the rest of its stripe
+static void degraded_read(const char *key)
+{
+    //degraded read data
+    //local_repair_list
+    pthread_mutex_lock(&ech_mutex);
+    struct index_entry value = get_value_hash_table(ech->hash_table, key);
+    int sealed = ech->chunk_list[value.index_tag][value.chunk_id].stat == Sealed;
+    pthread_mutex_unlock(&ech_mutex);
+
+    uint32_t index_tag = value.index_tag;
+    uint32_t chunk_id = value.chunk_id;
+    uint32_t offset = value.position;
+    uint32_t length = value.length;
+
+    if (sealed) //encoded, then put into repair_list
+    {
+        pthread_mutex_lock(&local_repair_mutex);
+        if (local_repair_list == NULL)
         {
-            status_now = conn_read;
-            //sleep(1);
-            break;
+            local_repair_list = (struct local_repair_arg *)calloc(1, sizeof(struct local_repair_arg));
+            strcpy(local_repair_list->key, key);
+            local_repair_list->need = 0;
+            local_repair_list->next = NULL;
+            local_repair_list->index_tag = index_tag;
+            local_repair_list->chunk_id = chunk_id; //mark the repair unit
+            local_repair_list->offset = offset;
+            local_repair_list->length = length;
+
+            //time start
+            gettimeofday(&(local_repair_list->begin), NULL);
+
+            //left_data takes the gathered chunks and middles as they come
+            //for one
+            local_repair_list->recovery_data = slab_zalloc(chunk_size);
+
+            sched_add(SCHED_REPAIR, repair_chunk, local_repair_list);
         }
-        case conn_read:
+        else
         {
-            //receive message
-            memset(receive_buf, 0, CHUNK_SIZE);
-            int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-            if (-1 == ret)
+            //tail insert
+            struct local_repair_arg *p = local_repair_list, *q = p;
+            while (p)
             {
-                status_now = conn_close;
-                print_err("recv failed", errno);
+                q = p;
+                p = p->next;
             }
-            else
-            {
-                VERBOSE(1, "[GET request,%d]<={%s}\n", ret, receive_buf);
 
-                if (strcmp(receive_buf, "quit") == 0)
-                {
-                    status_now = conn_close;
-                }
+            struct local_repair_arg *new_repair = (struct local_repair_arg *)calloc(1, sizeof(struct local_repair_arg));
+            strcpy(new_repair->key, key);
+            new_repair->need = 0;
+            new_repair->next = NULL;
+            new_repair->index_tag = index_tag;
+            new_repair->chunk_id = chunk_id; //mark the repair unit
+            new_repair->offset = offset;
+            new_repair->length = length;
+
+            gettimeofday(&(new_repair->begin), NULL);
+
+            //for one
+            new_repair->recovery_data = slab_zalloc(chunk_size);
+
+            q->next = new_repair;
+            sched_add(SCHED_REPAIR, repair_chunk, new_repair);
+        }
+
+        pthread_mutex_unlock(&local_repair_mutex);
+    }
+    else
+    {
+        VERBOSE(3, "\n\t$$$$CANOT DECODE, index_tag=%u, chunk_id=%u, offset=%u, length=%u\n", index_tag, chunk_id, offset, length);
+    }
+}
+
+static void request_get(const char *key, char *send_buf)
+{
+    size_t val_len;
+    uint32_t flags;
+
+    // include dget
+    memcached_return rc;
+    char *getval = memcached_get(worker_ring(), key, strlen(key), &val_len, &flags, &rc);
+
+    //failed test
+    //if(getval[0] > 'T')
+    rc = MEMCACHED_FAILURE;
+
+    if (rc == MEMCACHED_SUCCESS)
+    {
+        VERBOSE(1, "\tGET:[%s] ok\n", key);
+        snprintf(send_buf, REQUEST_SIZE, "value %s %s (%d,%d)", key, getval, gid_self, rid_self);
+    }
+    else
+    {
+        degraded_read(key);
+        strcpy(send_buf, "value nok, START DEGRARED READ!");
+    }
+    free(getval);
+}
+
+//a key of an encoded chunk got a new value, move the delta from old into the parities
+//-1 if its chunk is not encoded yet
+//the delta of a value that went from old to value, both are zero padded to the length in the chunk
+static int update_parity(struct index_entry vv, int sealed, const char *old, size_t old_length, const char *value, size_t value_length)
+{
+    if (!sealed)
+        return -1;
+    uint32_t chunk_id = vv.chunk_id;
+    uint32_t offset = vv.position;
+    uint32_t length = vv.length;
+    size_t val_len;
+    uint32_t flags;
+    memcached_return rc;
+
+    //update delta of a whole chunk
+    char *delta = (char *)slab_zalloc(chunk_size);
+    //xor, some difference
+    if (!old)
+        old_length = 0;
+    uint32_t i, j;
+    for (i = offset, j = 0; i < offset + length && i < chunk_size; i++, j++)
+    {
+        unsigned char o = j < old_length ? old[j] : 0;
+        unsigned char n = j < value_length ? value[j] : 0;
+        delta[i] = o ^ n;
+    }
 
-                //memcached set
-                char key[100];
+    //send to local, same rack
+    if ((int)(chunk_id % RACK) == rid_self)
+    {
+        gettimeofday(&l_this_update_begin, NULL);
+        //the parity of an open stripe takes the delta before it is stored
+        if (local_delta_add(chunk_id, (unsigned char *)delta))
+            VERBOSE(4, "update local in this rack, stripe %u is open\n", chunk_id);
+        else
+        {
+            //get local parity
+            char key_local[100] = {0};
+            sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
+            char *local = memcached_get(worker_ring(), key_local, strlen(key_local), &val_len, &flags, &rc);
 
-                if (strncmp(receive_buf, "set", 3) == 0) //set
+            if (local == NULL || val_len < chunk_size)
+                VERBOSE(4, "local parity %s is missing, skip\n", key_local);
+            else
+            {
+                //xor, delta stays as it is for the global parity
+                for (uint32_t i = 0; i < chunk_size; i++)
                 {
-                    char value[CHUNK_SIZE] = {0};
-
-                    sscanf(receive_buf, "%*s %s %s", key, value);
-
-                    //for(int i=0;i<20;i++)
-                    //    memcpy(value+20*i,str,20);
-                    //memset(value,key[4],500);
-
-                    rc = ECHash_set(ech, key, strlen(key), value, strlen(value), 0, 0);
-                    if (rc == MEMCACHED_SUCCESS)
-                    {
-                        VERBOSE(1, "\tSET:[%s] ok\n", key);
-                        sprintf(send_buf, "ack kv{%s} STORED OK", key);
-                    }
-                    else
-                    {
-                        VERBOSE(1, "\tSET:[%s] not ok\n", key);
-                        sprintf(send_buf, "ack kv{%s} STORED NOK", key);
-                    }
-
-                    //check sealed data chunk
-                    char buffer[CHUNK_SIZE];
-                    int index_tag;
-                    uint32_t chunk_id = 0;
-                    if ((index_tag = check_chunk_sealed(ech, buffer, &chunk_id)) != -1)
-                    {
-                        //show_data(buffer,CHUNK_SIZE);
-                        //VERBOSE(1,"\n\n\n\n\nget a sealed data chunk,chunk_id=%d, index_tag=%d\n\n\n\n\n\n\n",chunk_id,index_tag);
-                        //local parity
-                        if (chunk_id % RACK == rid_self)
-                        {
-                            pthread_mutex_lock(&local_encode_mutex);
-
-                            if (local_encode_list == NULL)
-                            {
-                                local_encode_list = (struct local_encode_st *)calloc(1, sizeof(struct local_encode_st));
-                                local_encode_list->chunk_id = chunk_id;
-                                local_encode_list->num++;
-                                local_encode_list->next = NULL;
-                                local_wait_num++;
-
-                                //initial the encode
-                                for (int i = 0; i < LN; i++)
-                                {
-                                    local_encode_list->source_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                                }
-
-                                if (local_encode_list->num == LK)
-                                {
-                                    local_can_encode++;
-                                }
-                                unsigned char *pp = transfer_str_to_ustr(buffer, CHUNK_SIZE);
-                                memcpy(local_encode_list->source_data[local_encode_list->num - 1], pp, CHUNK_SIZE);
-                                free(pp);
-                                //show_unsigned_data(local_encode_list->source_data[local_encode_list->num-1],CHUNK_SIZE);
-                                VERBOSE(2, "\n\t****Local data(%d,%d) NEW (%d), local_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", gid_self, rid_self, local_encode_list->num, local_wait_num, local_can_encode, chunk_id, index_tag);
-                            }
-                            else
-                            {
-                                //local parity in this rack, do not need to send
-                                struct local_encode_st *p = local_encode_list, *q = p;
-                                while (p)
-                                {
-                                    if (p->chunk_id == chunk_id)
-                                    {
-                                        p->num++;
-                                        if (p->num == LK)
-                                        {
-                                            local_can_encode++;
-                                        }
-                                        unsigned char *pp = transfer_str_to_ustr(buffer, CHUNK_SIZE);
-                                        memcpy(p->source_data[p->num - 1], pp, CHUNK_SIZE);
-                                        free(pp);
-                                        //show_unsigned_data(p->source_data[p->num-1],CHUNK_SIZE);
-                                        VERBOSE(2, "\n\t****Local data(%d,%d) OLD (%d), local_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", gid_self, rid_self, p->num, local_wait_num, local_can_encode, chunk_id, index_tag);
-                                        break;
-                                    }
-                                    q = p;
-                                    p = p->next;
-                                }
-                                if (p == NULL)
-                                {
-                                    struct local_encode_st *new_encode = (struct local_encode_st *)calloc(1, sizeof(struct local_encode_st));
-                                    new_encode->chunk_id = chunk_id;
-                                    new_encode->num++;
-                                    new_encode->next = NULL;
-                                    q->next = new_encode;
-                                    local_wait_num++;
-
-                                    for (int i = 0; i < LN; i++)
-                                    {
-                                        new_encode->source_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                                    }
-
-                                    if (new_encode->num == LK)
-                                    {
-                                        local_can_encode++;
-                                    }
-                                    unsigned char *pp = transfer_str_to_ustr(buffer, CHUNK_SIZE);
-                                    memcpy(new_encode->source_data[new_encode->num - 1], pp, CHUNK_SIZE);
-                                    free(pp);
-                                    //show_unsigned_data(new_encode->source_data[new_encode->num-1], CHUNK_SIZE);
-                                    VERBOSE(2, "\n\t****Local data(%d,%d) new (%d), local_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", gid_self, rid_self, new_encode->num, local_wait_num, local_can_encode, chunk_id, index_tag);
-                                }
-                            }
-
-                            if (local_can_encode > 0)
-                            {
-                                //wake up local parity
-                                VERBOSE(2, "\nWaking up local_encode in (local)\n");
-                                pthread_cond_signal(&local_encode_cond);
-                            }
-
-                            //show_local_encode();
-                            pthread_mutex_unlock(&local_encode_mutex);
-                        }
-                        else
-                        {
-                            struct send_arg *ll = (struct send_arg *)calloc(1, sizeof(struct send_arg));
-                            ll->connfd = connfd_list_W[gid_self][chunk_id % RACK];
-                            ll->global = 0;
-                            //come from
-                            ll->gid = ech->gid;
-                            ll->rid = ech->rid;
-                            ll->index_tag = index_tag;
-                            ll->chunk_id = chunk_id;
-                            memcpy(ll->send, buffer, CHUNK_SIZE);
-
-                            //show_data(ll->send, CHUNK_SIZE);
-                            //send to this group, chunkID%RACK
-                            VERBOSE(2, "\n\t****Add [Local data] task to (%d,%d) local_encode_st, chunk_id=%d,index_tag=%d\n", gid_self, chunk_id % RACK, chunk_id, index_tag);
-                            threadpool_add_job(send_pool, proxy_send, ll);
-                        }
-
-                        //global parity
-                        //send to chunk_id%GROUP, chunk_id%RACK
-                        //all needed to send
-                        struct send_arg *gg = (struct send_arg *)calloc(1, sizeof(struct send_arg));
-                        gg->connfd = connfd_list_W[chunk_id % GROUP][chunk_id % RACK];
-                        gg->global = 1;
-                        //come from
-                        gg->gid = ech->gid;
-                        gg->rid = ech->rid;
-                        gg->index_tag = index_tag;
-                        gg->chunk_id = chunk_id;
-                        memcpy(gg->send, buffer, CHUNK_SIZE);
-
-                        //show_data(gg->send, CHUNK_SIZE);
-                        //send to this group, chunkID%RACK
-                        VERBOSE(2, "\n\t####Add [Global data] task to (%d,%d) global_encode_st, chunk_id=%d,index_tag=%d\n", chunk_id % GROUP, chunk_id % RACK, chunk_id, index_tag);
-                        threadpool_add_job(send_pool, proxy_send, gg);
-                    }
-
-                    status_now = conn_write;
-                    break;
+                    local[i] = local[i] ^ delta[i];
                 }
-                else if (strncmp(receive_buf, "get", 3) == 0) //get
+
+                //update the local
+                rc = memcached_set(worker_ring(), key_local, strlen(key_local), local, chunk_size, 0, 0);
+                if (rc == MEMCACHED_SUCCESS)
                 {
-                    sscanf(receive_buf, "%*s %s", key);
-                    size_t val_len;
-                    uint32_t flags;
-
-                    // include dget
-                    char *getval = ECHash_get(ech, key, strlen(key), &val_len, &flags, &rc);
-
-                    //failed test
-                    //if(getval[0] > 'T')
-                    rc = MEMCACHED_FAILURE;
-
-                    if (rc == MEMCACHED_SUCCESS)
-                    {
-                        VERBOSE(1, "\tGET:[%s] ok\n", key);
-                        sprintf(send_buf, "value %s %s (%d,%d)", key, getval, gid_self, rid_self);
-                    }
-                    else
-                    {
-                        //degraded read data
-                        //local_repair_list
-                        uint64_t value = get_value_hash_table(ech->hash_table, key);
-
-                        uint32_t index_tag = (uint32_t)(value >> 56);
-                        uint32_t chunk_id = (uint32_t)(value >> 24) & 0xffffffff;
-                        uint32_t offset = (uint32_t)(value >> 12) & 0xfff;
-                        uint32_t length = (uint32_t)(value & 0xfff);
-
-                        if (ech->chunk_list[index_tag][chunk_id].stat == Sealed) //encoded, then put into repair_list
-                        {
-                            pthread_mutex_lock(&local_repair_mutex);
-                            if (local_repair_list == NULL)
-                            {
-                                local_repair_list = (struct local_repair_arg *)calloc(1, sizeof(struct local_repair_arg));
-                                strcpy(local_repair_list->key, key);
-                                local_repair_list->need = 0;
-                                local_repair_list->next = NULL;
-                                local_repair_list->index_tag = index_tag;
-                                local_repair_list->chunk_id = chunk_id; //mark the repair unit
-                                local_repair_list->offset = offset;
-                                local_repair_list->length = length;
-
-                                //time start
-                                gettimeofday(&(local_repair_list->begin), NULL);
-
-                                for (int i = 0; i < RACK - 1 + NODE - 1; i++)
-                                {
-                                    local_repair_list->left_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                                }
-                                //for one
-                                local_repair_list->recovery_data = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-
-                                threadpool_add_job(repair_pool, repair_chunk, local_repair_list);
-                            }
-                            else
-                            {
-                                //tail insert
-                                struct local_repair_arg *p = local_repair_list, *q = p;
-                                while (p)
-                                {
-                                    q = p;
-                                    p = p->next;
-                                }
-
-                                struct local_repair_arg *new_repair = (struct local_repair_arg *)calloc(1, sizeof(struct local_repair_arg));
-                                strcpy(new_repair->key, key);
-                                new_repair->need = 0;
-                                new_repair->next = NULL;
-                                new_repair->index_tag = index_tag;
-                                new_repair->chunk_id = chunk_id; //mark the repair unit
-                                new_repair->offset = offset;
-                                new_repair->length = length;
-
-                                gettimeofday(&(new_repair->begin), NULL);
-
-                                for (int i = 0; i < RACK - 1 + NODE - 1; i++)
-                                {
-                                    new_repair->left_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                                }
-                                //for one
-                                new_repair->recovery_data = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-
-                                q->next = new_repair;
-                                threadpool_add_job(repair_pool, repair_chunk, new_repair);
-                            }
-
-                            pthread_mutex_unlock(&local_repair_mutex);
-                        }
-                        else
-                        {
-                            VERBOSE(3, "\n\t$$$$CANOT DECODE, index_tag=%u, chunk_id=%u, offset=%u, length=%u\n", index_tag, chunk_id, offset, length);
-                        }
-
-                        strcpy(send_buf, "value nok, START DEGRARED READ!");
-                    }
-
-                    status_now = conn_write;
-                    break;
+                    VERBOSE(4, "update local in this rack ok\n");
                 }
-                else if (strncmp(receive_buf, "update", 6) == 0) //update
+                else
                 {
-                    char value[CHUNK_SIZE] = {0};
-
-                    sscanf(receive_buf, "%*s %s %s", key, value);
-
-                    sleep(1);
-
-                    uint64_t vv = get_value_hash_table(ech->hash_table, key);
-                    uint32_t index_tag = (uint32_t)(vv >> 56);
-                    uint32_t chunk_id = (uint32_t)(vv >> 24) & 0xffffffff;
-                    uint32_t offset = (uint32_t)(vv >> 12) & 0xfff;
-                    uint32_t length = (uint32_t)(vv & 0xfff);
-
-                    //get orginal
-                    size_t val_len;
-                    uint32_t flags;
-
-                    char *getval = memcached_get(ech->ring, key, strlen(key), &val_len, &flags, &rc);
-                    rc = memcached_set(ech->ring, key, strlen(key), value, strlen(value), 0, 0);
-
-                    char delta[CHUNK_SIZE] = {0};
-                    memset(delta, 0, CHUNK_SIZE);
-                    //xor, some difference
-                    int i, j;
-                    for (i = offset, j = 0; i < length; i++)
-                    {
-                        delta[i] = delta[i] ^ getval[j++];
-                    }
-
-                    //failed
-                    if (rc != MEMCACHED_SUCCESS)
-                    {
-                        VERBOSE(4, "\tUPDATE:[%s] nok\n", key);
-                        sprintf(send_buf, "ack kv{%s} UPDATE NOK", key);
-                    }
-                    else
-                    {
-                        if (ech->chunk_list[index_tag][chunk_id].stat == Sealed) //encoded, then put into repair_list
-                        {
-                            //send to local, same rack
-                            if (chunk_id % RACK == rid_self)
-                            {
-                                gettimeofday(&l_this_update_begin, NULL);
-                                //get local parity
-                                char key_local[100] = {0};
-                                sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
-                                char *local = memcached_get(ech->ring, key_local, strlen(key_local), &val_len, &flags, &rc);
-
-                                //xor
-                                for (int i = 0; i < CHUNK_SIZE; i++)
-                                {
-                                    delta[i] = delta[i] ^ local[i];
-                                }
-
-                                //update the local
-                                rc = memcached_set(ech->ring, key_local, strlen(key_local), local, strlen(local), 0, 0);
-                                if (rc == MEMCACHED_SUCCESS)
-                                {
-                                    VERBOSE(4, "update local in this rack ok\n");
-                                }
-                                else
-                                {
-                                    VERBOSE(4, "update local in this rack nok\n");
-                                }
-                                gettimeofday(&l_this_update_end, NULL);
-
-                                double time = timeval_diff(&l_this_update_begin, &l_this_update_end);
-                                FILE *fin = fopen("l_this_rack_update.txt", "a+");
-
-                                VERBOSE(4, "\nUpdate this rack local kv{} time: %.1f us\n\n", time);
-
-                                //fprintf(fin,"\n\n In (gid,rid)=(%d,%d) Repair kv{%s} time: %.10f s\n\n*********************************************\n", gid_self, rid_self, p->key, time);
-                                fprintf(fin, "%.1f\n", time);
-                                fclose(fin);
-                            }
-                            else //send to other local parity, other rack
-                            {
-                                //update++
-                                rack_update[gid_self][rid_self]++;
-
-                                struct update_arg *uu = (struct update_arg *)calloc(1, sizeof(struct update_arg));
-                                uu->connfd = connfd_list_W[gid_self][chunk_id % RACK];
-                                uu->gid = gid_self;
-                                uu->rid = rid_self;
-                                uu->global = 0;
-                                uu->chunk_id = chunk_id;
-                                memcpy(uu->update, delta, CHUNK_SIZE);
-
-                                gettimeofday(&l_other_update_begin, NULL);
-
-                                threadpool_add_job(update_pool, update_send, uu);
-                                VERBOSE(4, "update in other racks\n");
-                            }
-
-                            //send to global parity
-                            struct update_arg *uu = (struct update_arg *)calloc(1, sizeof(struct update_arg));
-                            uu->connfd = connfd_list_W[chunk_id % GROUP][chunk_id % RACK];
-                            uu->gid = gid_self;
-                            uu->rid = rid_self;
-                            uu->global = 1;
-                            uu->chunk_id = chunk_id;
-                            memcpy(uu->update, delta, CHUNK_SIZE);
-                            gettimeofday(&g_update_begin, NULL);
-
-                            threadpool_add_job(update_pool, update_send, uu);
-                            VERBOSE(4, "update in global racks\n");
-                        }
-                        else
-                        {
-                            VERBOSE(4, "\nNOT encode\n", key);
-                            strcat(send_buf, ", but not encoded");
-                        }
-                    }
-                    status_now = conn_write;
-                    break;
+                    VERBOSE(4, "update local in this rack nok\n");
                 }
             }
-            break;
+            free(local);
         }
-        case conn_write:
-        {
-            // scanf("%[^\n]",send_buf);
-            // getchar();
-            //VERBOSE("s=%s\n",send_buf);
+        gettimeofday(&l_this_update_end, NULL);
 
-            //sprintf(send_buf,"I receive [%s]!",receive_buf);
-            //sleep(1);
-            int ret = send(fd, send_buf, CHUNK_SIZE, 0);
-            if (-1 == ret)
-                print_err("send failed", errno);
-            else
-                VERBOSE(1, "\t[SEND request ack,%d]=>{%s}\n", ret, send_buf);
+        double time = timeval_diff(&l_this_update_begin, &l_this_update_end);
+        FILE *fin = fopen("l_this_rack_update.txt", "a+");
 
-            status_now = conn_read;
-            memset(send_buf, 0, CHUNK_SIZE);
+        VERBOSE(4, "\nUpdate this rack local kv{} time: %.1f us\n\n", time);
+
+        //fprintf(fin,"\n\n In (gid,rid)=(%d,%d) Repair kv{%s} time: %.10f s\n\n*********************************************\n", gid_self, rid_self, p->key, time);
+        fprintf(fin, "%.1f\n", time);
+        fclose(fin);
+    }
+    else //send to other local parity, other rack
+    {
+        //update++
+        rack_update[gid_self][rid_self]++;
+
+        struct update_arg *uu = (struct update_arg *)calloc(1, sizeof(struct update_arg));
+        uu->connfd = connfd_list_W[gid_self][chunk_id % RACK];
+        uu->gid = gid_self;
+        uu->rid = rid_self;
+        uu->global = 0;
+        uu->index_tag = vv.index_tag;
+        uu->chunk_id = chunk_id;
+        uu->update = slab_ref(delta);
+
+        gettimeofday(&l_other_update_begin, NULL);
+
+        sched_add_serial(peer_serial(uu->connfd, SCHED_UPDATE), SCHED_UPDATE, update_send, uu);
+        VERBOSE(4, "update in other racks\n");
+    }
+
+    //send to global parity
+    struct update_arg *uu = (struct update_arg *)calloc(1, sizeof(struct update_arg));
+    uu->connfd = connfd_list_W[chunk_id % GROUP][chunk_id % RACK];
+    uu->gid = gid_self;
+    uu->rid = rid_self;
+    uu->global = 1;
+    uu->index_tag = vv.index_tag;
+    uu->chunk_id = chunk_id;
+    uu->update = slab_ref(delta);
+    gettimeofday(&g_update_begin, NULL);
+
+    sched_add_serial(peer_serial(uu->connfd, SCHED_UPDATE), SCHED_UPDATE, update_send, uu);
+    VERBOSE(4, "update in global racks\n");
+    slab_free(delta);
+    return 0;
+}
+
+static void request_update(const char *key, const char *value, char *send_buf)
+{
+    sleep(1);
+
+    pthread_mutex_lock(&ech_mutex);
+    struct index_entry vv = get_value_hash_table(ech->hash_table, key);
+    int sealed = ech->chunk_list[vv.index_tag][vv.chunk_id].stat == Sealed;
+    pthread_mutex_unlock(&ech_mutex);
+
+    //get orginal
+    size_t val_len;
+    uint32_t flags;
+
+    memcached_return rc;
+    char *getval = memcached_get(worker_ring(), key, strlen(key), &val_len, &flags, &rc);
+    rc = memcached_set(worker_ring(), key, strlen(key), value, strlen(value), 0, 0);
+
+    //failed
+    if (rc != MEMCACHED_SUCCESS)
+    {
+        VERBOSE(4, "\tUPDATE:[%s] nok\n", key);
+        snprintf(send_buf, REQUEST_SIZE, "ack kv{%s} UPDATE NOK", key);
+    }
+    else if (update_parity(vv, sealed, getval, val_len, value, strlen(value)) == -1)
+    {
+        VERBOSE(4, "\nNOT encode\n", key);
+        strcat(send_buf, ", but not encoded");
+    }
+    free(getval);
+}
+
+//one request of the requestor, served by a request worker
+struct request_arg
+{
+    struct frame_head head;
+    char *payload; //key '\0' value, NUL ended
+};
+
+//replies go through the queue, workers finish in any order, the request_id tells them apart
+struct peer_queue requestor_queue;
+
+static int batch_op(int opcode)
+{
+    return opcode == OP_MSET || opcode == OP_MGET || opcode == OP_MUPDATE;
+}
+
+//one key of a batch
+struct batch_key
+{
+    char key[100];
+    const char *value; //into the request payload
+    size_t value_length;
+    uint8_t status;
+    char *found; //value read for mget and mupdate, NULL if the key has none
+    size_t found_length;
+};
+
+//values of the n keys of b, one request a server instead of one a key
+static void batch_fetch(memcached_st *ring, struct batch_key *b, int n)
+{
+    const char **keys = (const char **)malloc(n * sizeof(char *));
+    size_t *lengths = (size_t *)malloc(n * sizeof(size_t));
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = b[i].key;
+        lengths[i] = strlen(b[i].key);
+    }
+
+    memcached_return rc = memcached_mget(ring, keys, lengths, n);
+    memcached_result_st *res;
+    while (rc == MEMCACHED_SUCCESS && (res = memcached_fetch_result(ring, NULL, &rc)) != NULL)
+    {
+        //values come server by server, not in the order of the keys
+        const char *key = memcached_result_key_value(res);
+        size_t key_length = memcached_result_key_length(res);
+        for (int i = 0; i < n; i++)
+        {
+            if (b[i].found || lengths[i] != key_length || memcmp(keys[i], key, key_length))
+                continue;
+            b[i].found_length = memcached_result_length(res);
+            b[i].found = (char *)malloc(b[i].found_length + 1);
+            memcpy(b[i].found, memcached_result_value(res), b[i].found_length);
+            b[i].found[b[i].found_length] = '\0';
             break;
         }
-        case conn_init:
+        memcached_result_free(res);
+    }
+    free(keys);
+    free(lengths);
+}
+
+//sets of a batch go out without waiting for a reply each, the index is kept as in request_set
+//status is whether a set was written, memcached does not answer noreply sets
+static void batch_set(struct batch_key *b, int n)
+{
+    int *index_tag = (int *)malloc(n * sizeof(int));
+    uint32_t *chunk_id = (uint32_t *)malloc(n * sizeof(uint32_t));
+    unsigned char **chunk = (unsigned char **)calloc(n, sizeof(unsigned char *));
+
+    pthread_mutex_lock(&ech_mutex);
+    memcached_behavior_set(ech->ring, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    for (int i = 0; i < n; i++)
+    {
+        memcached_return rc = ECHash_set(ech, b[i].key, strlen(b[i].key), b[i].value, b[i].value_length, 0, 0);
+        b[i].status = rc == MEMCACHED_SUCCESS ? ENTRY_OK : ENTRY_NOK;
+
+        //a batch can seal more than one chunk
+        if ((index_tag[i] = check_chunk_sealed(ech, (char *)seal_chunk, &chunk_id[i])) != -1)
         {
-            //getchar();
-            memset(send_buf, 0, CHUNK_SIZE);
-            sprintf(send_buf, "CONN %d %d", gid_self, rid_self);
-            // scanf("%[^\n]",send_buf);
-            // getchar();
-            //VERBOSE(1,"s=%s\n",send_buf);
+            chunk[i] = seal_chunk;
+            seal_chunk = slab_alloc(chunk_size);
+        }
+    }
+    memcached_behavior_set(ech->ring, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+    pthread_mutex_unlock(&ech_mutex);
 
-            //sprintf(send_buf,"I receive [%s]!",receive_buf);
-            //sleep(1);
-            int ret = send(fd, send_buf, COMMAND_SIZE, 0);
-            if (-1 == ret)
-                print_err("send failed", errno);
-            else
-                VERBOSE(1, "\t[SEND connect,%d]=>{%s}\n", ret, send_buf);
+    for (int i = 0; i < n; i++)
+    {
+        VERBOSE(1, "\tMSET:[%s] %s\n", b[i].key, b[i].status == ENTRY_OK ? "ok" : "not ok");
+        if (chunk[i])
+            chunk_sealed_send(index_tag[i], chunk_id[i], chunk[i]);
+    }
+    free(index_tag);
+    free(chunk_id);
+    free(chunk);
+}
 
-            status_now = conn_wait;
-            memset(send_buf, 0, CHUNK_SIZE);
-            break;
+static void batch_get(struct batch_key *b, int n)
+{
+    batch_fetch(worker_ring(), b, n);
+    for (int i = 0; i < n; i++)
+    {
+        if (b[i].found)
+        {
+            VERBOSE(1, "\tMGET:[%s] ok\n", b[i].key);
+            b[i].status = ENTRY_OK;
         }
-        case conn_close:
+        else
         {
-            VERBOSE(1, "\n\nconn_close\n");
+            degraded_read(b[i].key);
+            b[i].status = ENTRY_NOK;
+        }
+    }
+}
+
+//request_update for n keys, the old values come in one mget and the new ones go out without replies
+static void batch_update(struct batch_key *b, int n)
+{
+    struct index_entry *vv = (struct index_entry *)malloc(n * sizeof(struct index_entry));
+    int *sealed = (int *)malloc(n * sizeof(int));
+    pthread_mutex_lock(&ech_mutex);
+    for (int i = 0; i < n; i++)
+    {
+        vv[i] = get_value_hash_table(ech->hash_table, b[i].key);
+        sealed[i] = ech->chunk_list[vv[i].index_tag][vv[i].chunk_id].stat == Sealed;
+    }
+    pthread_mutex_unlock(&ech_mutex);
+
+    memcached_st *ring = worker_ring();
+    batch_fetch(ring, b, n);
+
+    memcached_behavior_set(ring, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    for (int i = 0; i < n; i++)
+    {
+        memcached_return rc = memcached_set(ring, b[i].key, strlen(b[i].key), b[i].value, b[i].value_length, 0, 0);
+        b[i].status = rc == MEMCACHED_SUCCESS ? ENTRY_OK : ENTRY_NOK;
+    }
+    memcached_behavior_set(ring, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (b[i].status != ENTRY_OK)
+            VERBOSE(4, "\tMUPDATE:[%s] nok\n", b[i].key);
+        else if (update_parity(vv[i], sealed[i], b[i].found, b[i].found_length, b[i].value, b[i].value_length) == -1)
+            VERBOSE(4, "\tMUPDATE:[%s] not encoded\n", b[i].key);
+        //the old value is not sent back
+        free(b[i].found);
+        b[i].found = NULL;
+        b[i].found_length = 0;
+    }
+    free(vv);
+    free(sealed);
+}
+
+//mset, mget and mupdate, one OP_BATCH_REPLY entry a key in request order
+static void batch_serve(struct request_arg *ra)
+{
+    int n = ra->head.chunk_id;
+    struct batch_key *b = (struct batch_key *)calloc(n ? n : 1, sizeof(struct batch_key));
+    const unsigned char *in = (const unsigned char *)ra->payload, *end = in + ra->head.length;
+    struct frame_entry e;
+    for (int i = 0; i < n; i++)
+    {
+        if (-1 == frame_entry_next(&in, end, &e))
+        {
+            //a short payload ends the batch where it is cut
+            n = i;
             break;
         }
+        snprintf(b[i].key, sizeof(b[i].key), "%.*s", (int)(e.key_length < sizeof(b[i].key) ? e.key_length : sizeof(b[i].key) - 1), (const char *)e.key);
+        b[i].value = (const char *)e.value;
+        b[i].value_length = e.value_length;
+    }
+
+    VERBOSE(1, "[GET request %u,%u]<={%s %d keys}\n", ra->head.request_id, ra->head.length, frame_op_name(ra->head.opcode), n);
+
+    if (ra->head.opcode == OP_MSET)
+        batch_set(b, n);
+    else if (ra->head.opcode == OP_MGET)
+        batch_get(b, n);
+    else
+        batch_update(b, n);
+
+    size_t length = 0;
+    for (int i = 0; i < n; i++)
+        length += FRAME_ENTRY_HEAD + strlen(b[i].key) + b[i].found_length;
+    unsigned char *send_buf = (unsigned char *)malloc(length ? length : 1);
+    unsigned char *out = send_buf;
+    for (int i = 0; i < n; i++)
+    {
+        struct frame_entry r = {b[i].status, (uint16_t)strlen(b[i].key), (uint32_t)b[i].found_length,
+                                (const unsigned char *)b[i].key, (const unsigned char *)b[i].found};
+        out = frame_entry_put(out, &r);
+        free(b[i].found);
+    }
+    free(b);
+
+    uint32_t request_id = ra->head.request_id;
+    struct frame_head reply = {OP_BATCH_REPLY, (uint8_t)gid_self, (uint8_t)rid_self, 0, (uint32_t)n, request_id, (uint32_t)length};
+    free(ra->payload);
+    free(ra);
+
+    if (-1 == peer_send(&requestor_queue, &reply, send_buf))
+        VERBOSE(1, "\t[reply %u dropped]\n", request_id);
+    else
+        VERBOSE(1, "\t[SEND batch ack %u, %d keys]\n", request_id, n);
+}
+
+void *request_serve(void *arg)
+{
+    struct request_arg *ra = (struct request_arg *)arg;
+    if (batch_op(ra->head.opcode))
+    {
+        batch_serve(ra);
+        return NULL;
+    }
+    char *send_buf = (char *)calloc(REQUEST_SIZE, sizeof(char));
+
+    //payload is key '\0' value, the value is empty for get
+    size_t key_len = strnlen(ra->payload, ra->head.length);
+    char key[100];
+    snprintf(key, sizeof(key), "%.*s", (int)(key_len < sizeof(key) ? key_len : sizeof(key) - 1), ra->payload);
+    const char *value = ra->payload + (key_len < ra->head.length ? key_len + 1 : key_len);
+
+    VERBOSE(1, "[GET request %u,%u]<={%s %s}\n", ra->head.request_id, ra->head.length, frame_op_name(ra->head.opcode), key);
+
+    if (ra->head.opcode == OP_SET) //set
+        request_set(key, value, send_buf);
+    else if (ra->head.opcode == OP_GET) //get
+        request_get(key, send_buf);
+    else if (ra->head.opcode == OP_UPDATE) //update
+        request_update(key, value, send_buf);
+
+    uint32_t request_id = ra->head.request_id;
+    struct frame_head reply = {OP_REPLY, (uint8_t)gid_self, (uint8_t)rid_self, 0, 0, request_id, (uint32_t)strlen(send_buf)};
+    free(ra->payload);
+    free(ra);
+
+    //the writer frees send_buf once it is on the wire
+    if (-1 == peer_send(&requestor_queue, &reply, send_buf))
+        VERBOSE(1, "\t[reply %u dropped]\n", request_id);
+    else
+        VERBOSE(1, "\t[SEND request ack %u]\n", request_id);
+    return NULL;
+}
+
+//requests turned away, for logs
+static unsigned long requests_busy = 0;
+
+//writes grow the chunks for the peers, none while a peer is FLOW_PARKED frames behind
+static int request_admit(int opcode)
+{
+    if (opcode != OP_SET && opcode != OP_UPDATE && opcode != OP_MSET && opcode != OP_MUPDATE)
+        return 1;
+    for (int i = 0; i < GROUP; i++)
+    {
+        for (int j = 0; j < RACK; j++)
+        {
+            struct flow_out *f = &peers[i][j].flow;
+            if (flow_parked(f, FLOW_ENCODE) > FLOW_PARKED)
+                return 0;
         }
     }
-    close(fd);
+    return 1;
 }
 
-//receive data chunks
-//we accpet, the former
-void *accept_proxy_rece(void *arg)
+//answer a request without serving it, every key of a batch is ENTRY_BUSY
+static void request_busy(struct request_arg *ra)
 {
-    pthread_mutex_t rece_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct frame_head reply = {OP_REPLY, (uint8_t)gid_self, (uint8_t)rid_self, 0, 0, ra->head.request_id, 0};
+    unsigned char *send_buf;
+    if (batch_op(ra->head.opcode))
+    {
+        const unsigned char *in = (const unsigned char *)ra->payload, *end = in + ra->head.length;
+        send_buf = (unsigned char *)malloc(ra->head.length + 1);
+        unsigned char *out = send_buf;
+        struct frame_entry e;
+        uint32_t n = 0;
+        while (n < ra->head.chunk_id && -1 != frame_entry_next(&in, end, &e))
+        {
+            struct frame_entry r = {ENTRY_BUSY, e.key_length, 0, e.key, NULL};
+            out = frame_entry_put(out, &r);
+            n++;
+        }
+        reply.opcode = OP_BATCH_REPLY;
+        reply.chunk_id = n;
+        reply.length = out - send_buf;
+    }
+    else
+    {
+        send_buf = (unsigned char *)malloc(REQUEST_SIZE);
+        size_t key_len = strnlen(ra->payload, ra->head.length);
+        reply.length = snprintf((char *)send_buf, REQUEST_SIZE, "ack kv{%.*s} BUSY", (int)(key_len < 100 ? key_len : 99), ra->payload);
+    }
+    __atomic_add_fetch(&requests_busy, 1, __ATOMIC_RELAXED);
+    VERBOSE(1, "\t[BUSY request %u, %s]\n", ra->head.request_id, frame_op_name(ra->head.opcode));
+    free(ra->payload);
+    free(ra);
 
-    //char send_buf[CHUNK_SIZE];
-    char receive_com[COMMAND_SIZE];
-    char receive_buf[CHUNK_SIZE];
+    if (-1 == peer_send(&requestor_queue, &reply, send_buf))
+        VERBOSE(1, "\t[reply %u dropped]\n", reply.request_id);
+}
 
-    int gid, rid;
+//work with server, for normal KV
+//reads requests and hands each to the scheduler, so many can be in flight on one connection
+//a request that would have to wait, for the workers or for a peer, is answered busy at once
+void *work(void *arg)
+{
     int fd = (long)arg;
     enum status status_now = conn_init;
 
@@ -1341,552 +1937,592 @@ void *accept_proxy_rece(void *arg)
             //sleep(1);
             break;
         }
-        case conn_init:
+        case conn_read:
         {
             //receive message
-            memset(receive_com, 0, COMMAND_SIZE);
-
-            pthread_mutex_lock(&rece_mutex);
-
-            int ret = recv(fd, receive_com, COMMAND_SIZE, 0);
-            pthread_mutex_unlock(&rece_mutex);
-            if (-1 == ret)
+            struct frame_head head;
+            int ret = frame_recv_head(fd, &head);
+            if (-1 == ret || head.length >= (batch_op(head.opcode) ? FRAME_BATCH_BYTES : REQUEST_SIZE) || (batch_op(head.opcode) && head.chunk_id > FRAME_BATCH_MAX))
             {
                 status_now = conn_close;
                 print_err("recv failed", errno);
+                break;
             }
-            else
+            struct request_arg *ra = (struct request_arg *)malloc(sizeof(struct request_arg));
+            ra->head = head;
+            ra->payload = (char *)malloc(head.length + 1);
+            if (-1 == frame_recv(fd, ra->payload, head.length))
             {
-                //parse_handle(receive_buf, ret);
-                //set connection fd
-                VERBOSE(1, "\t[GET connect,%d]=>{%s}\n", ret, receive_com);
-                if (strncmp(receive_com, "CONN", 4) == 0)
-                {
-                    sscanf(receive_com, "%*s %d %d", &gid, &rid);
-                    VERBOSE(1, "\t[MANAGE CONN gid=%d, rid=%d]\n", gid, rid);
-
-                    connfd_list_R[gid][rid] = fd;
-                    VERBOSE(1, "Accept connfd_list_R: ");
-                    for (int i = 0; i < GROUP; i++)
-                    {
-                        for (int j = 0; j < RACK; j++)
-                            VERBOSE(1, "%d, ", connfd_list_R[i][j]);
-                    }
-                    VERBOSE(1, "\n");
-                }
+                free(ra->payload);
+                free(ra);
+                status_now = conn_close;
+                print_err("recv failed", errno);
+                break;
             }
+            ra->payload[head.length] = '\0';
+            if (!request_admit(head.opcode) || -1 == sched_try_add(SCHED_CLIENT, request_serve, ra, 64 * request_workers))
+                request_busy(ra);
+            break;
+        }
+        case conn_init:
+        {
+            //getchar();
+            struct frame_head conn = {OP_CONN, (uint8_t)gid_self, (uint8_t)rid_self, 0, 0, 0, sizeof(uint32_t)};
+            uint32_t wire = htonl(chunk_size);
+            int ret = frame_send(fd, &conn, &wire);
+            if (-1 == ret)
+                print_err("send failed", errno);
+            else
+                VERBOSE(1, "\t[SEND connect] (%d,%d)\n", gid_self, rid_self);
 
+            //replies are written by the queue's writer from now on
+            peer_init(&requestor_queue, fd, gid_self, rid_self);
             status_now = conn_wait;
             break;
         }
-        case conn_read:
+        case conn_close:
         {
-            //receive large data chunks, but it will receive the ack, ignore them
-            memset(receive_com, 0, COMMAND_SIZE);
-            pthread_mutex_lock(&rece_mutex);
-            int ret = recv(fd, receive_com, COMMAND_SIZE, 0);
-            pthread_mutex_unlock(&rece_mutex);
-            if (-1 == ret)
+            VERBOSE(1, "\n\nconn_close\n");
+            break;
+        }
+        }
+    }
+    close(fd);
+}
+
+//one connection from another proxy, served by the mesh reactor
+struct rece_conn
+{
+    int fd;
+    int gid; //peer, known after OP_CONN
+    int rid;
+};
+
+//the payload is the handler's, to keep or free, 0 to go on, -1 to close the connection
+typedef int (*rece_fn)(struct rece_conn *c, const struct frame_head *head, unsigned char *payload);
+
+static int rece_conn_init(struct rece_conn *c, const struct frame_head *head, unsigned char *payload)
+{
+    uint32_t wire;
+    memcpy(&wire, payload, sizeof(wire));
+    slab_free(payload);
+
+    uint32_t peer_chunk_size = ntohl(wire);
+    VERBOSE(1, "\t[MANAGE CONN gid=%d, rid=%d, lane=%d, chunk_size=%u]\n", head->gid, head->rid, head->index_tag, peer_chunk_size);
+    if (peer_chunk_size != chunk_size)
+    {
+        VERBOSE(1, "\t[proxy (%d,%d) runs with chunk_size=%u, but this one with %u, drop it]\n", head->gid, head->rid, peer_chunk_size, chunk_size);
+        return -1;
+    }
+
+    c->gid = head->gid;
+    c->rid = head->rid;
+    //every lane of a peer is read alike, only the control lane is kept
+    if (head->index_tag != 0)
+        return 0;
+    connfd_list_R[c->gid][c->rid] = c->fd;
+    VERBOSE(1, "Accept connfd_list_R: ");
+    for (int i = 0; i < GROUP; i++)
+    {
+        for (int j = 0; j < RACK; j++)
+            VERBOSE(1, "%d, ", connfd_list_R[i][j]);
+    }
+    VERBOSE(1, "\n");
+    return 0;
+}
+
+//local or global data chunk
+static int rece_encode(struct rece_conn *, const struct frame_head *head, unsigned char *payload)
+{
+    int global = (head->opcode == OP_G_ENCODE);
+    if (head->index_tag >= NODE)
+    {
+        slab_free(payload);
+        return -1;
+    }
+
+    if (global)
+        VERBOSE(2, "\t(Global data RECE) from (%d,%d) chunk_id=%u, index_tag=%d\n", head->gid, head->rid, head->chunk_id, head->index_tag);
+    else
+        VERBOSE(2, "\t(Local data RECE) from (%d,%d) chunk_id=%u, index_tag=%d\n", head->gid, head->rid, head->chunk_id, head->index_tag);
+
+    //the payload is the buffer the encode job folds
+    encode_add(global, head->gid, head->rid, head->index_tag, head->chunk_id, payload);
+    return 0;
+}
+
+static int rece_gather_middle(struct rece_conn *, const struct frame_head *head, unsigned char *)
+{
+    VERBOSE(3, "\t(Local-gather middle RECE) from (%d,%d) chunk_id=%u\n", head->gid, head->rid, head->chunk_id);
+
+    struct gather_arg *ga = (struct gather_arg *)calloc(1, sizeof(struct gather_arg));
+    ga->connfd = connfd_list_W[head->gid][head->rid];
+    ga->chunk_id = head->chunk_id;
+    ga->rid = head->rid;
+
+    sched_add(SCHED_GATHER, gather_middle, ga);
+    return 0;
+}
+
+static int rece_global_gather_middle(struct rece_conn *, const struct frame_head *head, unsigned char *payload)
+{
+    uint64_t wire;
+    memcpy(&wire, payload, sizeof(wire));
+    slab_free(payload);
+    uint64_t erasure = be64toh(wire);
+    VERBOSE(3, "\t(Global-gather middle RECE) from (%d,%d) chunk_id=%u, erasure=%llx\n", head->gid, head->rid, head->chunk_id, (unsigned long long)erasure);
+
+    struct gather_arg *ga = (struct gather_arg *)calloc(1, sizeof(struct gather_arg));
+    ga->connfd = connfd_list_W[head->gid][head->rid];
+    ga->gid = head->gid;
+    ga->rid = head->rid;
+    ga->chunk_id = head->chunk_id;
+    ga->erasure = erasure;
+
+    sched_add(SCHED_GATHER, gather_global_middle, ga);
+    return 0;
+}
+
+static int rece_middle(struct rece_conn *, const struct frame_head *head, unsigned char *payload)
+{
+    //the payload goes straight into the repair slot
+    unsigned char *middle = payload;
+    uint32_t chunk_id = head->chunk_id;
+    VERBOSE(3, "\t(Local middle RECE) from (%d,%d) chunk_id=%u\n", head->gid, head->rid, chunk_id);
+
+    pthread_mutex_lock(&local_repair_mutex);
+    struct local_repair_arg *p = local_repair_list;
+    if (local_repair_list == NULL)
+    {
+        VERBOSE(3, "\nReapair_list == NULL\n");
+    }
+    else
+    {
+        while (p)
+        {
+            if (p->chunk_id == chunk_id && !p->global)
             {
-                status_now = conn_close;
-                print_err("recv failed", errno);
-                //strcpy(send_buf,"ack NOK");
-                //status_now=conn_write;
-                status_now = conn_wait;
+                p->left_data[p->need++] = middle;
+                middle = NULL;
                 break;
             }
-            // else if(strncmp(receive_buf,"ack",3)==0) //may receive the other ack message
-            // {
-            //     VERBOSE(1,"\t[GET data chunk ack,%d]=>{%s}\n",ret,receive_buf);
-            //     status_now=conn_read;
-            //     break;
-            // }
-            else if (strncmp(receive_com, "l-encode", 8) == 0) //local data chunk
-            {
-                VERBOSE(2, "\t(Local data RECE command) {%s}\n", receive_com);
-
-                memset(receive_buf, 0, CHUNK_SIZE);
-                pthread_mutex_lock(&rece_mutex);
-                int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-                pthread_mutex_unlock(&rece_mutex);
+            p = p->next;
+        }
 
-                //show_data(receive_buf,CHUNK_SIZE,"l-encode");
+        if (p && p->need == RACK - 1 + NODE - 1)
+        {
+            local_can_repair++;
+        }
+    }
 
-                //put local parity
-                int g, r;
-                uint32_t index_tag;
-                uint32_t chunk_id;
-                sscanf(receive_com, "%*s %d %d %u %u", &g, &r, &index_tag, &chunk_id);
+    if (local_can_repair > 0)
+    {
+        //wake local repair
+        VERBOSE(3, "\nWaking up local_repair for chunk_id=%u\n", chunk_id);
+        pthread_cond_signal(&local_repair_cond);
+    }
+    pthread_mutex_unlock(&local_repair_mutex);
 
-                //set connection fd
-                //VERBOSE(2,"\t[GET data chunk, %d]=>{%s}\n",ret,receive_buf);
-                VERBOSE(2, "\t(Local data RECE real) from (%d,%d) chunk_id=%d)=>{data chunk}\n", g, r, chunk_id);
+    //no repair waits for it
+    slab_free(middle);
+    return 0;
+}
 
-                pthread_mutex_lock(&local_encode_mutex);
+static int rece_global_middle(struct rece_conn *, const struct frame_head *head, unsigned char *payload)
+{
+    //one chunk per erased position
+    unsigned char *middle = payload;
+    int count = head->length / chunk_size;
+    uint32_t chunk_id = head->chunk_id;
+    VERBOSE(3, "\t(Global middle RECE) from (%d,%d) chunk_id=%u)=>{%d middle}\n", head->gid, head->rid, chunk_id, count);
+
+    pthread_mutex_lock(&local_repair_mutex);
+    struct local_repair_arg *p = local_repair_list;
+    while (p)
+    {
+        if (p->chunk_id == chunk_id && p->global && p->need < p->expect && p->nerr == count)
+            break;
+        p = p->next;
+    }
+    if (p)
+    {
+        //gf add of the shares is xor
+        for (int i = 0; i < count; i++)
+        {
+            unsigned char *v[2] = {p->decoded[i], middle + (size_t)i * chunk_size};
+            xor_gen(2, chunk_size, v, p->decoded[i]);
+        }
+        p->need++;
+        if (p->need == p->expect)
+            local_can_repair++;
+    }
+    else
+        VERBOSE(3, "\nNo global repair waits for chunk_id=%u\n", chunk_id);
 
-                if (local_encode_list == NULL)
-                {
-                    local_encode_list = (struct local_encode_st *)calloc(1, sizeof(struct local_encode_st));
-                    local_encode_list->chunk_id = chunk_id;
-                    local_encode_list->num++;
-                    local_encode_list->next = NULL;
-                    local_wait_num++;
-
-                    //initial the encode
-                    for (int i = 0; i < LN; i++)
-                    {
-                        local_encode_list->source_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                    }
-
-                    if (local_encode_list->num == LK)
-                    {
-                        local_can_encode++;
-                    }
-                    unsigned char *pp = transfer_str_to_ustr(receive_buf, CHUNK_SIZE);
-                    memcpy(local_encode_list->source_data[local_encode_list->num - 1], pp, CHUNK_SIZE);
-                    free(pp);
-                    //show_unsigned_data(local_encode_list->source_data[local_encode_list->num-1],CHUNK_SIZE);
-                    VERBOSE(2, "\n\t****Remote local data from (%d,%d) NEW (%d), local_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", g, r, local_encode_list->num, local_wait_num, local_can_encode, chunk_id, index_tag);
-                }
-                else
-                {
-                    struct local_encode_st *p = local_encode_list, *q = p;
-                    while (p)
-                    {
-                        if (p->chunk_id == chunk_id)
-                        {
-                            p->num++;
-                            if (p->num == LK)
-                            {
-                                local_can_encode++;
-                            }
-                            unsigned char *pp = transfer_str_to_ustr(receive_buf, CHUNK_SIZE);
-                            memcpy(p->source_data[p->num - 1], pp, CHUNK_SIZE);
-                            free(pp);
-                            //show_unsigned_data(p->source_data[p->num-1],CHUNK_SIZE);
-                            VERBOSE(2, "\n\t****Remote local data from (%d,%d) OLD (%d), local_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", g, r, p->num, local_wait_num, local_can_encode, chunk_id, index_tag);
-                            break;
-                        }
-                        q = p;
-                        p = p->next;
-                    }
-                    if (p == NULL)
-                    {
-                        struct local_encode_st *new_encode = (struct local_encode_st *)calloc(1, sizeof(struct local_encode_st));
-                        new_encode->chunk_id = chunk_id;
-                        new_encode->num++;
-                        new_encode->next = 0;
-                        q->next = new_encode;
-                        local_wait_num++;
-
-                        for (int i = 0; i < LN; i++)
-                        {
-                            new_encode->source_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                        }
-
-                        if (new_encode->num == LK)
-                        {
-                            local_can_encode++;
-                        }
-                        unsigned char *pp = transfer_str_to_ustr(receive_buf, CHUNK_SIZE);
-                        memcpy(new_encode->source_data[new_encode->num - 1], pp, CHUNK_SIZE);
-                        free(pp);
-                        //show_unsigned_data(new_encode->source_data[new_encode->num-1],CHUNK_SIZE);
-                        VERBOSE(2, "\n\t****Remote local data from (%d,%d) new (%d), local_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", g, r, new_encode->num, local_wait_num, local_can_encode, chunk_id, index_tag);
-                    }
-                }
+    if (local_can_repair > 0)
+    {
+        VERBOSE(3, "\nWaking up local_repair for chunk_id=%u\n", chunk_id);
+        pthread_cond_signal(&local_repair_cond);
+    }
+    pthread_mutex_unlock(&local_repair_mutex);
 
-                if (local_can_encode > 0)
-                {
-                    //wake local parity
-                    VERBOSE(2, "\nWaking up local_encode in (receiving)\n");
-                    pthread_cond_signal(&local_encode_cond);
-                }
+    slab_free(middle);
+    return 0;
+}
 
-                //show_local_encode();
-                pthread_mutex_unlock(&local_encode_mutex);
+static int rece_update(struct rece_conn *, const struct frame_head *head, unsigned char *payload)
+{
+    //the delta becomes the new parity in place
+    char *receive_buf = (char *)payload;
+    show_unsigned_data(payload, chunk_size, "Local update receive");
 
-                //strcpy(send_buf,"ack local OK");
-                //status_now=conn_write;
-                status_now = conn_wait;
-                break;
-            }
-            else if (strncmp(receive_com, "g-encode", 8) == 0) //global data chunk
-            {
-                VERBOSE(2, "\t(Global data RECE command) {%s}\n", receive_com);
+    uint32_t chunk_id = head->chunk_id;
+    VERBOSE(4, "\t(Local update RECE) from (%d,%d) chunk_id=%u\n", head->gid, head->rid, chunk_id);
 
-                memset(receive_buf, 0, CHUNK_SIZE);
-                pthread_mutex_lock(&rece_mutex);
-                int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-                pthread_mutex_unlock(&rece_mutex);
+    //the parity of an open stripe takes the delta before it is stored
+    if (local_delta_add(chunk_id, payload))
+        VERBOSE(4, "update local rece from other rack, stripe %u is open\n", chunk_id);
+    else
+    {
+        size_t val_len;
+        uint32_t flags;
+        //update local parity
+        char key_local[100] = {0};
+        sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
+        memcached_return rc;
+        char *local = memcached_get(worker_ring(), key_local, strlen(key_local), &val_len, &flags, &rc);
 
-                //show_data(receive_buf,CHUNK_SIZE);
+        //show_data(receive_buf,chunk_size,"Update delta");
+        //show_data(local,chunk_size,"Local original parity");
 
-                //put global parity
-                int g, r;
-                uint32_t index_tag;
-                uint32_t chunk_id;
-                sscanf(receive_com, "%*s %d %d %u %u", &g, &r, &index_tag, &chunk_id);
+        if (local == NULL || val_len < chunk_size)
+            VERBOSE(4, "local parity %s is missing, skip\n", key_local);
+        else
+        {
+            //xor
+            for (uint32_t i = 0; i < chunk_size; i++)
+            {
+                receive_buf[i] = receive_buf[i] ^ local[i];
+            }
 
-                //set connection fd
-                //VERBOSE(2,"\t[GET data chunk, %d]=>{%s}\n",ret,receive_buf);
-                VERBOSE(2, "\t(Global data RECE real) from (%d,%d) chunk_id=%d]=>{data chunk}\n", g, r, chunk_id);
+            //show_data(receive_buf,chunk_size,"Local new parity");
+            //update the local
+            rc = memcached_set(worker_ring(), key_local, strlen(key_local), receive_buf, chunk_size, 0, 0);
+            if (rc == MEMCACHED_SUCCESS)
+            {
+                VERBOSE(4, "update local rece from other rack ok\n");
+            }
+            else
+            {
+                VERBOSE(4, "update local rece from other rack nok\n");
+            }
+        }
+        free(local);
+    }
+    slab_free(payload);
 
-                pthread_mutex_lock(&global_encode_mutex);
+    struct update_ack_arg *ua = (struct update_ack_arg *)calloc(1, sizeof(struct update_ack_arg));
+    ua->connfd = connfd_list_W[head->gid][head->rid];
+    ua->gid = gid_self;
+    ua->rid = rid_self;
+    ua->global = 0;
 
-                //printf("g,r,index_tag, chunkid =(%d,%d,%u,%u), GN=%d, GK=%d, offset=%u\n",g,r,index_tag,chunk_id, GN, GK, offset(g, r, index_tag, gid_self));
-                if (global_encode_list == NULL)
-                {
-                    global_encode_list = (struct global_encode_st *)calloc(1, sizeof(struct global_encode_st));
-                    global_encode_list->chunk_id = chunk_id;
-                    global_encode_list->num++;
-                    global_encode_list->next = 0;
-                    global_wait_num++;
-
-                    //initial the encode
-                    for (int i = 0; i < GN; i++)
-                    {
-
-                        global_encode_list->source_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                    }
-
-                    if (global_encode_list->num == GK)
-                    {
-                        global_can_encode++;
-                    }
-                    unsigned char *pp = transfer_str_to_ustr(receive_buf, CHUNK_SIZE);
-                    //printf("GN=%d, GK=%d, offset=%u\n",GN, GK, offset(g, r, index_tag, gid_self));
-                    memcpy(global_encode_list->source_data[global_encode_list->num - 1], pp, CHUNK_SIZE);
-                    //memcpy(global_encode_list->source_data[offset(g,r,index_tag,gid_self)], pp, CHUNK_SIZE);
-                    free(pp);
-                    //show_unsigned_data(global_encode_list->source_data[global_encode_list->num-1], CHUNK_SIZE);
-                    VERBOSE(2, "\n\t####Remote global data from (%d,%d) NEW (%d), global_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", g, r, global_encode_list->num, global_wait_num, global_can_encode, chunk_id, index_tag);
-                }
-                else
-                {
-                    struct global_encode_st *p = global_encode_list, *q = p;
-                    while (p)
-                    {
-                        if (p->chunk_id == chunk_id)
-                        {
-                            p->num++;
-                            if (p->num == GK)
-                            {
-                                global_can_encode++;
-                            }
-                            unsigned char *pp = transfer_str_to_ustr(receive_buf, CHUNK_SIZE);
-                            //memcpy(p->source_data[offset(g,r,index_tag,gid_self)], pp, CHUNK_SIZE);
-                            memcpy(p->source_data[p->num - 1], pp, CHUNK_SIZE);
-                            free(pp);
-                            // //how_unsigned_data(p->source_data[p->num-1], CHUNK_SIZE);
-                            VERBOSE(2, "\n\t####Remote global data from (%d,%d) OLD (%d), global_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", g, r, p->num, global_wait_num, global_can_encode, chunk_id, index_tag);
-                            break;
-                        }
-                        q = p;
-                        p = p->next;
-                    }
-                    if (p == NULL)
-                    {
-                        struct global_encode_st *new_encode = (struct global_encode_st *)calloc(1, sizeof(struct global_encode_st));
-                        new_encode->chunk_id = chunk_id;
-                        new_encode->num++;
-                        new_encode->next = 0;
-                        q->next = new_encode;
-                        global_wait_num++;
-
-                        for (int i = 0; i < GN; i++)
-                        {
-                            new_encode->source_data[i] = (unsigned char *)calloc(1, CHUNK_SIZE * sizeof(unsigned char));
-                        }
-
-                        if (new_encode->num == GK)
-                        {
-                            global_can_encode++;
-                        }
-                        unsigned char *pp = transfer_str_to_ustr(receive_buf, CHUNK_SIZE);
-                        //memcpy(new_encode->source_data[offset(g,r,index_tag,gid_self)], pp, CHUNK_SIZE);
-                        memcpy(new_encode->source_data[new_encode->num - 1], pp, CHUNK_SIZE);
-                        free(pp);
-                        // show_unsigned_data(new_encode->source_data[new_encode->num-1], CHUNK_SIZE);
-                        VERBOSE(2, "\n\t####Remote global data from (%d,%d) NEW (%d), global_wait_num=%d, can_encode=%d, chunk_id=%d, index_tag=%d\n", g, r, new_encode->num, global_wait_num, global_can_encode, chunk_id, index_tag);
-                    }
-                }
+    sched_add_serial(peer_serial(ua->connfd, SCHED_UPDATE_ACK), SCHED_UPDATE_ACK, update_ack_send, ua);
+    return 0;
+}
 
-                if (global_can_encode > 0)
-                {
-                    //wake local parity
-                    VERBOSE(2, "\nWaking up global_encode in (receiving)\n");
-                    pthread_cond_signal(&global_encode_cond);
-                }
-                pthread_mutex_unlock(&global_encode_mutex);
+static int rece_global_update(struct rece_conn *, const struct frame_head *head, unsigned char *payload)
+{
+    unsigned char *receive_buf = payload;
+    show_unsigned_data(payload, chunk_size, "Global update receive");
 
-                //strcpy(send_buf,"ack global OK");
-                //status_now=conn_write;
-                status_now = conn_wait;
-                break;
-            }
-            else if (strncmp(receive_com, "l-gather-middle", 15) == 0) //receive gather middle
-            {
-                VERBOSE(3, "\t(Local-gather middle RECE command) {%s}\n", receive_com);
+    uint32_t chunk_id = head->chunk_id;
+    VERBOSE(4, "\t(Global update RECE) from (%d,%d) chunk_id=%u\n", head->gid, head->rid, chunk_id);
 
-                uint32_t gid, rid;
-                uint32_t chunk_id;
-                sscanf(receive_com, "%*s %d %d %u", &gid, &rid, &chunk_id);
+    //parity i takes coef[i][pos] * delta, pos is the updated chunk's column of the cauchy rows
+    //the parities of an open stripe take the delta before they are stored
+    int pos = global_offset(head->gid, head->rid, head->index_tag, chunk_id);
+    if (global_delta_add(chunk_id, pos, payload))
+        VERBOSE(4, "update global rece from other rack, stripe %u is open\n", chunk_id);
+    else
+    {
+        size_t val_len[GN - GK];
+        uint32_t flags;
+        //update global parity
+        char key_global[GN - GK][100];
+        for (int i = 0; i < GN - GK; i++)
+            memset(key_global[i], 0, 100);
+        char *global[GN - GK];
+        memcached_st *ring = worker_ring();
+        memcached_return rc;
+        //for global
+        for (int i = 0; i < GN - GK; i++)
+        {
+            sprintf(key_global[i], "global-%d[%d]", chunk_id, i);
+            global[i] = memcached_get(ring, key_global[i], strlen(key_global[i]), &val_len[i], &flags, &rc);
+            //show_unsigned_data((unsigned char*)global[i],chunk_size,"Global original parity");
+        }
 
-                struct gather_arg *ga = (struct gather_arg *)calloc(1, sizeof(struct gather_arg));
-                ga->connfd = connfd_list_W[gid][rid];
-                ga->chunk_id = chunk_id;
-                ga->rid = rid;
+        //a missing parity gets its share into a scratch chunk that is thrown away
+        unsigned char *global_new[GN - GK];
+        for (int i = 0; i < GN - GK; i++)
+        {
+            if (global[i] == NULL)
+            {
+                VERBOSE(4, "[%d]global parity %s is missing, skip\n", i, key_global[i]);
+                global_new[i] = slab_zalloc(chunk_size);
+            }
+            else
+                global_new[i] = chunk_from_value(global[i], val_len[i]);
+        }
+        codec_update(codec_get(GK, GN - GK, CAUCHY_MATRIX), chunk_size, pos, receive_buf, global_new);
 
-                threadpool_add_job(gather_pool, gather_middle, ga);
-                status_now = conn_wait;
-                break;
+        for (int i = 0; i < GN - GK; i++)
+        {
+            if (global[i] == NULL)
+            {
+                slab_free(global_new[i]);
+                continue;
             }
-            else if (strncmp(receive_com, "g-gather-middle", 15) == 0) //receive gather middle
+            //show_unsigned_data(global_new[i],chunk_size,"Global new parity");
+            rc = memcached_set(ring, key_global[i], strlen(key_global[i]), (char *)global_new[i], chunk_size, 0, 0);
+            if (rc == MEMCACHED_SUCCESS)
             {
+                VERBOSE(4, "[%d]update global rece from other rack ok\n", i);
             }
-            else if (strncmp(receive_com, "l-middle", 8) == 0) //receve local middle
+            else
             {
-                VERBOSE(3, "\t(Local middle RECE command) {%s}\n", receive_com);
+                VERBOSE(4, "[%d]update global rece from other rack nok\n", i);
+            }
+            free(global_new[i]);
+        }
+    }
+    slab_free(payload);
 
-                memset(receive_buf, 0, CHUNK_SIZE);
-                pthread_mutex_lock(&rece_mutex);
-                int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-                pthread_mutex_unlock(&rece_mutex);
+    struct update_ack_arg *ua = (struct update_ack_arg *)calloc(1, sizeof(struct update_ack_arg));
+    ua->connfd = connfd_list_W[head->gid][head->rid];
+    ua->gid = gid_self;
+    ua->rid = rid_self;
+    ua->global = 1;
 
-                //show_data(receive_buf,CHUNK_SIZE);
-                //put local middle
-                int g, r;
-                uint32_t chunk_id;
-                sscanf(receive_com, "%*s %d %d %u", &g, &r, &chunk_id);
+    sched_add_serial(peer_serial(ua->connfd, SCHED_UPDATE_ACK), SCHED_UPDATE_ACK, update_ack_send, ua);
+    return 0;
+}
 
-                //set connection fd
-                VERBOSE(3, "\t(Local middle RECE real) from (%d,%d) chunk_id=%d)=>{middle}\n", g, r, chunk_id);
+static int rece_update_ack(struct rece_conn *, const struct frame_head *head, unsigned char *)
+{
+    VERBOSE(4, "\t(Local update ack RECE) from (%d,%d)\n", head->gid, head->rid);
 
-                pthread_mutex_lock(&local_repair_mutex);
-                struct local_repair_arg *p = local_repair_list;
-                if (local_repair_list == NULL)
-                {
-                    VERBOSE(3, "\nReapair_list == NULL\n");
-                }
-                else
-                {
-                    while (p)
-                    {
-                        if (p->chunk_id == chunk_id)
-                        {
-                            memcpy(p->left_data[p->need++], receive_buf, CHUNK_SIZE);
-                            break;
-                        }
-                        p = p->next;
-                    }
-
-                    if (p->need == RACK - 1 + NODE - 1)
-                    {
-                        local_can_repair++;
-                    }
-                }
+    gettimeofday(&l_other_update_end, NULL);
 
-                if (local_can_repair > 0)
-                {
-                    //wake local repair
-                    VERBOSE(3, "\nWaking up local_repair for kv{%s}\n", p->key);
-                    pthread_cond_signal(&local_repair_cond);
-                }
-                pthread_mutex_unlock(&local_repair_mutex);
+    double time = timeval_diff(&l_other_update_begin, &l_other_update_end);
+    FILE *fin = fopen("l_other_rack_update.txt", "a+");
 
-                status_now = conn_wait;
-                break;
-            }
-            else if (strncmp(receive_com, "g-middle", 8) == 0) //receve global middle
-            {
-            }
-            else if (strncmp(receive_com, "l-update", 8) == 0) //receive local update
-            {
-                VERBOSE(4, "\t(Local update RECE command) {%s}\n", receive_com);
-
-                memset(receive_buf, 0, CHUNK_SIZE);
-                pthread_mutex_lock(&rece_mutex);
-                int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-                pthread_mutex_unlock(&rece_mutex);
-                show_unsigned_data((unsigned char *)receive_buf, CHUNK_SIZE, "Local update receive");
-
-                //put local update
-                int g, r;
-                uint32_t chunk_id;
-                sscanf(receive_com, "%*s %d %d %u", &g, &r, &chunk_id);
-
-                //set connection fd
-                //VERBOSE(4,"\t[GET data chunk, %d]=>{%s}\n",ret,receive_buf);
-                VERBOSE(4, "\t(Local update RECE real) from (%d,%d) chunk_id=%d)=>{update}\n", g, r, chunk_id);
-
-                size_t val_len;
-                uint32_t flags;
-                //update local parity
-                char key_local[100] = {0};
-                sprintf(key_local, "local-%d-%d", gid_self, chunk_id);
-                char *local = memcached_get(ech->ring, key_local, strlen(key_local), &val_len, &flags, &rc);
-
-                //show_data(receive_buf,CHUNK_SIZE,"Update delta");
-                //show_data(local,CHUNK_SIZE,"Local original parity");
-
-                //xor
-                for (int i = 0; i < CHUNK_SIZE; i++)
-                {
-                    receive_buf[i] = receive_buf[i] ^ local[i];
-                }
+    VERBOSE(4, "\nUpdate other rack local kv{} time: %.1f us\n\n", time);
 
-                //show_data(receive_buf,CHUNK_SIZE,"Local new parity");
-                //update the local
-                rc = memcached_set(ech->ring, key_local, strlen(key_local), receive_buf, CHUNK_SIZE, 0, 0);
-                if (rc == MEMCACHED_SUCCESS)
-                {
-                    VERBOSE(4, "update local rece from other rack ok\n");
-                }
-                else
-                {
-                    VERBOSE(4, "update local rece from other rack nok\n");
-                }
+    fprintf(fin, "%.1f\n", time);
+    fclose(fin);
+    return 0;
+}
 
-                struct update_ack_arg *ua = (struct update_ack_arg *)calloc(1, sizeof(struct update_ack_arg));
-                ua->connfd = connfd_list_W[g][r];
-                ua->gid = gid_self;
-                ua->rid = rid_self;
-                ua->global = 0;
+static int rece_global_update_ack(struct rece_conn *, const struct frame_head *head, unsigned char *)
+{
+    VERBOSE(4, "\t(Global update ack RECE) from (%d,%d)\n", head->gid, head->rid);
 
-                threadpool_add_job(update_ack_pool, update_ack_send, ua);
+    gettimeofday(&g_update_end, NULL);
 
-                status_now = conn_wait;
-                break;
-            }
-            else if (strncmp(receive_com, "g-update", 8) == 0) //receive global update
-            {
-                VERBOSE(4, "\t(Global update RECE command) {%s}\n", receive_com);
-
-                memset(receive_buf, 0, CHUNK_SIZE);
-                pthread_mutex_lock(&rece_mutex);
-                int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-                pthread_mutex_unlock(&rece_mutex);
-                show_unsigned_data((unsigned char *)receive_buf, CHUNK_SIZE, "Global update receive");
-
-                //put local update
-                int g, r;
-                uint32_t chunk_id;
-                sscanf(receive_com, "%*s %d %d %u", &g, &r, &chunk_id);
-
-                //set connection fd
-                VERBOSE(4, "\t(Global update RECE real) from (%d,%d) chunk_id=%d)=>{update}\n", g, r, chunk_id);
-
-                size_t val_len;
-                uint32_t flags;
-                //update global parity
-                char key_global[GN - GK][100];
-                for (int i = 0; i < GN - GK; i++)
-                    memset(key_global[i], 0, 100);
-                char *global[GN - GK];
-                char global_new[GN - GK][CHUNK_SIZE];
-                //for global
-                for (int i = 0; i < GN - GK; i++)
-                {
-                    sprintf(key_global[i], "global-%d[%d]", chunk_id, i);
-                    global[i] = memcached_get(ech->ring, key_global[i], strlen(key_global[i]), &val_len, &flags, &rc);
-                    if (global[i])
-                    {
-                        //show_unsigned_data((unsigned char*)global[i],CHUNK_SIZE,"Global original parity");
-                        memcpy(global_new[i], global[i], CHUNK_SIZE);
-                    }
-                }
+    double time = timeval_diff(&g_update_begin, &g_update_end);
+    FILE *fin = fopen("g_update.txt", "a+");
 
-                //how to update global,to do
-                for (int i = 0; i < GN - GK; i++)
-                {
-                    for (int j = 0; j < CHUNK_SIZE; j++)
-                    {
-                        global_new[i][j] = receive_buf[j] ^ global[i][j];
-                    }
-                    //show_unsigned_data((unsigned char*)global_new[i],CHUNK_SIZE,"Global new parity");
-                    rc = memcached_set(ech->ring, key_global[i], strlen(key_global[i]), global_new[i], CHUNK_SIZE, 0, 0);
-                    if (rc == MEMCACHED_SUCCESS)
-                    {
-                        VERBOSE(4, "[%d]update global rece from other rack ok\n", i);
-                    }
-                    else
-                    {
-                        VERBOSE(4, "[%d]update global rece from other rack nok\n", i);
-                    }
-                }
+    VERBOSE(4, "\nUpdate global kv{} time: %.1f us\n\n", time);
 
-                struct update_ack_arg *ua = (struct update_ack_arg *)calloc(1, sizeof(struct update_ack_arg));
-                ua->connfd = connfd_list_W[g][r];
-                ua->gid = gid_self;
-                ua->rid = rid_self;
-                ua->global = 1;
+    fprintf(fin, "%.1f\n", time);
+    fclose(fin);
+    return 0;
+}
 
-                threadpool_add_job(update_ack_pool, update_ack_send, ua);
+//the peer drained chunk frames, the ones waiting for its credits go out
+static int rece_credit(struct rece_conn *, const struct frame_head *head, unsigned char *)
+{
+    if (head->index_tag >= FLOW_CLASSES || head->chunk_id == 0 || head->chunk_id > FLOW_WINDOW)
+        return -1;
+    VERBOSE(4, "\t(Credit RECE) from (%d,%d) class=%d n=%u\n", head->gid, head->rid, head->index_tag, head->chunk_id);
+    flow_credit(&peers[head->gid][head->rid].flow, head->index_tag, head->chunk_id);
+    return 0;
+}
 
-                status_now = conn_wait;
-                break;
-            }
-            else if (strncmp(receive_com, "ack-l-update", 12) == 0) //receive local update
-            {
-                VERBOSE(4, "\t(Local update ack RECE command) {%s}\n", receive_com);
+//payload a frame must carry, checked on the io thread before it is read
+enum rece_payload
+{
+    PAY_NONE,   //empty
+    PAY_U32,    //4 bytes
+    PAY_U64,    //8 bytes
+    PAY_CHUNK,  //chunk_size
+    PAY_CHUNKS, //1 to GN - GK + 1 chunks
+};
 
-                gettimeofday(&l_other_update_end, NULL);
+//what a proxy may send to another one
+//pooled handlers block on memcached or files and run on rece_pool, the others on the io thread
+static const struct
+{
+    int opcode;
+    rece_fn handle;
+    enum rece_payload payload;
+    int pooled;
+} rece_entries[] = {
+    {OP_CONN, rece_conn_init, PAY_U32, 0},
+    {OP_L_ENCODE, rece_encode, PAY_CHUNK, 0},
+    {OP_G_ENCODE, rece_encode, PAY_CHUNK, 0},
+    {OP_L_GATHER_MIDDLE, rece_gather_middle, PAY_NONE, 0},
+    {OP_G_GATHER_MIDDLE, rece_global_gather_middle, PAY_U64, 0},
+    {OP_L_MIDDLE, rece_middle, PAY_CHUNK, 0},
+    {OP_G_MIDDLE, rece_global_middle, PAY_CHUNKS, 0},
+    {OP_L_UPDATE, rece_update, PAY_CHUNK, 1},
+    {OP_G_UPDATE, rece_global_update, PAY_CHUNK, 1},
+    {OP_L_UPDATE_ACK, rece_update_ack, PAY_NONE, 1},
+    {OP_G_UPDATE_ACK, rece_global_update_ack, PAY_NONE, 1},
+    {OP_CREDIT, rece_credit, PAY_NONE, 0},
+};
 
-                double time = timeval_diff(&l_other_update_begin, &l_other_update_end);
-                FILE *fin = fopen("l_other_rack_update.txt", "a+");
+#define RECE_ENTRIES (sizeof(rece_entries) / sizeof(rece_entries[0]))
 
-                VERBOSE(4, "\nUpdate other rack local kv{} time: %.1f us\n\n", time);
+//opcode ==> index in rece_entries + 1, 0 for frames nobody handles, filled once before any proxy connects
+static int rece_table[OP_MAX];
 
-                //fprintf(fin,"\n\n In (gid,rid)=(%d,%d) Repair kv{%s} time: %.10f s\n\n*********************************************\n", gid_self, rid_self, p->key, time);
-                fprintf(fin, "%.1f\n", time);
-                fclose(fin);
+static void rece_table_init()
+{
+    for (size_t i = 0; i < RECE_ENTRIES; i++)
+        rece_table[rece_entries[i].opcode] = i + 1;
+}
 
-                status_now = conn_wait;
-                break;
-            }
-            else if (strncmp(receive_com, "ack-g-update", 12) == 0) //receive local update
-            {
-                VERBOSE(4, "\t(Global update ack RECE command) {%s}\n", receive_com);
+struct reactor *mesh_reactor;
+struct threadpool *rece_pool;
 
-                gettimeofday(&g_update_end, NULL);
+//credits for a chunk frame once its handler is done, data chunks are drained by their encode job,
+//the deltas of their class here
+static void rece_drained(const struct frame_head *head)
+{
+    int cls = flow_class(head->opcode);
+    if (cls >= 0 && head->opcode != OP_L_ENCODE && head->opcode != OP_G_ENCODE)
+        peer_drained(head->gid, head->rid, cls);
+}
 
-                double time = timeval_diff(&g_update_begin, &g_update_end);
-                FILE *fin = fopen("g_update.txt", "a+");
+//a pooled frame, the connection may be gone when it runs
+struct rece_job
+{
+    rece_fn handle;
+    struct rece_conn conn;
+    struct frame_head head;
+    unsigned char *payload;
+};
 
-                VERBOSE(4, "\nUpdate global kv{} time: %.1f us\n\n", time);
+static void *rece_run(void *arg)
+{
+    struct rece_job *job = (struct rece_job *)arg;
+    job->handle(&job->conn, &job->head, job->payload);
+    rece_drained(&job->head);
+    free(job);
+    return NULL;
+}
 
-                //fprintf(fin,"\n\n In (gid,rid)=(%d,%d) Repair kv{%s} time: %.10f s\n\n*********************************************\n", gid_self, rid_self, p->key, time);
-                fprintf(fin, "%.1f\n", time);
-                fclose(fin);
+static int rece_head(struct reactor_conn *rc, const struct frame_head *head)
+{
+    struct rece_conn *c = (struct rece_conn *)rc->user;
 
-                status_now = conn_wait;
-                break;
-            }
-        }
-        case conn_write:
-        {
-            // ret = send(connfd_list_W[gid][rid],send_buf,sizeof(send_buf),0);
-            // if(-1 == ret)
-            //     print_err("send failed", errno);
-            // else
-            //     VERBOSE(1,"\t[SEND data chunk ack,%d]=>{%s}\n",ret,send_buf);
+    //only the size of a packed frame is known now, rece_frame checks it again unpacked
+    if (head->opcode & FRAME_PACKED)
+    {
+        int op = head->opcode & ~FRAME_PACKED;
+        return (c->gid >= 0 && op < OP_MAX && rece_table[op] && head->length > PACK_HEAD &&
+                head->length <= (GN - GK + 1) * chunk_size)
+                   ? 0
+                   : -1;
+    }
+    int e = head->opcode < OP_MAX ? rece_table[head->opcode] - 1 : -1;
+
+    //the first frame says who is on the other end
+    if (c->gid < 0 && head->opcode != OP_CONN)
+        return -1;
+    //not for the mesh, its payload is read and dropped so the stream stays in step
+    if (e < 0)
+        return head->length <= chunk_size ? 0 : -1;
+    if (head->gid >= GROUP || head->rid >= RACK)
+        return -1;
+
+    uint32_t n = head->length;
+    switch (rece_entries[e].payload)
+    {
+    case PAY_NONE:
+        return n == 0 ? 0 : -1;
+    case PAY_U32:
+        return n == sizeof(uint32_t) ? 0 : -1;
+    case PAY_U64:
+        return n == sizeof(uint64_t) ? 0 : -1;
+    case PAY_CHUNK:
+        return n == chunk_size ? 0 : -1;
+    case PAY_CHUNKS:
+        return (n % chunk_size == 0 && n >= chunk_size && n <= (GN - GK + 1) * chunk_size) ? 0 : -1;
+    }
+    return -1;
+}
 
-            status_now = conn_wait;
-            //memset(send_buf,0,BUFFER_SIZE);
-            break;
-        }
-        case conn_close:
+static int rece_frame(struct reactor_conn *rc, const struct frame_head *head, unsigned char *payload)
+{
+    struct rece_conn *c = (struct rece_conn *)rc->user;
+
+    struct frame_head raw;
+    if (head->opcode & FRAME_PACKED)
+    {
+        raw = *head;
+        raw.opcode &= ~FRAME_PACKED;
+        unsigned char *unpacked = unpack_payload(payload, head->length, (GN - GK + 1) * chunk_size, &raw.length);
+        slab_free(payload);
+        if (unpacked == NULL || -1 == rece_head(rc, &raw))
         {
-            VERBOSE(1, "\n\nconn_close\n");
-            break;
-        }
+            VERBOSE(1, "\t[BAD packed %s frame from (%d,%d), %u bytes]\n", frame_op_name(raw.opcode), c->gid, c->rid, head->length);
+            slab_free(unpacked);
+            return -1;
         }
+        head = &raw;
+        payload = unpacked;
+    }
+    int e = head->opcode < OP_MAX ? rece_table[head->opcode] - 1 : -1;
+    if (e < 0)
+    {
+        VERBOSE(1, "\t[SKIP %s frame from (%d,%d), %u bytes]\n", frame_op_name(head->opcode), c->gid, c->rid, head->length);
+        slab_free(payload);
+        return 0;
     }
 
-    close(fd);
+    if (rece_entries[e].pooled)
+    {
+        struct rece_job *job = (struct rece_job *)malloc(sizeof(struct rece_job));
+        job->handle = rece_entries[e].handle;
+        job->conn = *c;
+        job->head = *head;
+        job->payload = payload;
+        threadpool_add_job(rece_pool, rece_run, job);
+        return 0;
+    }
+
+    if (-1 == rece_entries[e].handle(c, head, payload))
+    {
+        VERBOSE(1, "\t[BAD %s frame from (%d,%d), %u bytes]\n", frame_op_name(head->opcode), c->gid, c->rid, head->length);
+        return -1;
+    }
+    rece_drained(head);
+    return 0;
+}
+
+static void rece_close(struct reactor_conn *rc)
+{
+    struct rece_conn *c = (struct rece_conn *)rc->user;
+    VERBOSE(1, "\n\nconn_close (%d,%d)\n", c->gid, c->rid);
+    free(c);
 }
 
+static const struct reactor_ops rece_ops = {rece_head, rece_frame, rece_close};
+
 //As server to connect these gid and rid higher
 void *server(void *arg)
 {
@@ -1903,10 +2539,17 @@ void *server(void *arg)
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(P_PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_addr.s_addr = inet_addr(ips[gid_self][rid_self]);
 
+    //its own address where this host has it, so proxies sharing a host do not share the port,
+    //any address behind a NAT
     printf("inet_addr=%s\n", ips[gid_self][rid_self]);
     ret = bind(listenfd, (struct sockaddr *)&addr, sizeof(addr));
+    if (-1 == ret && errno == EADDRNOTAVAIL)
+    {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        ret = bind(listenfd, (struct sockaddr *)&addr, sizeof(addr));
+    }
     if (-1 == ret)
     {
         print_err("Bind failed", errno);
@@ -1933,13 +2576,129 @@ void *server(void *arg)
 
         VERBOSE(1, "Cport = %d, caddr = %s\n", ntohs(caddr.sin_port), inet_ntoa(caddr.sin_addr));
 
-        //for each proxy, create a thread to handle its communication
-        pthread_t id;
-        //ret = pthread_create(&id, NULL, accept_proxy_send, (void *)connfd);
-        ret = pthread_create(&id, NULL, accept_proxy_rece, (void *)connfd);
-        if (-1 == ret)
-            print_err("Pthread create failed", errno);
+        //the io threads read every proxy's frames, no thread per connection
+        struct rece_conn *c = (struct rece_conn *)calloc(1, sizeof(struct rece_conn));
+        c->fd = connfd;
+        c->gid = -1;
+        c->rid = -1;
+        if (-1 == reactor_add(mesh_reactor, connfd, c))
+        {
+            free(c);
+            close(connfd);
+        }
+    }
+}
+
+//rings of proxies on this host, their frames are read by the io threads like the sockets'
+void *shm_server(void *arg)
+{
+    int listenfd = (int)(long)arg;
+    while (1)
+    {
+        int err;
+        struct shm_ring *shm = shm_accept(listenfd, &err);
+        if (shm == NULL)
+        {
+            if (err)
+            {
+                print_err("shm accept failed", errno);
+                break;
+            }
+            continue;
+        }
+
+        struct rece_conn *c = (struct rece_conn *)calloc(1, sizeof(struct rece_conn));
+        c->fd = shm->data_efd;
+        c->gid = -1;
+        c->rid = -1;
+        if (-1 == reactor_add_shm(mesh_reactor, shm, c))
+        {
+            //the peer goes over TCP
+            free(c);
+            shm_close(shm);
+            continue;
+        }
+        shm_ready(shm);
+    }
+    close(listenfd);
+    return NULL;
+}
+
+//connect to proxy (i,j) and send CONN, lane 0 is the control lane, 1.. carry chunks
+//*shm is the ring when (i,j) is on this host, the fd is then its unix socket
+static int proxy_connect(int i, int j, int lane, struct shm_ring **shm)
+{
+    *shm = NULL;
+    int fd_proxy = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd_proxy, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse));
+    const char chOpt = 1;
+    setsockopt(fd_proxy, IPPROTO_TCP, TCP_NODELAY, &chOpt, sizeof(char));
+
+    if (-1 == fd_proxy)
+    {
+        print_err("proxy socket failed", errno);
+    }
+    struct sockaddr_in addr1;
+    memset(&addr1, 0, sizeof(addr1));
+    addr1.sin_family = AF_INET;
+    addr1.sin_port = htons(P_PORT);
+
+    //	if(i==0 && j==0)
+    //		addr.sin_addr.s_addr = inet_addr(ip_demo);
+    //	else
+    addr1.sin_addr.s_addr = inet_addr(ips[i][j]);
+
+    while (1)
+    {
+        if (use_shm && (*shm = shm_connect(i, j)) != NULL)
+            break;
+        int re = connect(fd_proxy, (struct sockaddr *)&addr1, sizeof(addr1));
+        if (-1 == re)
+        {
+            print_err("server connect failed", errno);
+            printf("number:%d %d, %s\n", i, j, ips[i][j]);
+            sleep(1);
+        }
+        else
+        {
+            //it may have come up just after the try above, it sees the connection close
+            if (use_shm)
+                *shm = shm_connect(i, j);
+            break;
+        }
+    }
+    if (*shm)
+    {
+        close(fd_proxy);
+        fd_proxy = (*shm)->sock;
+        VERBOSE(1, "\t[(%d,%d) lane=%d over shared memory]\n", i, j, lane);
+    }
+
+    //send CONN and do not create a new thread
+    //ret = pthread_create(&pid, NULL, conn_proxy_send, (void *)fd_proxy);
+    //peers check that they run with the same chunk size, index_tag is the lane
+    struct frame_head head = {OP_CONN, (uint8_t)gid_self, (uint8_t)rid_self, (uint8_t)lane, 0, 0, sizeof(uint32_t)};
+    uint32_t wire = htonl(chunk_size);
+    int ret;
+    if (*shm)
+    {
+        unsigned char raw[FRAME_HEAD_SIZE];
+        frame_pack(&head, raw);
+        struct iovec iov[2] = {{raw, FRAME_HEAD_SIZE}, {&wire, sizeof(wire)}};
+        ret = shm_writev(*shm, iov, 2);
     }
+    else
+        ret = frame_send(fd_proxy, &head, &wire);
+    if (-1 == ret)
+        print_err("send failed", errno);
+    else
+        VERBOSE(1, "\t[SEND connect] (%d,%d) lane=%d chunk_size=%u\n", gid_self, rid_self, lane, chunk_size);
+
+    //ret = pthread_create(&pid, NULL, conn_proxy_rece, (void *)fd_proxy);
+    // if(-1 == ret)
+    //     print_err("proxy connect failed", errno);
+    return fd_proxy;
 }
 
 int main(int argc, char *argv[])
@@ -1962,6 +2721,73 @@ int main(int argc, char *argv[])
     //         P_PORT[i][j]=12001+i*RACK+j;
     // }
 
+    //options
+    int opt;
+    while ((opt = getopt(argc, argv, "c:e:i:n:tuw:xz")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            chunk_size = parse_chunk_size(optarg);
+            if (chunk_size == 0)
+            {
+                printf("bad chunk size %s, need a power of two in [4K,1M]\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'e':
+            encode_workers = atoi(optarg);
+            if (encode_workers <= 0)
+            {
+                printf("bad encode worker number %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'i':
+            io_threads = atoi(optarg);
+            if (io_threads <= 0)
+            {
+                printf("bad io thread number %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'n':
+            peer_lanes = atoi(optarg);
+            if (peer_lanes <= 0 || peer_lanes > PEER_LANES_MAX)
+            {
+                printf("bad lane number %s, need 1..%d\n", optarg, PEER_LANES_MAX);
+                exit(-1);
+            }
+            break;
+        case 't':
+            use_shm = 0;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'w':
+            request_workers = atoi(optarg);
+            if (request_workers <= 0)
+            {
+                printf("bad request worker number %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'x':
+            use_pack = 1;
+            break;
+        case 'z':
+            use_zerocopy = 1;
+            break;
+        default:
+            printf("usage: %s [-c chunk_size(4K..1M)] [-e encode_workers] [-i io_threads] [-n lanes] [-t] [-u] [-w request_workers] [-x] [-z]\n", argv[0]);
+            exit(-1);
+        }
+    }
+    //encoding on every core by default, one worker is left for the rest anyway
+    if (encode_workers == 0)
+        encode_workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
     //getname
     char hostname[20] = {0};
     FILE *host = fopen("/etc/hostname", "r");
@@ -1991,25 +2817,70 @@ int main(int argc, char *argv[])
 
     //memcached
     ECHash_init(&ech, GROUP, RACK, NODE, gid_self, rid_self);
+    if (ECHash_set_chunk_size(ech, chunk_size) != MEMCACHED_SUCCESS)
+    {
+        printf("libmemcached refuses chunk_size=%u\n", chunk_size);
+        exit(-1);
+    }
+    printf("chunk_size=%u\n", chunk_size);
 
     for (int i = 0; i < NODE; i++)
     {
         ECHash_init_addserver(ech, "127.0.0.1", 21000 + i);
     }
 
-    //thread pool
-    send_pool = threadpool_init(1, 10);
-    repair_pool = threadpool_init(1, 10);
-    gather_pool = threadpool_init(1, 10);
-    middle_pool = threadpool_init(1, 10);
-    update_pool = threadpool_init(1, 10);
-    update_ack_pool = threadpool_init(1, 10);
+    //coding tables, shared by encode and repair threads
+    codec_init();
 
-    //local_encode, global_encode
-    pthread_t leid, geid, lrid;
-    int ret = pthread_create(&leid, NULL, local_encode, (void *)NULL);
-    ret = pthread_create(&geid, NULL, global_encode, (void *)NULL);
-    ret = pthread_create(&lrid, NULL, local_repair, (void *)NULL);
+    //chunk buffers of frames, parities and repairs, the encode window of every peer faulted in now
+    slab_init(chunk_size, GROUP * RACK * FLOW_WINDOW);
+
+    //frames from other proxies
+    rece_table_init();
+
+    //requests of the requestor, encoding, sends to other proxies, repairs and gathers share the
+    //workers of one scheduler, by priority. Requests block on memcached, they get -w workers on
+    //top of one a core, folds get -e of them at most
+    //the tasks sending to a peer run in order through its serial
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    sched_init((cores > SCHED_MIN_WORKERS ? cores : SCHED_MIN_WORKERS) + request_workers);
+    sched_prio_limit(SCHED_FOREGROUND, request_workers);
+    sched_prio_limit(SCHED_ENCODING, encode_workers);
+    for (int p = 0; p < SCHED_PRIOS; p++)
+    {
+        sched_serial_init(&serial_unlinked[p]);
+        for (int i = 0; i < GROUP; i++)
+        {
+            for (int j = 0; j < RACK; j++)
+                sched_serial_init(&peers[i][j].serial[p]);
+        }
+    }
+
+    //buffer the next sealed chunk is copied into, under ech_mutex
+    seal_chunk = slab_alloc(chunk_size);
+
+    //frames from other proxies, read by the io threads, the blocking handlers run on rece_pool
+    //deltas in flight and their acks fit in, so the io threads never wait on it
+    rece_pool = threadpool_init(1, 10 + 2 * GROUP * RACK * FLOW_WINDOW);
+    mesh_reactor = reactor_init(io_threads, &rece_ops, use_uring);
+    //frames to other proxies, one writer thread a peer unless io_uring writes them all
+    if (use_uring && peer_uring_start() == -1)
+        VERBOSE(1, "\t[no io_uring, one writer thread a peer]\n");
+    if (use_zerocopy && peer_zerocopy_start() == -1)
+        VERBOSE(1, "\t[no MSG_ZEROCOPY, sends are copied]\n");
+    for (size_t i = 0; use_pack && i < sizeof(pack_table) / sizeof(pack_table[0]); i++)
+        peer_pack(pack_table[i].opcode, pack_table[i].codec);
+    //frames to other proxies share their queue by the priorities of the scheduler
+    for (size_t i = 0; i < sizeof(shape_table) / sizeof(shape_table[0]); i++)
+        peer_shape(shape_table[i].opcode, shape_table[i].prio);
+    for (int p = 0; p < SCHED_PRIOS; p++)
+        peer_class_weight(p, sched_prio_weight(p));
+    //frames with credits never wait for room, the io threads give out parked ones
+    peer_queue_bound(PEER_QUEUED + FLOW_QUEUED(chunk_size));
+
+    //local_repair
+    pthread_t lrid;
+    int ret = pthread_create(&lrid, NULL, local_repair, (void *)NULL);
 
     //******connect server
     connfd_server = socket(AF_INET, SOCK_STREAM, 0);
@@ -2040,6 +2911,14 @@ int main(int argc, char *argv[])
     pthread_t wid;
     ret = pthread_create(&wid, NULL, work, (void *)connfd_server);
 
+    //before the TCP listener, a peer that reaches that finds this too
+    int shm_listenfd = use_shm ? shm_listen(gid_self, rid_self) : -1;
+    if (use_shm && shm_listenfd == -1)
+        VERBOSE(1, "\t[no shared memory rings, %s]\n", strerror(errno));
+    pthread_t shid;
+    if (shm_listenfd != -1 && pthread_create(&shid, NULL, shm_server, (void *)(long)shm_listenfd) != 0)
+        print_err("shm server create failed", errno);
+
     pthread_t sid;
     ret = pthread_create(&sid, NULL, server, (void *)NULL);
     if (-1 == ret)
@@ -2053,57 +2932,30 @@ int main(int argc, char *argv[])
         {
             if (i == gid_self && j == rid_self)
                 continue;
-            //connect proxy
-            int fd_proxy = socket(AF_INET, SOCK_STREAM, 0);
-            int reuse = 1;
-            setsockopt(fd_proxy, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse));
-            const char chOpt = 1;
-            setsockopt(fd_proxy, IPPROTO_TCP, TCP_NODELAY, &chOpt, sizeof(char));
-
-            if (-1 == fd_proxy)
-            {
-                print_err("proxy socket failed", errno);
-            }
-            struct sockaddr_in addr1;
-            memset(&addr1, 0, sizeof(addr1));
-            addr1.sin_family = AF_INET;
-            addr1.sin_port = htons(P_PORT);
 
-            //	if(i==0 && j==0)
-            //		addr.sin_addr.s_addr = inet_addr(ip_demo);
-            //	else
-            addr1.sin_addr.s_addr = inet_addr(ips[i][j]);
-
-            while (1)
+            //the control lane, its fd stands for the peer in connfd_list_W, then the chunk lanes
+            struct peer_link *l = &peers[i][j];
+            flow_out_init(&l->flow);
+            for (int lane = 0; lane <= peer_lanes; lane++)
             {
-                int re = connect(fd_proxy, (struct sockaddr *)&addr1, sizeof(addr1));
-                if (-1 == re)
-                {
-                    print_err("server connect failed", errno);
-                    printf("number:%d %d, %s\n", i, j, ips[i][j]);
-                    sleep(1);
-                }
+                struct shm_ring *shm;
+                int fd_proxy = proxy_connect(i, j, lane, &shm);
+                struct peer_queue *q = lane == 0 ? &l->ctrl : &l->data[lane - 1];
+                if (shm)
+                    peer_init_shm(q, shm, i, j);
                 else
-                    break;
+                    peer_init(q, fd_proxy, i, j);
             }
 
-            pthread_t pid;
-            //send CONN and do not create a new thread
-            //ret = pthread_create(&pid, NULL, conn_proxy_send, (void *)fd_proxy);
-            char send_buf[COMMAND_SIZE] = {0};
-            sprintf(send_buf, "CONN %d %d", gid_self, rid_self);
-            int ret = send(fd_proxy, send_buf, COMMAND_SIZE, 0);
-            if (-1 == ret)
-                print_err("send failed", errno);
-            else
-                VERBOSE(1, "\t[SEND connect,%d]=>{%s}\n", ret, send_buf);
-
-            //ret = pthread_create(&pid, NULL, conn_proxy_rece, (void *)fd_proxy);
-            // if(-1 == ret)
-            //     print_err("proxy connect failed", errno);
-
-            //for sending
-            connfd_list_W[i][j] = fd_proxy;
+            //for sending, the writers first so peer_of never sees a fd without them
+            __atomic_store_n(&connfd_list_W[i][j], l->ctrl.fd, __ATOMIC_RELEASE);
+            //credits for what it sent before it could be reached
+            for (int cls = 0; cls < FLOW_CLASSES; cls++)
+            {
+                int n = flow_owed(&peers_in[i][j], cls);
+                if (n > 0)
+                    peer_grant(i, j, cls, n);
+            }
             VERBOSE(1, "Conn other groups connfd_list_W: ");
             for (int i = 0; i < GROUP; i++)
             {
@@ -2116,17 +2968,19 @@ int main(int argc, char *argv[])
 
     pthread_join(sid, NULL);
     pthread_join(wid, NULL);
-    pthread_join(leid, NULL);
-    pthread_join(geid, NULL);
     pthread_join(lrid, NULL);
     ECHash_destroy(ech);
 
-    threadpool_destroy(send_pool);
-    threadpool_destroy(repair_pool);
-    threadpool_destroy(gather_pool);
-    threadpool_destroy(middle_pool);
-    threadpool_destroy(update_pool);
-    threadpool_destroy(update_ack_pool);
+    sched_destroy();
+    for (int cls = 0; cls < SCHED_CLASSES; cls++)
+    {
+        struct sched_stats st;
+        sched_get_stats(cls, &st);
+        VERBOSE(1, "sched %s (%s): %lu tasks, %lu stolen, %.1f us waited, %.1f us run\n", sched_class_name(cls), sched_prio_name(sched_prio(cls)), st.run, st.stolen, st.wait_us, st.run_us);
+    }
+    threadpool_destroy(rece_pool);
+
+    codec_destroy();
 
     return 0;
 }
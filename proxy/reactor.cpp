@@ -0,0 +1,510 @@
+#include "reactor.hpp"
+#include "uring.hpp"
+#include "slab.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#ifdef HAVE_URING
+struct reactor_ring
+{
+    struct reactor *r;
+    struct uring u;
+
+    //reactor_add hands connections over, the eventfd wakes the thread
+    int efd;
+    uint64_t ebuf;
+    pthread_mutex_t mutex;
+    struct reactor_conn *added;
+
+    //REACTOR_SLOTS read buffers, registered as one
+    unsigned char *arena;
+    int free_slots[REACTOR_SLOTS];
+    int nfree;
+};
+
+static void slot_put(struct reactor_ring *g, struct reactor_conn *c);
+#endif
+
+static void conn_free(struct reactor_conn *c)
+{
+    if (c->r->rings == NULL)
+        epoll_ctl(c->r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->r->ops.close(c);
+    if (c->shm)
+        shm_close(c->shm);
+    else
+        close(c->fd);
+    slab_free(c->payload);
+#ifdef HAVE_URING
+    if (c->slot >= 0)
+    {
+        slot_put(c->ring, c);
+        c->rbuf = NULL;
+    }
+#endif
+    free(c->rbuf);
+    free(c);
+}
+
+//0 when a frame is complete, 1 when more bytes are needed, -1 to close
+static int conn_parse(struct reactor_conn *c)
+{
+    if (!c->in_payload)
+    {
+        if (c->rlen - c->rpos < FRAME_HEAD_SIZE)
+            return 1;
+        frame_unpack(c->rbuf + c->rpos, &c->head);
+        c->rpos += FRAME_HEAD_SIZE;
+        if (c->r->ops.head(c, &c->head) == -1)
+            return -1;
+        c->in_payload = 1;
+        c->got = 0;
+        c->payload = c->head.length ? slab_alloc(c->head.length) : NULL;
+    }
+
+    //what the buffer already holds
+    size_t take = c->rlen - c->rpos;
+    if (take > c->head.length - c->got)
+        take = c->head.length - c->got;
+    if (take)
+    {
+        memcpy(c->payload + c->got, c->rbuf + c->rpos, take);
+        c->rpos += take;
+        c->got += take;
+    }
+    return c->got == c->head.length ? 0 : 1;
+}
+
+//where the next read goes, straight into the payload when a large part of it is missing
+static unsigned char *conn_room(struct reactor_conn *c, size_t *room)
+{
+    if (c->in_payload && c->head.length - c->got >= REACTOR_BUF / 2)
+    {
+        *room = c->head.length - c->got;
+        return c->payload + c->got;
+    }
+
+    //keep the unparsed tail at the front
+    if (c->rpos > 0)
+    {
+        memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+        c->rlen -= c->rpos;
+        c->rpos = 0;
+    }
+    *room = REACTOR_BUF - c->rlen;
+    return c->rbuf + c->rlen;
+}
+
+//n bytes came to dst, from conn_room
+static void conn_got(struct reactor_conn *c, unsigned char *dst, size_t n)
+{
+    if (dst == c->rbuf + c->rlen)
+        c->rlen += n;
+    else
+        c->got += n;
+}
+
+//take from the ring what is there, as conn_fill
+static int conn_fill_shm(struct reactor_conn *c, unsigned char *dst, size_t room)
+{
+    size_t n = shm_read(c->shm, dst, room);
+    if (n > 0)
+    {
+        conn_got(c, dst, n);
+        return 1;
+    }
+    if (shm_done(c->shm))
+        return -1;
+
+    //empty, the kicks so far are seen, the writer kicks again once it finds the reader asleep
+    uint64_t v;
+    if (read(c->fd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+        return -1;
+    return shm_sleep(c->shm);
+}
+
+//recv what is there
+//1 when bytes came, 0 when none are left for now, -1 to close
+static int conn_fill(struct reactor_conn *c)
+{
+    size_t room;
+    unsigned char *dst = conn_room(c, &room);
+    if (c->shm)
+        return conn_fill_shm(c, dst, room);
+
+    //the fd stays blocking for writers, only the reads here do not wait
+    ssize_t ret = recv(c->fd, dst, room, MSG_DONTWAIT);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (ret <= 0)
+        return -1;
+    conn_got(c, dst, ret);
+    return 1;
+}
+
+//hand over every whole frame buffered, 1 when more bytes are needed, -1 to close
+static int conn_deliver(struct reactor_conn *c)
+{
+    while (1)
+    {
+        int ret = conn_parse(c);
+        if (ret != 0)
+            return ret;
+
+        //the payload goes with the frame
+        unsigned char *payload = c->payload;
+        c->payload = NULL;
+        c->in_payload = 0;
+        if (c->r->ops.frame(c, &c->head, payload) == -1)
+            return -1;
+    }
+}
+
+//0 to wait for more, -1 to close
+static int conn_read(struct reactor_conn *c)
+{
+    int reads = 0;
+    while (1)
+    {
+        if (conn_deliver(c) == -1)
+            return -1;
+
+        //frames already buffered are all handed over, the socket may still hold more
+        if (reads++ == REACTOR_READS)
+        {
+            //a ring does not stay readable for epoll, it has to be kicked
+            if (c->shm)
+                shm_kick(c->shm);
+            return 0;
+        }
+        int ret = conn_fill(c);
+        if (ret <= 0)
+            return ret;
+    }
+}
+
+static void *reactor_loop(void *arg)
+{
+    struct reactor *r = (struct reactor *)arg;
+    struct epoll_event events[REACTOR_EVENTS];
+
+    while (1)
+    {
+        int n = epoll_wait(r->epfd, events, REACTOR_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno != EINTR)
+                print_err("epoll_wait failed", errno);
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct reactor_conn *c = (struct reactor_conn *)events[i].data.ptr;
+            if (conn_read(c) == -1)
+            {
+                conn_free(c);
+                continue;
+            }
+
+            //one shot, so only one io thread works on a connection at a time
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            ev.data.ptr = c;
+            epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    }
+    return NULL;
+}
+
+#ifdef HAVE_URING
+//user_data of the eventfd read, connections use their address
+#define RING_WAKE 1
+
+static struct io_uring_sqe *ring_sqe(struct reactor_ring *g)
+{
+    struct io_uring_sqe *sqe;
+    //full, hand what is there over first
+    while ((sqe = uring_sqe(&g->u)) == NULL)
+        uring_submit(&g->u, 0);
+    return sqe;
+}
+
+static void ring_wait_added(struct reactor_ring *g)
+{
+    struct io_uring_sqe *sqe = ring_sqe(g);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = g->efd;
+    sqe->addr = (uint64_t)(uintptr_t)&g->ebuf;
+    sqe->len = sizeof(g->ebuf);
+    sqe->user_data = RING_WAKE;
+}
+
+//one read at a time a connection, so its bytes stay in order
+static void ring_read(struct reactor_ring *g, struct reactor_conn *c)
+{
+    size_t room;
+    c->rdst = conn_room(c, &room);
+
+    struct io_uring_sqe *sqe = ring_sqe(g);
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)c->rdst;
+    sqe->len = room;
+    sqe->user_data = (uint64_t)(uintptr_t)c;
+    if (c->slot >= 0 && c->rdst == c->rbuf + c->rlen)
+    {
+        //the kernel already holds the pages of the slot
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    }
+    else
+        sqe->opcode = IORING_OP_RECV;
+}
+
+static void slot_get(struct reactor_ring *g, struct reactor_conn *c)
+{
+    if (g->nfree > 0)
+    {
+        int i = g->free_slots[--g->nfree];
+        c->slot = i;
+        c->rbuf = g->arena + (size_t)i * REACTOR_BUF;
+    }
+    else
+    {
+        c->slot = -1;
+        c->rbuf = (unsigned char *)malloc(REACTOR_BUF);
+    }
+}
+
+static void slot_put(struct reactor_ring *g, struct reactor_conn *c)
+{
+    g->free_slots[g->nfree++] = c->slot;
+}
+
+static void ring_take_added(struct reactor_ring *g)
+{
+    pthread_mutex_lock(&g->mutex);
+    struct reactor_conn *c = g->added;
+    g->added = NULL;
+    pthread_mutex_unlock(&g->mutex);
+
+    while (c)
+    {
+        struct reactor_conn *next = c->next;
+        c->ring = g;
+        slot_get(g, c);
+        ring_read(g, c);
+        c = next;
+    }
+}
+
+static void *ring_loop(void *arg)
+{
+    struct reactor_ring *g = (struct reactor_ring *)arg;
+    ring_wait_added(g);
+
+    while (1)
+    {
+        //posts the reads of the last round and sleeps until one is done, one system call
+        if (uring_submit(&g->u, 1) < 0 && errno != EINTR && errno != EBUSY)
+            print_err("io_uring_enter failed", errno);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&g->u)) != NULL)
+        {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(&g->u);
+
+            if (data == RING_WAKE)
+            {
+                ring_take_added(g);
+                ring_wait_added(g);
+                continue;
+            }
+
+            struct reactor_conn *c = (struct reactor_conn *)(uintptr_t)data;
+            if (res == -EINTR || res == -EAGAIN)
+            {
+                ring_read(g, c);
+                continue;
+            }
+            if (res <= 0)
+            {
+                conn_free(c);
+                continue;
+            }
+            conn_got(c, c->rdst, res);
+            if (conn_deliver(c) == -1)
+            {
+                conn_free(c);
+                continue;
+            }
+            ring_read(g, c);
+        }
+    }
+    return NULL;
+}
+
+//-1 if this kernel has no io_uring, the caller goes on with epoll
+static int ring_init(struct reactor *r, struct reactor_ring *g)
+{
+    g->r = r;
+    if (uring_init(&g->u, REACTOR_RING) == -1)
+        return -1;
+    g->efd = eventfd(0, EFD_CLOEXEC);
+    if (g->efd == -1)
+    {
+        uring_exit(&g->u);
+        return -1;
+    }
+    pthread_mutex_init(&g->mutex, NULL);
+
+    //without the buffers registered (memlock limit) every read is a plain recv
+    g->arena = (unsigned char *)aligned_alloc(4096, (size_t)REACTOR_SLOTS * REACTOR_BUF);
+    struct iovec iov;
+    iov.iov_base = g->arena;
+    iov.iov_len = (size_t)REACTOR_SLOTS * REACTOR_BUF;
+    if (g->arena && uring_register_buffers(&g->u, &iov, 1) == 0)
+    {
+        for (int i = 0; i < REACTOR_SLOTS; i++)
+            g->free_slots[i] = REACTOR_SLOTS - 1 - i;
+        g->nfree = REACTOR_SLOTS;
+    }
+    else
+        VERBOSE(1, "\t[io_uring buffers not registered, %s]\n", strerror(errno));
+    return 0;
+}
+
+static int reactor_init_uring(struct reactor *r)
+{
+    r->rings = (struct reactor_ring *)calloc(r->nthreads, sizeof(struct reactor_ring));
+    for (int i = 0; i < r->nthreads; i++)
+    {
+        if (ring_init(r, &r->rings[i]) == -1)
+        {
+            //threads are not started yet, so nothing runs on the rings
+            for (int j = 0; j < i; j++)
+            {
+                uring_exit(&r->rings[j].u);
+                close(r->rings[j].efd);
+                free(r->rings[j].arena);
+            }
+            free(r->rings);
+            r->rings = NULL;
+            return -1;
+        }
+    }
+    for (int i = 0; i < r->nthreads; i++)
+    {
+        if (pthread_create(&r->threads[i], NULL, ring_loop, &r->rings[i]) != 0)
+            print_err("io thread create failed", errno);
+    }
+    return 0;
+}
+#endif
+
+struct reactor *reactor_init(int nthreads, const struct reactor_ops *ops, int uring)
+{
+    struct reactor *r = (struct reactor *)calloc(1, sizeof(struct reactor));
+    r->ops = *ops;
+    r->nthreads = nthreads;
+    r->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+
+#ifdef HAVE_URING
+    if (uring)
+    {
+        if (reactor_init_uring(r) == 0)
+        {
+            VERBOSE(1, "\t[%d io threads on io_uring]\n", nthreads);
+            return r;
+        }
+        VERBOSE(1, "\t[no io_uring, %d io threads on epoll]\n", nthreads);
+    }
+#else
+    if (uring)
+        VERBOSE(1, "\t[built without io_uring, %d io threads on epoll]\n", nthreads);
+#endif
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == -1)
+    {
+        print_err("epoll_create failed", errno);
+        free(r->threads);
+        free(r);
+        return NULL;
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&r->threads[i], NULL, reactor_loop, r) != 0)
+            print_err("io thread create failed", errno);
+    }
+    return r;
+}
+
+int reactor_add(struct reactor *r, int fd, void *user)
+{
+    struct reactor_conn *c = (struct reactor_conn *)calloc(1, sizeof(struct reactor_conn));
+    c->fd = fd;
+    c->user = user;
+    c->r = r;
+    c->slot = -1;
+
+#ifdef HAVE_URING
+    if (r->rings)
+    {
+        //the owning thread gives it a buffer and posts its first read
+        struct reactor_ring *g = &r->rings[__atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED) % r->nthreads];
+        pthread_mutex_lock(&g->mutex);
+        c->next = g->added;
+        g->added = c;
+        pthread_mutex_unlock(&g->mutex);
+        uint64_t one = 1;
+        if (write(g->efd, &one, sizeof(one)) != sizeof(one))
+            print_err("eventfd write failed", errno);
+        return 0;
+    }
+#endif
+
+    c->rbuf = (unsigned char *)malloc(REACTOR_BUF);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        print_err("epoll_ctl failed", errno);
+        free(c->rbuf);
+        free(c);
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_add_shm(struct reactor *r, struct shm_ring *shm, void *user)
+{
+    //the io_uring threads only post reads of sockets
+    if (r->rings)
+        return -1;
+
+    struct reactor_conn *c = (struct reactor_conn *)calloc(1, sizeof(struct reactor_conn));
+    c->fd = shm->data_efd;
+    c->user = user;
+    c->r = r;
+    c->slot = -1;
+    c->shm = shm;
+    c->rbuf = (unsigned char *)malloc(REACTOR_BUF);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+    {
+        print_err("epoll_ctl failed", errno);
+        free(c->rbuf);
+        free(c);
+        return -1;
+    }
+    return 0;
+}
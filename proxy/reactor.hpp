@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.hpp"
+#include "frame.hpp"
+#include "shm.hpp"
+
+//epoll loop for inbound connections, a few io threads serve any number of peers
+//each connection reassembles whole frames from what recv hands over, short reads included,
+//and gives every frame to ops.frame with its payload in one buffer of slab_alloc (slab.hpp),
+//a pooled one for chunk frames
+//with io_uring each io thread owns a ring and the connections given to it, reads go into
+//registered buffers and one io_uring_enter both posts them and waits, see reactor_init
+//a shared memory ring (shm.hpp) is read like a socket, epoll waits on its eventfd
+
+#define REACTOR_EVENTS 64       //events an epoll_wait
+#define REACTOR_BUF (64 << 10)  //read buffer a connection, small frames are parsed out of it
+#define REACTOR_READS 16        //recv calls on one connection a wakeup, the others get their turn
+#define REACTOR_SLOTS 64        //registered read buffers an io_uring thread, later connections read into their own
+#define REACTOR_RING 256        //sqes of a ring
+
+struct reactor_ring;
+
+struct reactor_conn;
+
+struct reactor_ops
+{
+    //a head is in, -1 closes the connection before its payload is read
+    int (*head)(struct reactor_conn *c, const struct frame_head *head);
+    //a whole frame, payload (NULL when empty) belongs to the callee, to slab_free, -1 closes the connection
+    int (*frame)(struct reactor_conn *c, const struct frame_head *head, unsigned char *payload);
+    //the connection is gone, fd is closed after this returns
+    void (*close)(struct reactor_conn *c);
+};
+
+struct reactor
+{
+    int epfd;
+    int nthreads;
+    pthread_t *threads;
+    struct reactor_ops ops;
+
+    //NULL with epoll, else one ring a thread, connections go round robin
+    struct reactor_ring *rings;
+    unsigned next;
+};
+
+struct reactor_conn
+{
+    int fd;
+    void *user;
+    struct reactor *r;
+
+    //bytes read but not parsed yet, [rpos, rlen) of rbuf
+    unsigned char *rbuf;
+    size_t rpos;
+    size_t rlen;
+
+    //frame being read, its payload once the head is in
+    int in_payload;
+    struct frame_head head;
+    unsigned char *payload;
+    size_t got;
+
+    //io_uring: the owning ring, registered slot of rbuf (-1 for a malloc'd one), where the read in flight goes
+    struct reactor_ring *ring;
+    int slot;
+    unsigned char *rdst;
+    struct reactor_conn *next;
+
+    //NULL for a socket, else the ring read instead of fd, which is its data_efd
+    struct shm_ring *shm;
+};
+
+//start nthreads io threads, on io_uring if uring is set and the kernel has it, else on epoll
+struct reactor *reactor_init(int nthreads, const struct reactor_ops *ops, int uring);
+
+//serve fd from now on, user is kept in the connection for the callbacks
+int reactor_add(struct reactor *r, int fd, void *user);
+
+//serve the frames of a ring from now on, the connection owns it, -1 on io_uring
+int reactor_add_shm(struct reactor *r, struct shm_ring *shm, void *user);
@@ -4,4 +4,4 @@ rm repair.txt
 export LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH
 make clean
 make all
-./proxy
\ No newline at end of file
+./proxy "$@"
\ No newline at end of file
@@ -0,0 +1,593 @@
+#include "sched.hpp"
+
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static const struct
+{
+    const char *name;
+    int prio;
+} classes[SCHED_CLASSES] = {
+    {"client", SCHED_FOREGROUND},
+    {"send", SCHED_ENCODING},
+    {"encode", SCHED_ENCODING},
+    {"repair", SCHED_DEGRADED},
+    {"gather", SCHED_DEGRADED},
+    {"middle", SCHED_DEGRADED},
+    {"update", SCHED_ENCODING},
+    {"update-ack", SCHED_PARITY},
+    {"repair-back", SCHED_BACKGROUND},
+};
+
+static const struct
+{
+    const char *name;
+    int weight;
+} prios[SCHED_PRIOS] = {
+    {"foreground", 16},
+    {"degraded", 8},
+    {"parity", 4},
+    {"encoding", 2},
+    {"background", 1},
+};
+
+//a serial's turn on a worker, its tasks are counted in their own classes
+#define SCHED_RUNNER SCHED_CLASSES
+
+//seq as in thread.cpp: == index free for the producer, == index + 1 full for the workers
+struct sched_task
+{
+    alignas(64) uint64_t seq;
+    void *(*fn)(void *arg);
+    void *arg;
+    int cls;
+    uint64_t stamp; //ns it was added
+};
+
+struct sched_ring
+{
+    struct sched_task *tasks;
+    alignas(64) uint64_t tail;
+    alignas(64) uint64_t head;
+};
+
+//a task of a serial, waiting in its list
+struct sched_item
+{
+    void *(*fn)(void *arg);
+    void *arg;
+    int cls;
+    uint64_t stamp;
+    struct sched_item *next;
+};
+
+struct sched_account
+{
+    alignas(64) unsigned long added;
+    int queued; //added, not started
+    unsigned long run;
+    unsigned long stolen;
+    uint64_t wait_ns;
+    uint64_t run_ns;
+};
+
+//a priority; the counts are hints for picking, the rings are what is there
+struct sched_level
+{
+    alignas(64) int queued; //tasks in its rings
+    int running;
+    int limit;         //running at once, 0 for no bound
+    uint64_t pass;     //ns run over weight, the least goes first
+    uint64_t last_run; //ns a task of it last started, or it got tasks again
+};
+
+static int nworkers = 0;
+static struct sched_ring *rings; //[worker][prio]
+static pthread_t *threads;
+static int spin;
+static unsigned next_ring = 0; //for tasks from other threads
+static __thread int self = -1; //ring of this worker
+
+//futex words as in thread.cpp
+alignas(64) static uint32_t task_seq = 0;
+static int task_idle = 0;
+alignas(64) static uint32_t room_seq = 0;
+static int room_waiting = 0;
+
+static int closing = 0; //no new tasks
+static int stopped = 0; //workers leave
+static int busy = 0;    //tasks running
+
+static struct sched_account accounts[SCHED_CLASSES];
+static struct sched_level levels[SCHED_PRIOS];
+//pass of the priority picked last, one that had no tasks starts from here, not from its old pass
+static uint64_t vtime = 0;
+
+const char *sched_class_name(int cls)
+{
+    if (cls < 0 || cls >= SCHED_CLASSES)
+        return "unknown";
+    return classes[cls].name;
+}
+
+const char *sched_prio_name(int prio)
+{
+    if (prio < 0 || prio >= SCHED_PRIOS)
+        return "unknown";
+    return prios[prio].name;
+}
+
+int sched_prio(int cls)
+{
+    return classes[cls].prio;
+}
+
+int sched_prio_weight(int prio)
+{
+    return prios[prio].weight;
+}
+
+static struct sched_ring *ring_of(int worker, int prio)
+{
+    return &rings[worker * SCHED_PRIOS + prio];
+}
+
+static uint64_t now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void futex_wait(uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static int ring_put(struct sched_ring *r, void *(*fn)(void *arg), void *arg, int cls, uint64_t stamp)
+{
+    uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    while (1)
+    {
+        struct sched_task *t = &r->tasks[pos % SCHED_QUEUE];
+        int64_t d = (int64_t)(__atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) - pos);
+        if (d == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                t->fn = fn;
+                t->arg = arg;
+                t->cls = cls;
+                t->stamp = stamp;
+                __atomic_store_n(&t->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        }
+        else if (d < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+}
+
+static int ring_take(struct sched_ring *r, struct sched_task *out)
+{
+    uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    while (1)
+    {
+        struct sched_task *t = &r->tasks[pos % SCHED_QUEUE];
+        int64_t d = (int64_t)(__atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (d == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                out->fn = t->fn;
+                out->arg = t->arg;
+                out->cls = t->cls;
+                out->stamp = t->stamp;
+                __atomic_store_n(&t->seq, pos + SCHED_QUEUE, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (d < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+}
+
+static int sleeper_take(int *sleepers)
+{
+    int n = __atomic_load_n(sleepers, __ATOMIC_RELAXED);
+    while (n > 0 && !__atomic_compare_exchange_n(sleepers, &n, n - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return n > 0;
+}
+
+//the waker takes the sleeper off the count, see thread.cpp
+static void wake_one(uint32_t *seq, int *sleepers)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (sleeper_take(sleepers))
+    {
+        __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+        futex_wake(seq, 1);
+    }
+}
+
+//a task is in a ring of l, counted before the wake so the woken worker sees it
+static void level_queued(struct sched_level *l)
+{
+    if (__atomic_fetch_add(&l->queued, 1, __ATOMIC_RELAXED) == 0)
+    {
+        //it had nothing to run, its old pass would let it have the workers to itself for a while
+        uint64_t v = __atomic_load_n(&vtime, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&l->pass, __ATOMIC_RELAXED) < v)
+            __atomic_store_n(&l->pass, v, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->last_run, now_ns(), __ATOMIC_RELAXED);
+    }
+    //at its limit the worker that finishes one of its tasks takes the next, a woken one could not
+    //the fence pairs with the one a worker has before it looks again and sleeps
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (l->limit == 0 || __atomic_load_n(&l->running, __ATOMIC_RELAXED) < l->limit)
+        wake_one(&task_seq, &task_idle);
+}
+
+//into the ring of prio of this worker, or of the next one for other threads, then the others if it is full
+//internal tasks (a serial's next turn) still go once closing
+static int queue_task(void *(*fn)(void *arg), void *arg, int cls, int prio, uint64_t stamp, int internal)
+{
+    int w = self >= 0 ? self : (int)(__atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED) % nworkers);
+    while (internal || !__atomic_load_n(&closing, __ATOMIC_ACQUIRE))
+    {
+        for (int k = 0; k < nworkers; k++)
+        {
+            if (ring_put(ring_of((w + k) % nworkers, prio), fn, arg, cls, stamp) == 0)
+            {
+                level_queued(&levels[prio]);
+                return 0;
+            }
+        }
+
+        //every ring is full, wait for a take
+        uint32_t seq = __atomic_load_n(&room_seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&room_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_put(ring_of(w, prio), fn, arg, cls, stamp) == 0)
+        {
+            sleeper_take(&room_waiting);
+            level_queued(&levels[prio]);
+            return 0;
+        }
+        if (!__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+            futex_wait(&room_seq, seq);
+        else
+            break;
+    }
+    return -1;
+}
+
+//a task of prio, own ring first, then the others from the next one on
+static int take_level(int prio, struct sched_task *t, int *stolen)
+{
+    for (int k = 0; k < nworkers; k++)
+    {
+        if (ring_take(ring_of((self + k) % nworkers, prio), t))
+        {
+            *stolen = k != 0;
+            //counted running before the ring looks empty, for sched_destroy
+            __atomic_add_fetch(&busy, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&levels[prio].queued, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&room_waiting, __ATOMIC_RELAXED) > 0)
+                wake_one(&room_seq, &room_waiting);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//priorities with tasks and room under their limit, the starved first, then by pass
+static int level_order(int *order)
+{
+    uint64_t now = now_ns();
+    uint64_t key[SCHED_PRIOS];
+    int n = 0;
+    for (int p = 0; p < SCHED_PRIOS; p++)
+    {
+        struct sched_level *l = &levels[p];
+        if (__atomic_load_n(&l->queued, __ATOMIC_RELAXED) <= 0)
+            continue;
+        if (l->limit && __atomic_load_n(&l->running, __ATOMIC_RELAXED) >= l->limit)
+            continue;
+        uint64_t last = __atomic_load_n(&l->last_run, __ATOMIC_RELAXED);
+        //starved ones ahead of any pass, in priority order
+        uint64_t k = now > last && now - last > SCHED_STARVE_US * 1000ull ? p : SCHED_PRIOS + __atomic_load_n(&l->pass, __ATOMIC_RELAXED);
+        int i = n++;
+        for (; i > 0 && key[i - 1] > k; i--)
+        {
+            key[i] = key[i - 1];
+            order[i] = order[i - 1];
+        }
+        key[i] = k;
+        order[i] = p;
+    }
+    return n;
+}
+
+static int take_any(struct sched_task *t, int *stolen, int *prio)
+{
+    int order[SCHED_PRIOS];
+    int n = level_order(order);
+    for (int i = 0; i < n; i++)
+    {
+        struct sched_level *l = &levels[order[i]];
+        //the limit is held by counting first
+        int running = __atomic_add_fetch(&l->running, 1, __ATOMIC_RELAXED);
+        if ((l->limit == 0 || running <= l->limit) && take_level(order[i], t, stolen))
+        {
+            *prio = order[i];
+            __atomic_store_n(&l->last_run, now_ns(), __ATOMIC_RELAXED);
+            __atomic_store_n(&vtime, __atomic_load_n(&l->pass, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+            return 1;
+        }
+        __atomic_sub_fetch(&l->running, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static int next_task(struct sched_task *t, int *stolen, int *prio)
+{
+    while (1)
+    {
+        for (int i = 0; i <= spin; i++)
+        {
+            if (take_any(t, stolen, prio))
+                return 1;
+            if (__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+                return 0;
+            cpu_relax();
+        }
+
+        uint32_t seq = __atomic_load_n(&task_seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&task_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (take_any(t, stolen, prio))
+        {
+            sleeper_take(&task_idle);
+            return 1;
+        }
+        if (!__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+            futex_wait(&task_seq, seq);
+    }
+}
+
+static void run_task(void *(*fn)(void *arg), void *arg, int cls, uint64_t stamp, int stolen)
+{
+    __atomic_sub_fetch(&accounts[cls].queued, 1, __ATOMIC_RELAXED);
+    uint64_t start = now_ns();
+    fn(arg);
+    uint64_t end = now_ns();
+
+    //charged to its priority, the others go first until they have run as much for their weight
+    __atomic_add_fetch(&levels[classes[cls].prio].pass, (end - start) / prios[classes[cls].prio].weight, __ATOMIC_RELAXED);
+
+    struct sched_account *a = &accounts[cls];
+    __atomic_add_fetch(&a->run, 1, __ATOMIC_RELAXED);
+    if (stolen)
+        __atomic_add_fetch(&a->stolen, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->wait_ns, start - stamp, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->run_ns, end - start, __ATOMIC_RELAXED);
+}
+
+//a turn of a serial: up to SCHED_SERIAL_RUN of its tasks, then to the back of the ring if more wait
+static void *serial_run(void *arg)
+{
+    struct sched_serial *s = (struct sched_serial *)arg;
+    for (int i = 0; i < SCHED_SERIAL_RUN; i++)
+    {
+        pthread_mutex_lock(&s->mutex);
+        struct sched_item *item = s->first;
+        if (item == NULL)
+        {
+            s->scheduled = 0;
+            pthread_mutex_unlock(&s->mutex);
+            return NULL;
+        }
+        s->first = item->next;
+        if (s->first == NULL)
+            s->last = NULL;
+        if (s->count-- == SCHED_SERIAL_MAX)
+            pthread_cond_broadcast(&s->room);
+        pthread_mutex_unlock(&s->mutex);
+
+        run_task(item->fn, item->arg, item->cls, item->stamp, 0);
+        free(item);
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    int more = s->first != NULL;
+    if (!more)
+        s->scheduled = 0;
+    pthread_mutex_unlock(&s->mutex);
+    if (more)
+        queue_task(serial_run, s, SCHED_RUNNER, s->prio, 0, 1);
+    return NULL;
+}
+
+static void *sched_worker(void *arg)
+{
+    self = (int)(long)arg;
+    struct sched_task t;
+    int stolen, prio;
+    while (next_task(&t, &stolen, &prio))
+    {
+        if (t.cls == SCHED_RUNNER)
+            t.fn(t.arg);
+        else
+            run_task(t.fn, t.arg, t.cls, t.stamp, stolen);
+        __atomic_sub_fetch(&levels[prio].running, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&busy, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void sched_init(int workers)
+{
+    if (workers <= 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > SCHED_MIN_WORKERS ? cores : SCHED_MIN_WORKERS;
+    }
+    nworkers = workers;
+    spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SCHED_SPIN : 0;
+
+    //encoding and background leave a worker to the others
+    for (int p = 0; p < SCHED_PRIOS; p++)
+        sched_prio_limit(p, 0);
+
+    rings = (struct sched_ring *)aligned_alloc(64, sizeof(struct sched_ring) * nworkers * SCHED_PRIOS);
+    memset(rings, 0, sizeof(struct sched_ring) * nworkers * SCHED_PRIOS);
+    for (int i = 0; i < nworkers * SCHED_PRIOS; i++)
+    {
+        rings[i].tasks = (struct sched_task *)aligned_alloc(64, sizeof(struct sched_task) * SCHED_QUEUE);
+        for (int j = 0; j < SCHED_QUEUE; j++)
+            rings[i].tasks[j].seq = j;
+    }
+
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * nworkers);
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&threads[i], NULL, sched_worker, (void *)(long)i) != 0)
+            print_err("sched worker create failed", errno);
+    }
+}
+
+void sched_prio_limit(int prio, int running)
+{
+    if (prio == SCHED_ENCODING || prio == SCHED_BACKGROUND)
+    {
+        int most = nworkers > 1 ? nworkers - 1 : 1;
+        if (running == 0 || running > most)
+            running = most;
+    }
+    levels[prio].limit = running;
+}
+
+int sched_add(int cls, void *(*fn)(void *arg), void *arg)
+{
+    __atomic_add_fetch(&accounts[cls].added, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&accounts[cls].queued, 1, __ATOMIC_RELAXED);
+    if (queue_task(fn, arg, cls, classes[cls].prio, now_ns(), 0) == 0)
+        return 0;
+    __atomic_sub_fetch(&accounts[cls].queued, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+int sched_try_add(int cls, void *(*fn)(void *arg), void *arg, int waiting)
+{
+    if (__atomic_load_n(&accounts[cls].queued, __ATOMIC_RELAXED) >= waiting)
+        return -1;
+    return sched_add(cls, fn, arg);
+}
+
+void sched_serial_init(struct sched_serial *s)
+{
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->room, NULL);
+    s->first = s->last = NULL;
+    s->count = 0;
+    s->scheduled = 0;
+    s->prio = 0;
+}
+
+int sched_add_serial(struct sched_serial *s, int cls, void *(*fn)(void *arg), void *arg)
+{
+    if (__atomic_load_n(&closing, __ATOMIC_ACQUIRE))
+        return -1;
+    struct sched_item *item = (struct sched_item *)malloc(sizeof(struct sched_item));
+    item->fn = fn;
+    item->arg = arg;
+    item->cls = cls;
+    item->stamp = now_ns();
+    item->next = NULL;
+    __atomic_add_fetch(&accounts[cls].added, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&accounts[cls].queued, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&s->mutex);
+    //the serial runs on its own, a worker adding to a full one would only wait for another worker
+    while (s->count >= SCHED_SERIAL_MAX && self < 0)
+        pthread_cond_wait(&s->room, &s->mutex);
+    s->count++;
+    if (s->last)
+        s->last->next = item;
+    else
+        s->first = item;
+    s->last = item;
+    int start = !s->scheduled;
+    s->scheduled = 1;
+    s->prio = classes[cls].prio;
+    pthread_mutex_unlock(&s->mutex);
+
+    //the serial's turn, its tasks wait in the list until it runs
+    return start ? queue_task(serial_run, s, SCHED_RUNNER, classes[cls].prio, 0, 1) : 0;
+}
+
+void sched_get_stats(int cls, struct sched_stats *st)
+{
+    struct sched_account *a = &accounts[cls];
+    st->added = __atomic_load_n(&a->added, __ATOMIC_RELAXED);
+    st->run = __atomic_load_n(&a->run, __ATOMIC_RELAXED);
+    st->stolen = __atomic_load_n(&a->stolen, __ATOMIC_RELAXED);
+    st->wait_us = __atomic_load_n(&a->wait_ns, __ATOMIC_RELAXED) / 1000.0;
+    st->run_us = __atomic_load_n(&a->run_ns, __ATOMIC_RELAXED) / 1000.0;
+}
+
+static int rings_empty()
+{
+    for (int i = 0; i < nworkers * SCHED_PRIOS; i++)
+    {
+        if (__atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE) != __atomic_load_n(&rings[i].tail, __ATOMIC_ACQUIRE))
+            return 0;
+    }
+    return 1;
+}
+
+void sched_destroy()
+{
+    if (__atomic_exchange_n(&closing, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    //a running serial may queue its next turn, so the rings are empty only once nothing runs
+    while (!rings_empty() || __atomic_load_n(&busy, __ATOMIC_ACQUIRE) != 0)
+        usleep(1000);
+
+    __atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&task_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&task_seq, INT_MAX);
+    __atomic_add_fetch(&room_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&room_seq, INT_MAX);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < nworkers * SCHED_PRIOS; i++)
+        free(rings[i].tasks);
+    free(rings);
+    free(threads);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.hpp"
+
+//one scheduler for the proxy's work: client requests, encoding, frames to other proxies, repairs, gathers
+//each worker has its own rings of tasks (the ring of thread.cpp, with a class and a time a slot),
+//one a priority, a worker adds to its own rings, other threads spread over them, and a worker whose
+//rings are empty steals from the others before it sleeps, so a burst of one class runs on every worker
+//
+//priorities share the workers by weight: of those with tasks, the one with the least run time for
+//its weight goes first, and one that has not run for SCHED_STARVE_US goes before all of them.
+//Encoding and background repair never take every worker, one is left for the others
+//
+//tasks of a serial run one at a time in the order they were added, on whichever worker is free,
+//frames to one peer keep their order that way without a thread of their own
+
+enum sched_prio
+{
+    SCHED_FOREGROUND = 0, //client reads and writes
+    SCHED_DEGRADED,       //repairs a client waits for
+    SCHED_PARITY,         //acks of parity updates
+    SCHED_ENCODING,       //sealed chunks and their folds
+    SCHED_BACKGROUND,     //repairs nobody waits for
+    SCHED_PRIOS
+};
+
+enum sched_class
+{
+    SCHED_CLIENT = 0,  //requests of the requestor
+    SCHED_SEND,        //data chunks to the parity racks
+    SCHED_ENCODE,      //data chunks folded into the parities here
+    SCHED_REPAIR,      //degraded reads
+    SCHED_GATHER,      //shares for another proxy's repair
+    SCHED_MIDDLE,      //those shares to the wire
+    SCHED_UPDATE,      //parity deltas, in the serial of the data chunks to the same peer
+    SCHED_UPDATE_ACK,  //their acks
+    SCHED_REPAIR_BACK, //repairs run again for measurement
+    SCHED_CLASSES
+};
+
+#define SCHED_QUEUE 256       //tasks a worker ring
+#define SCHED_SPIN 256        //tries before a worker sleeps, none on a single cpu
+#define SCHED_SERIAL_RUN 16   //tasks of a serial run before it lets others in
+#define SCHED_SERIAL_MAX 64   //tasks waiting in a serial before adding one waits
+#define SCHED_MIN_WORKERS 4   //tasks block on memcached and peer queues, so not fewer on small hosts
+#define SCHED_STARVE_US 20000 //a priority with tasks that has not run for this long goes first
+
+//tasks in order, one at a time, all of one priority
+struct sched_item;
+struct sched_serial
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t room;
+    struct sched_item *first;
+    struct sched_item *last;
+    int count;
+    int scheduled; //a worker has it or it is queued
+    int prio;      //of its tasks
+};
+
+//per class, for logs
+struct sched_stats
+{
+    unsigned long added;
+    unsigned long run;
+    unsigned long stolen; //run by a worker other than the one it was queued on
+    double wait_us;       //queued to started, in all
+    double run_us;
+};
+
+const char *sched_class_name(int cls);
+const char *sched_prio_name(int prio);
+
+//priority of a class
+int sched_prio(int cls);
+
+//share of the workers a priority gets while others have tasks too, relative to the other weights
+int sched_prio_weight(int prio);
+
+//start the workers, if workers is 0 one a core of the host and at least SCHED_MIN_WORKERS
+void sched_init(int workers);
+
+//at most running tasks of prio at once, 0 for no bound; encoding and background stay below the
+//workers anyway. After sched_init
+void sched_prio_limit(int prio, int running);
+
+//run fn(arg) on a worker, waits while every ring of its priority is full, -1 once the scheduler is stopped
+int sched_add(int cls, void *(*fn)(void *arg), void *arg);
+
+//the same, -1 at once if waiting tasks of cls are queued already
+int sched_try_add(int cls, void *(*fn)(void *arg), void *arg, int waiting);
+
+void sched_serial_init(struct sched_serial *s);
+
+//run fn(arg) after the tasks added to s before it, waits while SCHED_SERIAL_MAX are waiting,
+//all tasks of s are of one priority, -1 once the scheduler is stopped
+int sched_add_serial(struct sched_serial *s, int cls, void *(*fn)(void *arg), void *arg);
+
+void sched_get_stats(int cls, struct sched_stats *st);
+
+//waits until the queued tasks are taken, then stops the workers
+void sched_destroy();
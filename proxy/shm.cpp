@@ -0,0 +1,338 @@
+#include "shm.hpp"
+#include "common.hpp"
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define SHM_FDS 3 //memfd, data_efd, room_efd
+
+static socklen_t shm_addr(struct sockaddr_un *a, int gid, int rid)
+{
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    //abstract, sun_path[0] stays 0 and the name is not a file
+    int n = snprintf(a->sun_path + 1, sizeof(a->sun_path) - 1, "haf-wec-%d-%d-%d", P_PORT, gid, rid);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+static size_t shm_bytes(size_t size)
+{
+    return sizeof(struct shm_shared) + size;
+}
+
+static struct shm_ring *shm_map(int memfd, int sock, int data_efd, int room_efd, size_t size)
+{
+    void *p = mmap(NULL, shm_bytes(size), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    struct shm_ring *r = (struct shm_ring *)calloc(1, sizeof(struct shm_ring));
+    r->s = (struct shm_shared *)p;
+    r->size = size;
+    r->sock = sock;
+    r->data_efd = data_efd;
+    r->room_efd = room_efd;
+    return r;
+}
+
+int shm_listen(int gid, int rid)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    struct sockaddr_un a;
+    socklen_t len = shm_addr(&a, gid, rid);
+    if (bind(fd, (struct sockaddr *)&a, len) == -1 || listen(fd, LISTEN_NUM) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct shm_ring *shm_connect(int gid, int rid)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return NULL;
+    struct sockaddr_un a;
+    socklen_t len = shm_addr(&a, gid, rid);
+    if (connect(sock, (struct sockaddr *)&a, len) == -1)
+    {
+        close(sock);
+        return NULL;
+    }
+
+    int memfd = memfd_create("haf-wec-ring", MFD_CLOEXEC);
+    int data_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int room_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct shm_ring *r = NULL;
+    if (memfd != -1 && data_efd != -1 && room_efd != -1 && ftruncate(memfd, shm_bytes(SHM_RING)) == 0)
+        r = shm_map(memfd, sock, data_efd, room_efd, SHM_RING);
+    if (r == NULL)
+    {
+        close(sock);
+        if (memfd != -1)
+            close(memfd);
+        if (data_efd != -1)
+            close(data_efd);
+        if (room_efd != -1)
+            close(room_efd);
+        return NULL;
+    }
+    r->s->size = SHM_RING;
+
+    //one byte and the three fds
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union
+    {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(SHM_FDS * sizeof(int));
+    int fds[SHM_FDS] = {memfd, data_efd, room_efd};
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    //the peer holds its own copy of the fds now, the map keeps the memfd alive
+    int ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 && recv(sock, &byte, 1, 0) == 1;
+    close(memfd);
+    if (!ok)
+    {
+        shm_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+struct shm_ring *shm_accept(int listenfd, int *err)
+{
+    *err = 0;
+    int sock = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1)
+    {
+        *err = errno != EINTR && errno != ECONNABORTED;
+        return NULL;
+    }
+
+    //only proxies of the same user map their memory here
+    struct ucred cred;
+    socklen_t clen = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &clen) == -1 || cred.uid != geteuid())
+    {
+        close(sock);
+        return NULL;
+    }
+
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union
+    {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (ret != 1 || cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(SHM_FDS * sizeof(int)))
+    {
+        //fds that did come are closed with the message, none are kept
+        if (cm && cm->cmsg_type == SCM_RIGHTS)
+        {
+            int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < n; i++)
+                close(((int *)CMSG_DATA(cm))[i]);
+        }
+        close(sock);
+        return NULL;
+    }
+    int fds[SHM_FDS];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    //the size is the writer's word, it has to fit the memfd
+    struct stat st;
+    struct shm_ring *r = NULL;
+    uint64_t size = 0;
+    if (fstat(fds[0], &st) == 0 && (size_t)st.st_size > sizeof(struct shm_shared) &&
+        pread(fds[0], &size, sizeof(size), offsetof(struct shm_shared, size)) == sizeof(size) &&
+        size > 0 && (size & (size - 1)) == 0 && shm_bytes(size) <= (size_t)st.st_size)
+        r = shm_map(fds[0], sock, fds[1], fds[2], size);
+    close(fds[0]);
+    if (r == NULL)
+    {
+        close(fds[1]);
+        close(fds[2]);
+        close(sock);
+    }
+    return r;
+}
+
+int shm_ready(struct shm_ring *r)
+{
+    //the reader waits on data_efd until the first bytes, the writer has to kick it
+    __atomic_store_n(&r->s->reader_sleeping, 1, __ATOMIC_SEQ_CST);
+    char byte = 1;
+    return send(r->sock, &byte, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+void shm_kick(struct shm_ring *r)
+{
+    uint64_t one = 1;
+    //a full counter already wakes the reader
+    if (write(r->data_efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        print_err("eventfd write failed", errno);
+}
+
+static void room_kick(struct shm_ring *r)
+{
+    uint64_t one = 1;
+    if (write(r->room_efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        print_err("eventfd write failed", errno);
+}
+
+void shm_close(struct shm_ring *r)
+{
+    __atomic_store_n(&r->s->closed, 1, __ATOMIC_SEQ_CST);
+    shm_kick(r);
+    room_kick(r);
+    munmap(r->s, shm_bytes(r->size));
+    close(r->sock);
+    close(r->data_efd);
+    close(r->room_efd);
+    free(r);
+}
+
+//the bytes up to tail are the reader's, wake it if it sleeps
+static void shm_publish(struct shm_ring *r, uint64_t tail)
+{
+    struct shm_shared *s = r->s;
+    __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+    //against shm_sleep: either it sees the tail or this sees it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->reader_sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&s->reader_sleeping, 0, __ATOMIC_RELAXED))
+        shm_kick(r);
+}
+
+//0 once there is room, -1 if the reader is gone
+static int shm_wait_room(struct shm_ring *r, uint64_t tail)
+{
+    struct shm_shared *s = r->s;
+    __atomic_store_n(&s->writer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) < r->size)
+    {
+        __atomic_store_n(&s->writer_waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (__atomic_load_n(&s->closed, __ATOMIC_ACQUIRE))
+        return -1;
+
+    struct pollfd p[2] = {{r->room_efd, POLLIN, 0}, {r->sock, POLLRDHUP, 0}};
+    if (poll(p, 2, -1) == -1)
+        return errno == EINTR ? 0 : -1;
+    if (p[1].revents)
+        return -1;
+    uint64_t v;
+    if (read(r->room_efd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+int shm_writev(struct shm_ring *r, const struct iovec *iov, int iovcnt)
+{
+    struct shm_shared *s = r->s;
+    if (__atomic_load_n(&s->closed, __ATOMIC_ACQUIRE))
+        return -1;
+
+    uint64_t tail = s->tail;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const unsigned char *p = (const unsigned char *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            size_t room = r->size - (tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE));
+            if (room == 0)
+            {
+                //what is in goes first, or both sides wait
+                shm_publish(r, tail);
+                if (shm_wait_room(r, tail) == -1)
+                    return -1;
+                continue;
+            }
+
+            size_t n = left < room ? left : room;
+            size_t off = tail & (r->size - 1);
+            size_t first = n < r->size - off ? n : r->size - off;
+            memcpy(s->data + off, p, first);
+            memcpy(s->data, p + first, n - first);
+            tail += n;
+            p += n;
+            left -= n;
+        }
+    }
+    shm_publish(r, tail);
+    return 0;
+}
+
+size_t shm_read(struct shm_ring *r, void *buf, size_t len)
+{
+    struct shm_shared *s = r->s;
+    uint64_t head = s->head;
+    size_t avail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) - head;
+    size_t n = len < avail ? len : avail;
+    if (n == 0)
+        return 0;
+
+    size_t off = head & (r->size - 1);
+    size_t first = n < r->size - off ? n : r->size - off;
+    memcpy(buf, s->data + off, first);
+    memcpy((unsigned char *)buf + first, s->data, n - first);
+    __atomic_store_n(&s->head, head + n, __ATOMIC_RELEASE);
+
+    //against shm_wait_room, as shm_publish against shm_sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->writer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&s->writer_waiting, 0, __ATOMIC_RELAXED))
+        room_kick(r);
+    return n;
+}
+
+int shm_sleep(struct shm_ring *r)
+{
+    struct shm_shared *s = r->s;
+    __atomic_store_n(&s->reader_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) != s->head)
+    {
+        __atomic_store_n(&s->reader_sleeping, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+int shm_done(struct shm_ring *r)
+{
+    struct shm_shared *s = r->s;
+    return __atomic_load_n(&s->closed, __ATOMIC_ACQUIRE) && __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) == s->head;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+//frames between two proxies on one host, without the network stack
+//a lane is a one way ring of frame bytes in a memfd both proxies map, one writer and one reader,
+//and two eventfds: the writer wakes a reader that went to sleep on an empty ring, the reader
+//wakes a writer that waits for room on a full one. The bytes are the same frames a socket
+//carries, so peer queues write them and the reactor parses them as before
+//
+//the ring is set up over a unix socket in the abstract namespace, "haf-wec-<port>-<gid>-<rid>",
+//that only proxies of this host (and network namespace) can reach: the one that connects makes
+//the memfd and the eventfds and hands them over with SCM_RIGHTS, the other maps them and
+//answers one byte once its reactor reads them. Any failure on the way and the lane goes over
+//TCP. The socket stays open for the life of the ring, its hang up tells the writer that the
+//reader is gone
+
+#define SHM_RING (4 << 20) //data bytes a ring, a power of two
+
+//in the memfd, writer and reader fields on their own cache lines
+struct shm_shared
+{
+    uint64_t size;
+    uint32_t closed; //either side is done, the reader closes once the ring is empty
+
+    alignas(64) uint64_t tail; //bytes ever written, only the writer moves it
+    uint32_t writer_waiting;   //the writer sleeps until room_efd, the reader clears it
+
+    alignas(64) uint64_t head; //bytes ever read, only the reader moves it
+    uint32_t reader_sleeping;  //the reader waits on data_efd, the writer clears it
+
+    alignas(64) unsigned char data[];
+};
+
+struct shm_ring
+{
+    struct shm_shared *s;
+    size_t size;
+    int sock;     //of the handshake
+    int data_efd; //bytes came, for the reader
+    int room_efd; //room came, for the writer
+};
+
+//listening socket for the rings of other proxies, -1 if it cannot be had
+int shm_listen(int gid, int rid);
+
+//a ring to proxy (gid, rid), NULL if it is not on this host or the handshake fails
+struct shm_ring *shm_connect(int gid, int rid);
+
+//the next ring from listenfd, NULL for a handshake that failed, listenfd gone if *err is set
+struct shm_ring *shm_accept(int listenfd, int *err);
+
+//the reader serves the ring, the writer may start
+int shm_ready(struct shm_ring *r);
+
+//unmap, close the fds, tell the other side
+void shm_close(struct shm_ring *r);
+
+//writer: all of iov, waits while the ring is full, 0 or -1 when the reader is gone
+int shm_writev(struct shm_ring *r, const struct iovec *iov, int iovcnt);
+
+//reader: at most len bytes, 0 if the ring is empty
+size_t shm_read(struct shm_ring *r, void *buf, size_t len);
+
+//reader: about to wait on data_efd, 1 if bytes came in the meantime and it should not
+int shm_sleep(struct shm_ring *r);
+
+//reader: nothing left and the writer closed
+int shm_done(struct shm_ring *r);
+
+//wake the reader, also used by the reader itself when it leaves bytes in the ring for later
+void shm_kick(struct shm_ring *r);
@@ -0,0 +1,180 @@
+#include "slab.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct slab
+{
+    unsigned char *base;
+    uint32_t *refs; //holders of each buffer, 0 while it is free
+};
+
+//slabs sorted by base, replaced as a whole when one is carved so lookups take no lock
+//the old tables stay, a lookup may still be in one, there are as many as slabs
+struct slab_table
+{
+    int n;
+    struct slab *slabs[];
+};
+
+static size_t buf_size = 0;
+static size_t stride;   //buf_size rounded up to SLAB_ALIGN
+static size_t per_slab; //buffers a slab
+static struct slab_table *table = NULL;
+
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+//free buffers, each keeps the next in its first bytes
+static unsigned char *free_list = NULL;
+static unsigned long idle = 0;
+static unsigned long mallocs = 0;
+
+//slab of p and its index in it, NULL if p is not pooled
+static struct slab *slab_of(const void *p, size_t *i)
+{
+    struct slab_table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    if (t == NULL || p == NULL)
+        return NULL;
+    uintptr_t a = (uintptr_t)p;
+
+    //the last slab at or below p
+    int lo = 0, hi = t->n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if ((uintptr_t)t->slabs[mid]->base <= a)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    struct slab *s = t->slabs[lo - 1];
+    size_t off = a - (uintptr_t)s->base;
+    if (off >= per_slab * stride)
+        return NULL;
+    *i = off / stride;
+    return s;
+}
+
+static void push_free(unsigned char *b)
+{
+    memcpy(b, &free_list, sizeof(free_list));
+    free_list = b;
+    idle++;
+}
+
+//a new slab, its buffers go on the free list; under slab_mutex
+static int slab_grow()
+{
+    struct slab *s = (struct slab *)malloc(sizeof(struct slab));
+    s->base = (unsigned char *)aligned_alloc(SLAB_ALIGN, per_slab * stride);
+    s->refs = (uint32_t *)calloc(per_slab, sizeof(uint32_t));
+    if (s->base == NULL || s->refs == NULL)
+    {
+        free(s->base);
+        free(s->refs);
+        free(s);
+        return -1;
+    }
+
+    int n = table ? table->n : 0;
+    struct slab_table *t = (struct slab_table *)malloc(sizeof(struct slab_table) + (n + 1) * sizeof(struct slab *));
+    int j = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (j == i && (uintptr_t)table->slabs[i]->base > (uintptr_t)s->base)
+            t->slabs[j++] = s;
+        t->slabs[j++] = table->slabs[i];
+    }
+    if (j == n)
+        t->slabs[j] = s;
+    t->n = n + 1;
+    __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+
+    for (size_t i = per_slab; i-- > 0;)
+        push_free(s->base + i * stride);
+    return 0;
+}
+
+void slab_init(size_t size, int prealloc)
+{
+    buf_size = size;
+    stride = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    per_slab = stride >= SLAB_BYTES ? 1 : SLAB_BYTES / stride;
+
+    //faulted in now rather than on the first frames
+    pthread_mutex_lock(&slab_mutex);
+    while (idle < (unsigned long)prealloc && slab_grow() == 0)
+        memset(table->slabs[table->n - 1]->base, 0, per_slab * stride);
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+unsigned char *slab_alloc(size_t n)
+{
+    if (buf_size == 0 || n != buf_size)
+    {
+        __atomic_add_fetch(&mallocs, 1, __ATOMIC_RELAXED);
+        return (unsigned char *)malloc(n ? n : 1);
+    }
+
+    pthread_mutex_lock(&slab_mutex);
+    if (free_list == NULL && slab_grow() == -1)
+    {
+        pthread_mutex_unlock(&slab_mutex);
+        return NULL;
+    }
+    unsigned char *b = free_list;
+    memcpy(&free_list, b, sizeof(free_list));
+    idle--;
+    pthread_mutex_unlock(&slab_mutex);
+
+    size_t i;
+    struct slab *s = slab_of(b, &i);
+    __atomic_store_n(&s->refs[i], 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+unsigned char *slab_zalloc(size_t n)
+{
+    unsigned char *b = slab_alloc(n);
+    if (b)
+        memset(b, 0, n);
+    return b;
+}
+
+unsigned char *slab_ref(void *p)
+{
+    size_t i;
+    struct slab *s = slab_of(p, &i);
+    if (s)
+        __atomic_add_fetch(&s->refs[i], 1, __ATOMIC_RELAXED);
+    return (unsigned char *)p;
+}
+
+void slab_free(void *p)
+{
+    size_t i;
+    struct slab *s = slab_of(p, &i);
+    if (s == NULL)
+    {
+        free(p);
+        return;
+    }
+    //the other holders' writes are done before the buffer is handed out again
+    if (__atomic_sub_fetch(&s->refs[i], 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    pthread_mutex_lock(&slab_mutex);
+    push_free((unsigned char *)p);
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+void slab_get_stats(struct slab_stats *st)
+{
+    pthread_mutex_lock(&slab_mutex);
+    st->slabs = table ? table->n : 0;
+    st->bufs = st->slabs * per_slab;
+    st->idle = idle;
+    pthread_mutex_unlock(&slab_mutex);
+    st->mallocs = __atomic_load_n(&mallocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//chunk buffers for frames, parity and repair, kept for reuse instead of going back to malloc
+//buffers are slab_size bytes, 64 byte aligned, carved SLAB_BYTES at a time from slabs that are
+//never given back, so a buffer that was used once does not fault again. Each buffer has a count
+//of holders: a sealed chunk goes to the encode job and both peer queues as one buffer, the last
+//slab_free puts it back on the free list
+//
+//slab_alloc of any other size is a plain malloc and slab_free frees it, so payloads of any
+//length can be freed the one way
+
+#define SLAB_ALIGN 64
+#define SLAB_BYTES (2 << 20) //a slab, or one buffer if chunks are larger
+
+//size of the pooled buffers, and buffers to fault in now; before any other call
+void slab_init(size_t size, int prealloc);
+
+//n bytes, pooled if n is the buffer size; one holder, contents left over, NULL out of memory
+unsigned char *slab_alloc(size_t n);
+
+//the same, zeroed
+unsigned char *slab_zalloc(size_t n);
+
+//one more holder of a pooled buffer, p is returned; p must be one, the count of others is not kept
+unsigned char *slab_ref(void *p);
+
+//a holder is done, the last puts p back, or frees it if it is not pooled; NULL is fine
+void slab_free(void *p);
+
+//for logs
+struct slab_stats
+{
+    unsigned long slabs; //carved so far
+    unsigned long bufs;  //in them
+    unsigned long idle;  //on the free list
+    unsigned long mallocs; //slab_alloc of other sizes
+};
+
+void slab_get_stats(struct slab_stats *s);
@@ -12,7 +12,21 @@ struct send_arg
     int index_tag;
     uint32_t chunk_id;
 
-    char send[CHUNK_SIZE];
+    char *send; //chunk_size, freed by proxy_send
+};
+
+//for encode workers, one data chunk to fold
+struct encode_arg
+{
+    int global; //0->local stripe, 1->global stripe
+    int gid;    //come from
+    int rid;
+    int index_tag;
+    uint32_t chunk_id;
+
+    unsigned char *chunk; //chunk_size, freed by encode_chunk
+    void *stripe;         //local_encode_st or global_encode_st, its place taken by encode_add
+    int vec_i;            //that place
 };
 
 //for middle
@@ -23,8 +37,9 @@ struct middle_arg
     int gid;
     int rid;
     uint32_t chunk_id;
+    int count; //chunks in middle, 1 for local, one per erased chunk for global
 
-    unsigned char middle[CHUNK_SIZE];
+    unsigned char *middle; //count * chunk_size, freed by middle_send
 };
 
 //for update
@@ -34,9 +49,10 @@ struct update_arg
     int global; //0->local update, 1->global update
     int gid;
     int rid;
+    int index_tag; //of the updated chunk, places it in the global stripe
     uint32_t chunk_id;
 
-    unsigned char update[CHUNK_SIZE];
+    unsigned char *update; //chunk_size, freed by update_send
 };
 
 //update ack
@@ -51,8 +67,10 @@ struct update_ack_arg
 struct gather_arg
 {
     int connfd;
+    int gid;
     int rid;
     uint32_t chunk_id;
+    uint64_t erasure; //global only, lost positions of the global stripe
 };
 
 //for normal set/get
@@ -83,6 +101,14 @@ struct local_repair_arg
     unsigned char *left_data[RACK - 1 + NODE - 1];
     unsigned char *recovery_data; //only one error
 
+    //global repair, when this rack lost more than the local parity covers
+    int global;
+    int expect;          //g-middle to wait for
+    uint64_t erasure;    //lost positions of the global stripe
+    int nerr;            //erased data chunks coming back
+    int target_row;      //row of decoded that is the failed chunk
+    unsigned char *decoded[GN - GK + 1]; //sum of own share and g-middles
+
     struct local_repair_arg *next;
 };
 
@@ -93,33 +119,46 @@ struct get_reapir_st
     char *value;
 };
 
+//the job queue is a bounded ring of queue_max_num slots that producers and workers claim with
+//a compare and swap on their own index, each slot has a sequence number that says whose turn
+//it is (Vyukov's bounded MPMC queue), so a job costs no malloc and no lock
+//a worker with nothing to do spins a while, then sleeps on a futex until a producer wakes it,
+//a producer that finds the ring full does the same until a worker takes a job
+#define THREADPOOL_SPIN 256 //tries before sleeping, none on a single cpu
+
 struct job
 {
+    alignas(64) uint64_t seq; //== index: free for the producer at it, == index + 1: full for the worker
     void *(*callback_function)(void *arg);
     void *arg;
-    struct job *next;
 };
 
 struct threadpool
 {
     int thread_num;
     int queue_max_num;
+    int spin;
 
     //job queue
-    struct job *head;
-    struct job *tail;
+    struct job *jobs;
+    alignas(64) uint64_t tail; //next slot to fill
+    alignas(64) uint64_t head; //next slot to run
 
-    pthread_t *pthreads;
-    pthread_mutex_t mutex;
-    pthread_cond_t queue_empty;
-    pthread_cond_t queue_not_empty;
-    pthread_cond_t queue_not_full;
+    //futex words, bumped before a wake so a sleeper that read the old value does not sleep
+    alignas(64) uint32_t job_seq; //jobs came, for idle workers
+    int idle;                     //workers asleep or about to be
+    alignas(64) uint32_t room_seq; //slots came free, for producers of a full ring
+    int waiting;                   //producers asleep or about to be
 
-    int queue_cur_num; //current task
+    pthread_t *pthreads;
     int queue_close;
     int pool_close;
 };
 
 struct threadpool *threadpool_init(int thread_num, int queue_max_num);
+//waits while the queue is full, -1 once the pool is closed
 int threadpool_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg);
+//the same without waiting, -1 if the queue is full
+int threadpool_try_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg);
+//waits until the queued jobs are taken, then stops the workers
 int threadpool_destroy(struct threadpool *pool);
\ No newline at end of file
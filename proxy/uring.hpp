@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.hpp"
+
+//io_uring through the raw system calls, no liburing needed
+//built when the kernel headers have it, used only if the running kernel sets a ring up
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+
+struct uring
+{
+    int fd;
+    unsigned entries;
+
+    //submission ring, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; //sqes handed out, not yet submitted
+    unsigned sq_submitted;
+
+    //completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+
+    unsigned long enters; //io_uring_enter calls, for the syscall count
+};
+
+//0, or -1 if this kernel can not set up a ring
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+
+//next free sqe, zeroed, NULL when the ring is full until the next submit
+struct io_uring_sqe *uring_sqe(struct uring *u);
+
+//hand the sqes over and wait for wait_nr completions, one system call for both
+int uring_submit(struct uring *u, unsigned wait_nr);
+
+//oldest completion, NULL if none, uring_seen once it is used
+struct io_uring_cqe *uring_peek(struct uring *u);
+void uring_seen(struct uring *u);
+
+//buffers for READ_FIXED / WRITE_FIXED, buf_index is the place in iov
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned n);
+
+#endif
@@ -33,6 +33,8 @@
 
 #define COMMAND_SIZE 100
 // #define BUFFER_SIZE 4096
+//messages with the proxies, a key and a value of up to a chunk with the words around them
+#define REQUEST_SIZE (chunk_size + 2 * COMMAND_SIZE)
 #define LISTEN_NUM 200
 
 //server
@@ -49,6 +51,9 @@ void vlog(int l, const char *fmt, ...);
 
 void print_err(const char *str, int err_no);
 
+//size of the proxies' chunks, CHUNK_SIZE until the first of them connects
+extern uint32_t chunk_size;
+
 int offset(int g, int r, int index_tag, int gid_self);
 
 double timeval_diff(struct timeval *start, struct timeval *end);
@@ -61,6 +61,10 @@ struct kv_arg
     int count;
     int fd;
     char *kv;
+
+    //-b, n requests of the same op to one proxy in one frame, kv is unused
+    int n;
+    char **batch;
 };
 
 //for repair KV
@@ -93,33 +97,46 @@ struct get_reapir_st
     char *value;
 };
 
+//the job queue is a bounded ring of queue_max_num slots that producers and workers claim with
+//a compare and swap on their own index, each slot has a sequence number that says whose turn
+//it is (Vyukov's bounded MPMC queue), so a job costs no malloc and no lock
+//a worker with nothing to do spins a while, then sleeps on a futex until a producer wakes it,
+//a producer that finds the ring full does the same until a worker takes a job
+#define THREADPOOL_SPIN 256 //tries before sleeping, none on a single cpu
+
 struct job
 {
+    alignas(64) uint64_t seq; //== index: free for the producer at it, == index + 1: full for the worker
     void *(*callback_function)(void *arg);
     void *arg;
-    struct job *next;
 };
 
 struct threadpool
 {
     int thread_num;
     int queue_max_num;
+    int spin;
 
     //job queue
-    struct job *head;
-    struct job *tail;
+    struct job *jobs;
+    alignas(64) uint64_t tail; //next slot to fill
+    alignas(64) uint64_t head; //next slot to run
 
-    pthread_t *pthreads;
-    pthread_mutex_t mutex;
-    pthread_cond_t queue_empty;
-    pthread_cond_t queue_not_empty;
-    pthread_cond_t queue_not_full;
+    //futex words, bumped before a wake so a sleeper that read the old value does not sleep
+    alignas(64) uint32_t job_seq; //jobs came, for idle workers
+    int idle;                     //workers asleep or about to be
+    alignas(64) uint32_t room_seq; //slots came free, for producers of a full ring
+    int waiting;                   //producers asleep or about to be
 
-    int queue_cur_num; //current task
+    pthread_t *pthreads;
     int queue_close;
     int pool_close;
 };
 
 struct threadpool *threadpool_init(int thread_num, int queue_max_num);
+//waits while the queue is full, -1 once the pool is closed
 int threadpool_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg);
+//the same without waiting, -1 if the queue is full
+int threadpool_try_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg);
+//waits until the queued jobs are taken, then stops the workers
 int threadpool_destroy(struct threadpool *pool);
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "common.hpp"
 
+uint32_t chunk_size = CHUNK_SIZE;
+
 //pthread_mutex_t mutex;
 //LEVEL is high, show less
 void vlog(int l, const char *fmt, ...)
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//every message between proxies, and between the requestor and a proxy, is one frame:
+//a 16 byte head in network byte order, then length bytes of payload
+//
+//  0       1       2       3       4               8               12              16
+//  opcode  gid     rid     index   chunk_id        request_id      length
+
+enum frame_op
+{
+    OP_NONE = 0,
+    OP_CONN,            //first frame of a connection, payload: uint32 chunk_size
+    //proxy mesh
+    OP_L_ENCODE,        //data chunk for the local parity
+    OP_G_ENCODE,        //data chunk for the global parity
+    OP_L_GATHER_MIDDLE, //ask a rack for its local repair share
+    OP_G_GATHER_MIDDLE, //ask a rack for its global repair share, payload: uint64 erasure
+    OP_L_MIDDLE,        //local repair share, one chunk
+    OP_G_MIDDLE,        //global repair share, one chunk per erased position
+    OP_L_UPDATE,        //delta for the local parity
+    OP_G_UPDATE,        //delta for the global parities
+    OP_L_UPDATE_ACK,
+    OP_G_UPDATE_ACK,
+    //requestor link
+    OP_SET,    //payload: key '\0' value
+    OP_GET,    //payload: key
+    OP_UPDATE, //payload: key '\0' value
+    OP_REPLY,  //payload: text of the answer, request_id of the request
+    //batches, chunk_id is the number of entries, see frame_entry
+    OP_MSET,    //entries: key, value
+    OP_MGET,    //entries: key
+    OP_MUPDATE, //entries: key, value
+    OP_BATCH_REPLY, //one entry a key in request order: status, value for mget
+    //proxy mesh again, after the others so their numbers stay
+    OP_CREDIT, //chunk_id credits of traffic class index_tag given back, see flow.hpp in the proxy
+    OP_MAX
+};
+
+#define FRAME_HEAD_SIZE 16
+
+//opcode bit of a frame whose payload is compressed, see pack.hpp in the proxy
+#define FRAME_PACKED 0x80
+
+//entries of a batch payload, each a 7 byte head in network byte order then the bytes
+//
+//  0       1               3               7
+//  status  key_length      value_length    key, value
+#define FRAME_ENTRY_HEAD 7
+#define FRAME_BATCH_MAX 1024        //entries a batch
+#define FRAME_BATCH_BYTES (8 << 20) //payload of a batch
+
+//status of a key in OP_BATCH_REPLY
+#define ENTRY_OK 0
+#define ENTRY_NOK 1
+#define ENTRY_BUSY 2 //turned away, the proxy is behind on its peers
+
+struct frame_head
+{
+    uint8_t opcode;
+    uint8_t gid;       //sender
+    uint8_t rid;       //sender
+    uint8_t index_tag;
+    uint32_t chunk_id;
+    uint32_t request_id;
+    uint32_t length;   //payload bytes after the head
+};
+
+struct frame_entry
+{
+    uint8_t status; //0 in requests
+    uint16_t key_length;
+    uint32_t value_length;
+    const unsigned char *key;
+    const unsigned char *value;
+};
+
+//"l-encode", for logs
+const char *frame_op_name(int opcode);
+
+//head ==> 16 bytes on the wire
+void frame_pack(const struct frame_head *head, unsigned char *out);
+
+//16 bytes on the wire ==> head
+void frame_unpack(const unsigned char *in, struct frame_head *head);
+
+//write all of iov, short writes move the window forward, iov is used up
+//0 or -1 on error or closed peer
+int frame_writev(int fd, struct iovec *iov, int iovcnt);
+
+//head and payload in one sendmsg, 0 or -1 on error or closed peer
+int frame_send(int fd, const struct frame_head *head, const void *payload);
+
+//payload gathered from iov, head->length is their sum
+int frame_sendv(int fd, const struct frame_head *head, const struct iovec *iov, int iovcnt);
+
+//write e at out, FRAME_ENTRY_HEAD + key_length + value_length bytes, returns the end
+unsigned char *frame_entry_put(unsigned char *out, const struct frame_entry *e);
+
+//read the entry at *in and move *in past it, key and value point into the payload
+//-1 if it runs past end
+int frame_entry_next(const unsigned char **in, const unsigned char *end, struct frame_entry *e);
+
+//0 or -1 on error or closed peer
+int frame_recv_head(int fd, struct frame_head *head);
+
+//len bytes of payload
+int frame_recv(int fd, void *buf, size_t len);
+
+//drop len bytes of payload, for frames nobody handles
+int frame_skip(int fd, size_t len);
@@ -1,5 +1,6 @@
 #include "common.hpp"
 #include "thread.hpp"
+#include "frame.hpp"
 
 enum status
 {
@@ -22,6 +23,43 @@ struct threadpool *repair;
 static uint32_t op_load = 0, op_test = 0;
 int count = 0;
 
+//requests in flight on one proxy connection, matched to their replies by request_id
+#define PIPE_MAX 256
+struct pipe_slot
+{
+    int used;
+    uint32_t request_id;
+    struct timeval begin;
+};
+
+struct pipeline
+{
+    int fd;
+    int gid;
+    int rid;
+
+    pthread_mutex_t send_mutex; //one frame on the wire at a time
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; //a slot is free, or a reply is in
+    int inflight;
+    struct pipe_slot slot[PIPE_MAX];
+    int broken; //the proxy is gone, no more replies
+
+    unsigned long issued; //handed to work, for the end of a run
+    unsigned long done;
+    unsigned long keys; //answered in done, more than done with batches
+    unsigned long busy; //of keys, turned away by a proxy behind on its peers
+    double latency; //us, sum over done
+
+    struct kv_arg *batch; //filled by handle, sent when full or the op changes
+};
+
+struct pipeline pipes[GROUP][RACK];
+//-d, requests in flight a proxy, 1 waits for each reply before the next request
+int pipe_depth = 1;
+//-b, requests a frame, 1 sends each on its own
+int batch_size = 1;
+
 static void request_init()
 {
     // FILE *fin_para;
@@ -146,91 +184,285 @@ static void request_init()
     fprintf(stderr, "\nqueries_init...done\n\n");
 }
 
-//deal with KV
-void *work(void *arg)
+static struct pipeline *pipe_of(int fd)
 {
-    char send_buf[CHUNK_SIZE];
-    char receive_buf[CHUNK_SIZE];
-    memset(send_buf, 0, CHUNK_SIZE);
-
-    struct kv_arg *kk = (struct kv_arg *)arg;
-
-    int fd = kk->fd;
-
-    char op[10];
-    sscanf(kk->kv, "%s", op);
-    strcpy(send_buf, kk->kv);
+    for (int i = 0; i < GROUP; i++)
+    {
+        for (int j = 0; j < RACK; j++)
+        {
+            if (pipes[i][j].fd == fd)
+                return &pipes[i][j];
+        }
+    }
+    return NULL;
+}
 
-    enum status status_now = conn_write;
+//replies of one proxy, in the order it finishes them
+void *pipe_read(void *arg)
+{
+    struct pipeline *p = (struct pipeline *)arg;
 
-    while (status_now != conn_close)
+    while (1)
     {
-        //char key[100];
-        switch (status_now)
-        {
-        case conn_read:
+        struct frame_head reply;
+        int ret = frame_recv_head(p->fd, &reply);
+        //a batch reply has one entry a key, with the values of an mget
+        int batch = reply.opcode == OP_BATCH_REPLY;
+        char *receive_buf = NULL;
+        if (-1 != ret && (reply.opcode == OP_REPLY || batch) && reply.length < (batch ? FRAME_BATCH_BYTES : REQUEST_SIZE))
         {
-            //receive message
-            memset(receive_buf, 0, CHUNK_SIZE);
-            int ret = recv(fd, receive_buf, CHUNK_SIZE, 0);
-            if (-1 == ret)
-            {
-                print_err("recv failed", errno);
-            }
-            else
+            receive_buf = (char *)malloc(reply.length + 1);
+            if (-1 == frame_recv(p->fd, receive_buf, reply.length))
             {
-                VERBOSE(4, "\t[GET request ack]<={%s}\n", receive_buf);
+                free(receive_buf);
+                receive_buf = NULL;
             }
-
-            status_now = conn_close;
-            break;
         }
-        case conn_write:
+        if (receive_buf == NULL)
         {
-            //send message
-            //getchar();
-            //scanf("%[^\n]",send_buf);
-            //getchar();
+            print_err("recv failed", errno);
+            pthread_mutex_lock(&p->mutex);
+            p->broken = 1;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
 
-            //VERBOSE(4,"s=%s\n",send_buf);
-            int ret = send(fd, send_buf, CHUNK_SIZE, 0);
-            if (-1 == ret)
-                print_err("send failed", errno);
-            else
-                VERBOSE(4, "COUNT: %d, [SEND request]=>{kv}\n", kk->count);
+        receive_buf[reply.length] = '\0';
 
-            if (strncmp(op, "set", 3) == 0) //set
-            {
-                status_now = conn_read;
-            }
-            else if (strncmp(op, "get", 3) == 0) //get
-            {
-                status_now = conn_read;
-            }
-            else if (strncmp(op, "update", 6) == 0) //get
+        int keys = 1, nok = 0, busy = 0;
+        if (batch)
+        {
+            const unsigned char *in = (const unsigned char *)receive_buf, *end = in + reply.length;
+            struct frame_entry e;
+            for (keys = 0; keys < (int)reply.chunk_id && -1 != frame_entry_next(&in, end, &e); keys++)
             {
-                status_now = conn_read;
+                nok += e.status != ENTRY_OK;
+                busy += e.status == ENTRY_BUSY;
             }
+        }
+        else
+            busy = strstr(receive_buf, "} BUSY") != NULL;
 
-            break;
+        struct timeval end;
+        gettimeofday(&end, NULL);
+        pthread_mutex_lock(&p->mutex);
+        int i;
+        for (i = 0; i < PIPE_MAX; i++)
+        {
+            if (p->slot[i].used && p->slot[i].request_id == reply.request_id)
+                break;
         }
-        case conn_close:
+        if (i == PIPE_MAX)
         {
-            break;
+            pthread_mutex_unlock(&p->mutex);
+            printf("reply %u of (%d,%d) matches no request\n", reply.request_id, p->gid, p->rid);
+            free(receive_buf);
+            continue;
         }
+        p->slot[i].used = 0;
+        p->inflight--;
+        p->done++;
+        p->keys += keys;
+        p->busy += busy;
+        p->latency += (end.tv_sec - p->slot[i].begin.tv_sec) * 1e6 + (end.tv_usec - p->slot[i].begin.tv_usec);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+
+        if (batch)
+        {
+            VERBOSE(4, "\t[GET batch ack %u]<={%d keys, %d nok}\n", reply.request_id, keys, nok);
+        }
+        else
+        {
+            VERBOSE(4, "\t[GET request ack %u]<={%s}\n", reply.request_id, receive_buf);
         }
+        free(receive_buf);
+    }
+    return NULL;
+}
+
+static void pipe_init(struct pipeline *p, int fd, int gid, int rid)
+{
+    p->fd = fd;
+    p->gid = gid;
+    p->rid = rid;
+    pthread_mutex_init(&p->send_mutex, NULL);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, pipe_read, p) != 0)
+        print_err("reply thread create failed", errno);
+    else
+        pthread_detach(tid);
+}
+
+//"op key value" ==> opcode, key and value point into kv
+static int kv_parse(const char *kv, const char **key, size_t *key_len, const char **value)
+{
+    char op[10] = {0};
+    sscanf(kv, "%9s", op);
+    *key = strchr(kv, ' ');
+    *key = *key ? *key + 1 : "";
+    *value = strchr(*key, ' ');
+    *key_len = *value ? (size_t)(*value - *key) : strlen(*key);
+    *value = *value ? *value + 1 : "";
+
+    if (strncmp(op, "set", 3) == 0) //set
+        return OP_SET;
+    else if (strncmp(op, "get", 3) == 0) //get
+        return OP_GET;
+    else if (strncmp(op, "update", 6) == 0) //update
+        return OP_UPDATE;
+    return OP_NONE;
+}
+
+static int kv_op(const char *kv)
+{
+    const char *key, *value;
+    size_t key_len;
+    return kv_parse(kv, &key, &key_len, &value);
+}
+
+//the n requests of kk->batch ==> one frame of entries, key and value of each
+static unsigned char *batch_pack(struct kv_arg *kk, struct frame_head *head)
+{
+    const char *key, *value;
+    size_t key_len;
+    int op = kv_parse(kk->batch[0], &key, &key_len, &value);
+    head->opcode = op == OP_SET ? OP_MSET : op == OP_GET ? OP_MGET : op == OP_UPDATE ? OP_MUPDATE : OP_NONE;
+    head->chunk_id = kk->n;
+
+    size_t length = 0;
+    for (int i = 0; i < kk->n; i++)
+    {
+        kv_parse(kk->batch[i], &key, &key_len, &value);
+        length += FRAME_ENTRY_HEAD + key_len + (op == OP_GET ? 0 : strlen(value));
     }
+    unsigned char *payload = (unsigned char *)malloc(length ? length : 1);
+    unsigned char *out = payload;
+    for (int i = 0; i < kk->n; i++)
+    {
+        kv_parse(kk->batch[i], &key, &key_len, &value);
+        struct frame_entry e = {0, (uint16_t)key_len, (uint32_t)(op == OP_GET ? 0 : strlen(value)),
+                                (const unsigned char *)key, (const unsigned char *)value};
+        out = frame_entry_put(out, &e);
+    }
+    head->length = length;
+    return payload;
+}
+
+//deal with KV
+//sends once the proxy has fewer than pipe_depth requests in flight, the reply is matched by pipe_read
+void *work(void *arg)
+{
+    struct kv_arg *kk = (struct kv_arg *)arg;
+
+    int fd = kk->fd;
+    struct pipeline *p = pipe_of(fd);
+
+    //"op key value" ==> one frame, payload key '\0' value
+    const char *key, *value;
+    size_t key_len;
+    struct frame_head head = {OP_NONE, 0, 0, 0, 0, (uint32_t)kk->count, 0};
+    struct iovec iov[3];
+    int parts = 1;
+    unsigned char *payload = NULL;
+    if (kk->batch)
+    {
+        payload = batch_pack(kk, &head);
+        iov[0].iov_base = payload;
+        iov[0].iov_len = head.length;
+    }
+    else
+    {
+        head.opcode = kv_parse(kk->kv, &key, &key_len, &value);
+        iov[0].iov_base = (void *)key;
+        iov[0].iov_len = key_len;
+        iov[1].iov_base = (void *)"";
+        iov[1].iov_len = 1;
+        iov[2].iov_base = (void *)value;
+        iov[2].iov_len = strlen(value);
+        parts = (head.opcode == OP_GET) ? 1 : 3;
+        for (int i = 0; i < parts; i++)
+            head.length += iov[i].iov_len;
+        //the proxy drops the connection on a request its chunk cannot take
+        if (head.length >= REQUEST_SIZE)
+        {
+            VERBOSE(4, "COUNT: %d, request of %u bytes is over the chunk size %u\n", kk->count, head.length, chunk_size);
+            head.opcode = OP_NONE;
+        }
+    }
+
+    if (p == NULL)
+    {
+        free(payload);
+        free(kk->batch);
+        free(kk);
+        return NULL;
+    }
+
+    //a slot for the reply
+    pthread_mutex_lock(&p->mutex);
+    while (p->inflight >= pipe_depth && !p->broken)
+        pthread_cond_wait(&p->cond, &p->mutex);
+    if (head.opcode == OP_NONE || p->broken)
+    {
+        //no reply will come
+        p->issued--;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+        free(payload);
+        free(kk->batch);
+        free(kk);
+        return NULL;
+    }
+    int i = 0;
+    while (p->slot[i].used)
+        i++;
+    p->slot[i].used = 1;
+    p->slot[i].request_id = head.request_id;
+    gettimeofday(&p->slot[i].begin, NULL);
+    p->inflight++;
+    pthread_mutex_unlock(&p->mutex);
+
+    //send message
+    pthread_mutex_lock(&p->send_mutex);
+    int ret = frame_sendv(fd, &head, iov, parts);
+    pthread_mutex_unlock(&p->send_mutex);
+    if (-1 == ret)
+        print_err("send failed", errno);
+    else
+        VERBOSE(4, "COUNT: %d, [SEND request]=>{kv}\n", kk->count);
+
+    free(payload);
+    free(kk->batch);
+    free(kk);
+    return NULL;
+}
+
+//one more frame for work, counted so handle can wait for its reply
+static void issue(struct pipeline *p, struct kv_arg *kk)
+{
+    if (p)
+    {
+        pthread_mutex_lock(&p->mutex);
+        p->issued++;
+        pthread_mutex_unlock(&p->mutex);
+    }
+    threadpool_add_job(pool, work, (void *)kk);
 }
 
 //distribute tasks
 void *handle(void *args)
 {
+    struct timeval begin, end;
+    gettimeofday(&begin, NULL);
+    int first = count;
+
     while (count < op_load + 5)
     {
-        struct kv_arg *kk = (struct kv_arg *)calloc(1, sizeof(struct kv_arg));
-        kk->count = count;
-        kk->kv = request[count];
-
         char key[100];
         //distributed by sum of key
         sscanf(request[count], "%*s %s", key);
@@ -239,24 +471,118 @@ void *handle(void *args)
         {
             sum = sum + key[i];
         }
+        int fd;
         if (strcmp(key, "user6284781860667377211") == 0)
         {
-            kk->fd = connfd_list[0][0];
+            fd = connfd_list[0][0];
         }
         else
         {
             printf("sum=%d, g=%d, r=%d\n", sum, (sum % (GROUP * RACK)) / RACK, (sum % (GROUP * RACK)) - RACK * ((sum % (GROUP * RACK)) / RACK));
-            kk->fd = connfd_list[(sum % (GROUP * RACK)) / RACK][(sum % (GROUP * RACK)) - RACK * ((sum % (GROUP * RACK)) / RACK)];
+            fd = connfd_list[(sum % (GROUP * RACK)) / RACK][(sum % (GROUP * RACK)) - RACK * ((sum % (GROUP * RACK)) / RACK)];
+        }
+        struct pipeline *p = pipe_of(fd);
+
+        if (batch_size == 1 || p == NULL)
+        {
+            struct kv_arg *kk = (struct kv_arg *)calloc(1, sizeof(struct kv_arg));
+            kk->count = count;
+            kk->fd = fd;
+            kk->kv = request[count];
+            issue(p, kk);
+            count++;
+            continue;
         }
 
-        threadpool_add_job(pool, work, (void *)kk);
+        //a batch holds one op, the requests of a proxy keep their order
+        if (p->batch && kv_op(p->batch->batch[0]) != kv_op(request[count]))
+        {
+            issue(p, p->batch);
+            p->batch = NULL;
+        }
+        if (p->batch == NULL)
+        {
+            p->batch = (struct kv_arg *)calloc(1, sizeof(struct kv_arg));
+            p->batch->count = count; //request_id of the batch
+            p->batch->fd = fd;
+            p->batch->batch = (char **)malloc(batch_size * sizeof(char *));
+        }
+        p->batch->batch[p->batch->n++] = request[count];
+        if (p->batch->n == batch_size)
+        {
+            issue(p, p->batch);
+            p->batch = NULL;
+        }
         count++;
     }
+
+    //the last batches are not full
+    for (int i = 0; i < GROUP; i++)
+    {
+        for (int j = 0; j < RACK; j++)
+        {
+            if (pipes[i][j].batch)
+                issue(&pipes[i][j], pipes[i][j].batch);
+            pipes[i][j].batch = NULL;
+        }
+    }
+
+    //every reply is in
+    unsigned long done = 0, keys = 0, busy = 0;
+    double latency = 0;
+    for (int i = 0; i < GROUP; i++)
+    {
+        for (int j = 0; j < RACK; j++)
+        {
+            struct pipeline *p = &pipes[i][j];
+            if (p->fd <= 0)
+                continue;
+            pthread_mutex_lock(&p->mutex);
+            while (p->done < p->issued && !p->broken)
+                pthread_cond_wait(&p->cond, &p->mutex);
+            done += p->done;
+            keys += p->keys;
+            busy += p->busy;
+            latency += p->latency;
+            pthread_mutex_unlock(&p->mutex);
+        }
+    }
+    gettimeofday(&end, NULL);
+    double time = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1e6;
+    fprintf(stderr, "\n%d requests, %lu replies, %lu keys, %lu busy, depth %d, batch %d, %.2f s, %.0f ops/s, %.1f us a reply\n", count - first, done, keys, busy, pipe_depth, batch_size, time, keys / time, done ? latency / done : 0);
     //exit(-1);
+    return NULL;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size <= 0 || batch_size > FRAME_BATCH_MAX)
+            {
+                printf("bad batch size %s, need 1..%d\n", optarg, FRAME_BATCH_MAX);
+                exit(-1);
+            }
+            break;
+        case 'd':
+            pipe_depth = atoi(optarg);
+            if (pipe_depth <= 0 || pipe_depth > PIPE_MAX)
+            {
+                printf("bad pipeline depth %s, need 1..%d\n", optarg, PIPE_MAX);
+                exit(-1);
+            }
+            break;
+        default:
+            printf("usage: %s [-b batch_size] [-d pipeline_depth]\n", argv[0]);
+            exit(-1);
+        }
+    }
+
     //load memcached
     request_init();
 
@@ -310,18 +636,28 @@ int main()
         VERBOSE(4, "Cport = %d, caddr = %s\n", ntohs(caddr.sin_port), inet_ntoa(caddr.sin_addr));
 
         int gid, rid;
-        char receive_buf[COMMAND_SIZE] = {0};
-        ret = recv(connfd, receive_buf, COMMAND_SIZE, 0);
+        struct frame_head head;
+        ret = frame_recv_head(connfd, &head);
         if (-1 == ret)
         {
             print_err("recv failed", errno);
         }
-        VERBOSE(4, "\t[GET connect]=>{%s}\n", receive_buf);
-        if (strncmp(receive_buf, "CONN", 4) == 0)
+        else
+        {
+            VERBOSE(4, "\t[GET connect]=>{%s}\n", frame_op_name(head.opcode));
+        }
+        //the payload is the chunk size of the proxies, requests and replies are sized by it
+        uint32_t wire = 0;
+        if (-1 != ret && head.opcode == OP_CONN && head.length == sizeof(wire) && -1 == frame_recv(connfd, &wire, sizeof(wire)))
+            ret = -1;
+        if (-1 != ret && head.opcode == OP_CONN && head.length == sizeof(wire) && head.gid < GROUP && head.rid < RACK)
         {
-            sscanf(receive_buf, "%*s %d %d", &gid, &rid);
+            chunk_size = ntohl(wire);
+            gid = head.gid;
+            rid = head.rid;
             VERBOSE(4, "\t[MANAGE CONN gid=%d, rid=%d]\n", gid, rid);
             connfd_list[gid][rid] = connfd;
+            pipe_init(&pipes[gid][rid], connfd, gid, rid);
             VERBOSE(4, "Accept: ");
             for (int i = 0; i < GROUP; i++)
             {
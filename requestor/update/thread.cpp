@@ -1,85 +1,217 @@
 #include "thread.hpp"
 
-static void *threadpool_function(void *arg)
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void futex_wait(uint32_t *addr, uint32_t val)
 {
-    struct threadpool *pool = (struct threadpool *)arg;
-    struct job *pjob = NULL;
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static int closed(struct threadpool *pool)
+{
+    return __atomic_load_n(&pool->queue_close, __ATOMIC_ACQUIRE) || __atomic_load_n(&pool->pool_close, __ATOMIC_ACQUIRE);
+}
+
+//a job into the ring, -1 if it is full
+static int ring_put(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg)
+{
+    uint64_t pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
     while (1)
     {
-        pthread_mutex_lock(&(pool->mutex));
-        while ((pool->queue_cur_num == 0) && !pool->pool_close)
-        {
-            pthread_cond_wait(&(pool->queue_not_empty), &(pool->mutex));
-        }
-        if (pool->pool_close)
+        struct job *pjob = &pool->jobs[pos % pool->queue_max_num];
+        int64_t d = (int64_t)(__atomic_load_n(&pjob->seq, __ATOMIC_ACQUIRE) - pos);
+        if (d == 0)
         {
-            pthread_mutex_unlock(&(pool->mutex));
-            pthread_exit(NULL);
-        }
-        pool->queue_cur_num--;
-        pjob = pool->head;
-        if (pool->queue_cur_num == 0)
-        {
-            pool->head = pool->tail = NULL;
+            //a failed swap loads the tail into pos
+            if (__atomic_compare_exchange_n(&pool->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                pjob->callback_function = callback_function;
+                pjob->arg = arg;
+                __atomic_store_n(&pjob->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
         }
+        else if (d < 0)
+            return -1; //the job of the last round is not taken yet
         else
+            pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+    }
+}
+
+//the next job out of the ring, 0 if it is empty
+static int ring_take(struct threadpool *pool, struct job *out)
+{
+    uint64_t pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    while (1)
+    {
+        struct job *pjob = &pool->jobs[pos % pool->queue_max_num];
+        int64_t d = (int64_t)(__atomic_load_n(&pjob->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (d == 0)
         {
-            pool->head = pjob->next;
+            if (__atomic_compare_exchange_n(&pool->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                out->callback_function = pjob->callback_function;
+                out->arg = pjob->arg;
+                //free for the producer of the next round
+                __atomic_store_n(&pjob->seq, pos + pool->queue_max_num, __ATOMIC_RELEASE);
+                return 1;
+            }
         }
-        if (pool->queue_cur_num == 0)
+        else if (d < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    }
+}
+
+//take one off the count of sleepers, 0 if there was none
+static int sleeper_take(int *sleepers)
+{
+    int n = __atomic_load_n(sleepers, __ATOMIC_RELAXED);
+    while (n > 0 && !__atomic_compare_exchange_n(sleepers, &n, n - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return n > 0;
+}
+
+//after a put or a take: wake one sleeper on seq if there is any
+//the waker takes it off the count, so the next puts do not wake it again before it runs
+//the fence pairs with the one a sleeper has between counting itself and looking at the ring
+static void wake_one(uint32_t *seq, int *sleepers)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (sleeper_take(sleepers))
+    {
+        __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+        futex_wake(seq, 1);
+    }
+}
+
+//jobs in the ring, about
+static uint64_t queued(struct threadpool *pool)
+{
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    return __atomic_load_n(&pool->tail, __ATOMIC_RELAXED) - head;
+}
+
+//after a take: a producer that waits for room is woken once the ring is down to half, not on
+//every take, it fills the ring in one go and wakes the next one if room is left
+static void room_wake(struct threadpool *pool)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->waiting, __ATOMIC_RELAXED) > 0 && queued(pool) <= (uint64_t)pool->queue_max_num / 2)
+        wake_one(&pool->room_seq, &pool->waiting);
+}
+
+//the next job for a worker, spinning and then sleeping while there is none, 0 once the pool is closed
+static int threadpool_next(struct threadpool *pool, struct job *pjob)
+{
+    while (1)
+    {
+        for (int i = 0; i <= pool->spin; i++)
         {
-            pthread_cond_signal(&(pool->queue_empty));
+            if (ring_take(pool, pjob))
+            {
+                room_wake(pool);
+                return 1;
+            }
+            if (__atomic_load_n(&pool->pool_close, __ATOMIC_ACQUIRE))
+                return 0;
+            cpu_relax();
         }
-        if (pool->queue_cur_num < pool->queue_max_num)
+
+        uint32_t seq = __atomic_load_n(&pool->job_seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        //a job put before idle went up is seen here, one put after it bumps job_seq
+        if (ring_take(pool, pjob))
         {
-            pthread_cond_broadcast(&(pool->queue_not_full));
+            //off idle again, unless a producer already took it off for this job
+            sleeper_take(&pool->idle);
+            room_wake(pool);
+            return 1;
         }
-        pthread_mutex_unlock(&(pool->mutex));
+        //the producer that wakes it takes it off idle
+        if (!__atomic_load_n(&pool->pool_close, __ATOMIC_ACQUIRE))
+            futex_wait(&pool->job_seq, seq);
+    }
+}
 
-        (*(pjob->callback_function))(pjob->arg);
-        free(pjob);
-        pjob = NULL;
+static void *threadpool_function(void *arg)
+{
+    struct threadpool *pool = (struct threadpool *)arg;
+    struct job pjob;
+    while (threadpool_next(pool, &pjob))
+    {
+        (*(pjob.callback_function))(pjob.arg);
     }
+    pthread_exit(NULL);
 }
 
-int threadpool_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg)
+static int threadpool_put_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg, int wait)
 {
     assert(pool != NULL);
     assert(callback_function != NULL);
     assert(arg != NULL);
 
-    pthread_mutex_lock(&(pool->mutex));
-    while ((pool->queue_cur_num == pool->queue_max_num) && !(pool->queue_close || pool->pool_close))
+    int slept = 0;
+    while (!closed(pool))
     {
-        pthread_cond_wait(&(pool->queue_not_full), &(pool->mutex));
-    }
-    if (pool->queue_close || pool->pool_close)
-    {
-        pthread_mutex_unlock(&(pool->mutex));
-        return -1;
-    }
-    struct job *pjob = (struct job *)malloc(sizeof(struct job));
-    if (NULL == pjob)
-    {
-        pthread_mutex_unlock(&(pool->mutex));
-        return -1;
-    }
-    pjob->callback_function = callback_function;
-    pjob->arg = arg;
-    pjob->next = NULL;
-    if (pool->head == NULL)
-    {
-        pool->head = pool->tail = pjob;
-        pthread_cond_broadcast(&(pool->queue_not_empty));
-    }
-    else
-    {
-        pool->tail->next = pjob;
-        pool->tail = pjob;
+        for (int i = 0; i <= (wait ? pool->spin : 0); i++)
+        {
+            if (ring_put(pool, callback_function, arg) == 0)
+            {
+                wake_one(&pool->job_seq, &pool->idle);
+                //woken for room, the next waiting producer gets what is left
+                if (slept && queued(pool) < (uint64_t)pool->queue_max_num)
+                    wake_one(&pool->room_seq, &pool->waiting);
+                return 0;
+            }
+            cpu_relax();
+        }
+        if (!wait)
+            return -1;
+
+        //full, as in threadpool_next with the roles swapped
+        uint32_t seq = __atomic_load_n(&pool->room_seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&pool->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_put(pool, callback_function, arg) == 0)
+        {
+            sleeper_take(&pool->waiting);
+            wake_one(&pool->job_seq, &pool->idle);
+            return 0;
+        }
+        if (!closed(pool))
+            futex_wait(&pool->room_seq, seq);
+        slept = 1;
     }
-    pool->queue_cur_num++;
-    pthread_mutex_unlock(&(pool->mutex));
-    return 0;
+    return -1;
+}
+
+int threadpool_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg)
+{
+    return threadpool_put_job(pool, callback_function, arg, 1);
+}
+
+int threadpool_try_add_job(struct threadpool *pool, void *(*callback_function)(void *arg), void *arg)
+{
+    return threadpool_put_job(pool, callback_function, arg, 0);
 }
 
 struct threadpool *threadpool_init(int thread_num, int queue_max_num)
@@ -87,36 +219,27 @@ struct threadpool *threadpool_init(int thread_num, int queue_max_num)
     struct threadpool *pool = NULL;
     do
     {
-        pool = (struct threadpool *)malloc(sizeof(struct threadpool));
+        pool = (struct threadpool *)aligned_alloc(64, sizeof(struct threadpool));
         if (NULL == pool)
         {
             printf("failed to malloc threadpool!\n");
             break;
         }
+        memset(pool, 0, sizeof(struct threadpool));
         pool->thread_num = thread_num;
-        pool->queue_max_num = queue_max_num;
-        pool->queue_cur_num = 0;
-        pool->head = NULL;
-        pool->tail = NULL;
-        if (pthread_mutex_init(&(pool->mutex), NULL))
-        {
-            printf("failed to init mutex!\n");
-            break;
-        }
-        if (pthread_cond_init(&(pool->queue_empty), NULL))
-        {
-            printf("failed to init queue_empty!\n");
-            break;
-        }
-        if (pthread_cond_init(&(pool->queue_not_empty), NULL))
+        //a slot of one round is told from one of the next by its sequence, which takes two slots
+        pool->queue_max_num = queue_max_num > 2 ? queue_max_num : 2;
+        //spinning only keeps the thread it waits for off a single cpu
+        pool->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? THREADPOOL_SPIN : 0;
+        pool->jobs = (struct job *)aligned_alloc(64, sizeof(struct job) * pool->queue_max_num);
+        if (NULL == pool->jobs)
         {
-            printf("failed to init queue_not_empty!\n");
+            printf("failed to malloc jobs!\n");
             break;
         }
-        if (pthread_cond_init(&(pool->queue_not_full), NULL))
+        for (int i = 0; i < pool->queue_max_num; i++)
         {
-            printf("failed to init queue_not_full!\n");
-            break;
+            pool->jobs[i].seq = i;
         }
         pool->pthreads = (pthread_t *)malloc(sizeof(pthread_t) * thread_num);
         if (NULL == pool->pthreads)
@@ -124,8 +247,6 @@ struct threadpool *threadpool_init(int thread_num, int queue_max_num)
             printf("failed to malloc pthreads!\n");
             break;
         }
-        pool->queue_close = 0;
-        pool->pool_close = 0;
         int i;
         for (i = 0; i < pool->thread_num; ++i)
         {
@@ -141,35 +262,30 @@ struct threadpool *threadpool_init(int thread_num, int queue_max_num)
 int threadpool_destroy(struct threadpool *pool)
 {
     assert(pool != NULL);
-    pthread_mutex_lock(&(pool->mutex));
-    if (pool->queue_close || pool->pool_close)
+    if (__atomic_exchange_n(&pool->queue_close, 1, __ATOMIC_ACQ_REL) || __atomic_load_n(&pool->pool_close, __ATOMIC_ACQUIRE))
     {
-        pthread_mutex_unlock(&(pool->mutex));
         return -1;
     }
 
-    pool->queue_close = 1;
-    while (pool->queue_cur_num != 0)
+    //the workers take what is queued
+    while (__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE))
     {
-        pthread_cond_wait(&(pool->queue_empty), &(pool->mutex));
+        usleep(1000);
     }
 
-    pool->pool_close = 1;
-    pthread_mutex_unlock(&(pool->mutex));
-    pthread_cond_broadcast(&(pool->queue_not_empty));
-    pthread_cond_broadcast(&(pool->queue_not_full));
+    __atomic_store_n(&pool->pool_close, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pool->job_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool->job_seq, INT_MAX);
+    __atomic_add_fetch(&pool->room_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool->room_seq, INT_MAX);
 
     for (int i = 0; i < pool->thread_num; ++i)
     {
         pthread_join(pool->pthreads[i], NULL);
     }
 
-    pthread_mutex_destroy(&(pool->mutex));
-    pthread_cond_destroy(&(pool->queue_empty));
-    pthread_cond_destroy(&(pool->queue_not_empty));
-    pthread_cond_destroy(&(pool->queue_not_full));
-
+    free(pool->jobs);
     free(pool->pthreads);
     free(pool);
     return 0;
-}
\ No newline at end of file
+}